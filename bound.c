@@ -1,7 +1,18 @@
 /* File: bound.c
  * Author: Sanjay Kannan
  * Bounding Params: latTL lonTL latBR lonBR
- * Usage: bound src dest [bounding rectangle params]
+ * Usage: bound [options] src dest [bounding rectangle params]
+ *        bound --thumbs dir [options] src [bounding rectangle params]
+ *        bound tiles [options] src out maxZoom
+ *        bound cluster [options] src out epsMeters minPts
+ *        bound serve [options] socket src
+ *        bound coordinate port src [bounding rectangle params]
+ *        bound worker [options] host port [dest]
+ *        bound index [options] src out
+ *        bound ingest [options] dir src
+ *        bound query dir [bounding rectangle params]
+ *        bound diff [options] before after [bounding rectangle params]
+ *        bound catalog [options] src out
  * -------------------------------------------------
  * Takes the name of a folder of images as its first
  * argument and the name of a destination folder as
@@ -10,254 +21,785 @@
  * next four GPS values relative to NE, which are
  * the latitudes and longitudes of a top right and
  * bottom left corner defining a bounding rectangle.
+ *
+ * The tiles command instead counts the images of
+ * a folder per Web Mercator tile for every zoom
+ * level up to maxZoom and writes the pyramid.
+ * The cluster command groups the images of a
+ * folder into places with DBSCAN and writes
+ * each centroid with its member file names.
+ * The serve command keeps the positions of the
+ * images of a folder in memory and answers
+ * spatial queries on a Unix domain socket.
+ * The coordinate command splits the folder tree
+ * under src into one work unit per folder and
+ * hands those out to worker commands over TCP.
+ * The index command writes the position and
+ * path of every image of a folder to a file
+ * sorted by position, within a memory budget.
+ * The ingest command adds the images of a folder
+ * to the segmented index in dir, replacing what
+ * it held for that folder, and the query command
+ * prints the images of that index in a rectangle.
+ * The diff command compares two index files and
+ * prints the images that were added to, removed
+ * from or moved within a rectangle between them.
+ * The catalog command writes every EXIF tag of
+ * every image of a folder to out, or to standard
+ * output if out is -, as described in catalog.h.
+ *
+ * Options:
+ *   --threads N  number of files read concurrently
+ *   --binary     write tiles as binary records
+ *   --thumbs dir write the embedded thumbnail of
+ *                each match to dir; dest may then
+ *                be left out to skip full copies
+ *   --dedupe=meta  keep only the first match with
+ *                  a given capture time, camera,
+ *                  position and pixel size
+ *   --dedupe=meta,verify  also compare full file
+ *                  contents when those collide
+ *   --nogps-cache file  skip files recorded in file
+ *                  as having no GPS and record new
+ *                  ones there for the next run
+ *   --io-sim spec  add simulated latency and
+ *                  failures to every file read,
+ *                  as described in io.h
+ *   --procs N      read files in N child processes
+ *                  instead of threads, so that a
+ *                  file crashing the parser is
+ *                  skipped instead of fatal
+ *   --interval N   rescan the served folder every
+ *                  N seconds, or only on request
+ *                  if 0 (the default)
+ *   --memory MB    memory to build or sort an
+ *                  index in, 256 by default
  */
- 
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
+#include <strings.h>
 #include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <sys/types.h>
-#include <dirent.h>
-#include "exif.h"
-
-/* Type: EXIFCoord
- * ---------------
- * Stores the EXIF GPS coordinate
- * of a particular image. Set the
- * error boolean if EXIF read failed.
+#include "scan.h"
+#include "tiles.h"
+#include "cluster.h"
+#include "io.h"
+#include "serve.h"
+#include "dist.h"
+#include "index.h"
+#include "segments.h"
+#include "diff.h"
+#include "catalog.h"
+
+/* Type: Options
+ * -------------
+ * Flags given on the command line
+ * before or between the positional
+ * parameters of any command.
  */
 
 typedef struct {
-    double lat;
-    double lon;
-    bool error;
-} EXIFCoord;
+    int threads;
+    bool binary;
+    char* cachePath;
+    char* thumbsPath;
+    bool dedupe;
+    bool verify;
+    char* ioSim;
+    int interval;
+    int procs;
+    size_t memory;
+} Options;
+
+
+static Options options = {0, false, NULL, NULL, false, false, NULL, 0, 0,
+    256 * 1024 * 1024};
 
 static void err(const char* error);
-static void copyFile(const char* src, const char* dest);
-static double convertDMS(const int* DMSArray, char direction);
-static EXIFCoord getEXIFCoord(const char* path);
-static bool fileInBounds(char* path, double latTL,
-    double lonTL, double latBR, double lonBR);
+static void runScan(BoundConfig* config, BoundCallback onResult, void* ctx);
 static void boundDir(const char* srcPath, const char* destPath,
     double latTL, double lonTL, double latBR, double lonBR);
+static int tilesMain(int argc, char* argv[]);
+static int clusterMain(int argc, char* argv[]);
+static int serveMain(int argc, char* argv[]);
+static int coordinateMain(int argc, char* argv[]);
+static int workerMain(int argc, char* argv[]);
+static int indexMain(int argc, char* argv[]);
+static int ingestMain(int argc, char* argv[]);
+static int queryMain(int argc, char* argv[]);
+static int diffMain(int argc, char* argv[]);
+static int catalogMain(int argc, char* argv[]);
+static void boundMain(int argc, char* argv[]);
+static void parseBounds(char* argv[], double coords[4]);
 
 /* Function: err
  * -------------
  * Prints the provided error
  * to console and then quits.
  */
-    
+
 static void err(const char* error) {
     printf("bound: fatal error: %s\n", error);
     exit(1);
 }
 
-/* Function: copyFile
+/* Function: runScan
+ * -----------------
+ * Fills in the options shared by all
+ * commands and runs the scan. Quits if the
+ * scan fails; a cache that could not be
+ * written only earns a warning.
+ */
+
+static void runScan(BoundConfig* config, BoundCallback onResult, void* ctx) {
+    config -> threads = options.threads;
+    config -> cachePath = options.cachePath;
+    config -> procs = options.procs;
+
+    int status = boundScan(config, onResult, ctx);
+    if (status == BOUND_ERR_CACHE)
+        printf("bound: warning: %s\n", boundStrError(status));
+    else if (status != BOUND_OK) err(boundStrError(status));
+}
+
+/* Function: boundPrint
+ * --------------------
+ * Prints what was done with one match.
+ */
+
+static bool boundPrint(void* ctx, int worker, const BoundResult* result) {
+    if (result -> duplicate) printf("duplicate: %s\n", result -> name);
+    if (result -> copied) printf("copied: %s\n", result -> name); // verbose output
+    if (result -> copyFailed) printf("copy failed: %s\n", result -> name);
+    if (result -> thumbnail) printf("thumbnail: %s\n", result -> name);
+    return true;
+}
+
+/* Function: boundDir
  * ------------------
- * Attempts to copy the file at src
- * to the path given by dest. This
- * particular implementation is not
- * error-proof and in particular is
- * prone to injection, but I have it
- * here as a simple system call for
- * easy cross-platform support.
+ * Scans a given directory srcPath and copies
+ * the files that fall within the bounding
+ * rectangle to the provided destination path,
+ * printing one line per file handled.
  */
 
-static void copyFile(const char* src, const char* dest) {
-    char command[strlen(src) + strlen(dest) + 9];
-    sprintf(command, "cp \"%s\" \"%s\"", src, dest);
-    system(command); // prone to injection attacks
+static void boundDir(const char* srcPath, const char* destPath,
+    double latTL, double lonTL, double latBR, double lonBR) {
+    BoundConfig config;
+    boundConfigInit(&config, srcPath);
+    config.latTL = latTL; config.lonTL = lonTL;
+    config.latBR = latBR; config.lonBR = lonBR;
+    config.destPath = destPath;
+    config.thumbsPath = options.thumbsPath;
+    config.dedupe = options.dedupe;
+    config.verify = options.verify;
+    runScan(&config, boundPrint, NULL);
 }
 
-/* Function: convertDMS
+/* Function: tilesVisit
  * --------------------
- * Takes an array of six values representing
- * the degree, minute, and second values of
- * a GPS coordinate in rational form, as well
- * as a direction character. Returns the coord
- * in decimal degree form relative to NE such
- * that W and S coordinates are negative.
+ * Adds the coordinate of one file to the
+ * partial aggregate of the calling worker.
  */
 
-static double convertDMS(const int* DMSArray, char direction) {
-    double minutes = (float) 1 / (float) 60;
-    double seconds = (float) 1 / (float) 3600;
-    
-    double degrees = (float) DMSArray[0] / (float) DMSArray[1];
-    degrees += (float) DMSArray[2] / (float) DMSArray[3] * minutes;
-    degrees += (float) DMSArray[4] / (float) DMSArray[5] * seconds;
-    
-    degrees *= (direction == 'N' || direction == 'E') ? 1.0 : -1.0;
-    return degrees;
+static bool tilesVisit(void* ctx, int worker, const BoundResult* result) {
+    TileAgg** partials = ctx;
+    if (!tileAggAdd(partials[worker], result -> lat, result -> lon))
+        err("out of memory");
+    return true;
 }
 
-/* Function: getEXIFCoord
+/* Function: clusterVisit
  * ----------------------
- * Reads and processes the EXIF GPS data
- * from a given image filename. Returns a
- * struct representing the decimal latitude
- * and longitude of image GPS data.
+ * Adds the coordinate of one file to the
+ * partial point set of the calling worker.
  */
 
-static EXIFCoord getEXIFCoord(const char* path) {
-    EXIFCoord coord = {0, 0, true}; // initialize struct with defaults
-    int result; void** ifdArray = createIfdTableArray(path, &result);
-    
-    //default coord error value is true
-    if (ifdArray == NULL) return coord;
-    
-    //see exif.h for documentation on how these calls work
-    TagNodeInfo* lat = getTagInfo(ifdArray, IFD_GPS, TAG_GPSLatitude);
-    TagNodeInfo* lon = getTagInfo(ifdArray, IFD_GPS, TAG_GPSLongitude);
-    TagNodeInfo* latDir = getTagInfo(ifdArray, IFD_GPS, TAG_GPSLatitudeRef);
-    TagNodeInfo* lonDir = getTagInfo(ifdArray, IFD_GPS, TAG_GPSLongitudeRef);
-    
-    //return error coord if any read fails
-    if (!lat || lat -> error) return coord;
-    if (!lon || lon -> error) return coord;
-    if (!latDir || latDir -> error) return coord;
-    if (!lonDir || lonDir -> error) return coord;
-    
-    coord.lat = convertDMS(lat -> numData, latDir -> byteData[0]);
-    coord.lon = convertDMS(lon -> numData, lonDir -> byteData[0]);
-    coord.error = false;
-    return coord;
+static bool clusterVisit(void* ctx, int worker, const BoundResult* result) {
+    ClusterSet** partials = ctx;
+    if (!clusterAdd(partials[worker], result -> lat, result -> lon, result -> name))
+        err("out of memory");
+    return true;
 }
 
-/* Function: fileInBounds
- * ----------------------
- * Checks if the GPS position of a given image
- * falls within the provided bounding rectangle
- * defined by its top left and bottom right corners
- * on a map of the world centered at the Greenwich
- * meridian and oriented upright.
+/* Function: checkDir
+ * ------------------
+ * Returns path if it names an existing
+ * directory without a trailing slash and
+ * quits with the given error otherwise.
+ */
+
+static char* checkDir(char* path, const char* error) {
+    struct stat pathStat;
+
+    if (ioStat(path, &pathStat) == 0 && S_ISDIR(pathStat.st_mode)
+        && path[strlen(path) - 1] != '/') // no trailing slash
+        return path; // path exists
+
+    err(error);
+    return NULL;
+}
+
+/* Function: tilesMain
+ * -------------------
+ * Runs the tiles command on the
+ * positional parameters after the
+ * command name itself.
  */
 
-static bool fileInBounds(char* path, double latTL,
-    double lonTL, double latBR, double lonBR) {
-    EXIFCoord imageGPS = getEXIFCoord(path);
-    
-    //getEXIFCoords sets false flag if the
-    //GPS data could not actually be read
-    if (imageGPS.error) return false;
-    
-    //check bounds [inclusive check with bounds]
-    if (imageGPS.lat <= latTL && imageGPS.lon >= lonTL
-        && imageGPS.lat >= latBR && imageGPS.lon <= lonBR)
-        return true;
-        
-    //not in bounds
-    return false;
+static int tilesMain(int argc, char* argv[]) {
+    if (argc < 3) // fatal error: missing parameters
+        err("usage: bound tiles [options] src out maxZoom");
+
+    char* srcPath = checkDir(argv[0], "provided source path was invalid");
+    char* remain;
+    long maxZoom = strtol(argv[2], &remain, 10);
+    if (strlen(remain) > 0 || maxZoom < 0 || maxZoom > TILES_MAX_ZOOM)
+        err("maximum zoom out of range");
+
+    //one partial aggregate per worker
+    TileAgg* partials[BOUND_MAX_THREADS];
+    for (int i = 0; i < options.threads; i++) {
+        partials[i] = tileAggCreate((int) maxZoom);
+        if (partials[i] == NULL) err("out of memory");
+    }
+
+    BoundConfig config;
+    boundConfigInit(&config, srcPath);
+    runScan(&config, tilesVisit, partials);
+
+    //fold the partials into the first
+    for (int i = 1; i < options.threads; i++) {
+        if (!tileAggMerge(partials[0], partials[i])) err("out of memory");
+        tileAggFree(partials[i]);
+    }
+
+    FILE* out = strcmp(argv[1], "-") == 0 ? stdout
+        : fopen(argv[1], options.binary ? "wb" : "w");
+    if (out == NULL) err("could not open tile output");
+
+    bool written = tileAggWrite(partials[0], out, options.binary);
+    if (out != stdout && fclose(out) != 0) written = false;
+    if (!written) err("could not write tile output");
+
+    tileAggFree(partials[0]);
+    return 0;
 }
 
-/* Function: boundDir
+/* Function: clusterMain
+ * ---------------------
+ * Runs the cluster command on the
+ * positional parameters after the
+ * command name itself.
+ */
+
+static int clusterMain(int argc, char* argv[]) {
+    if (argc < 4) // fatal error: missing parameters
+        err("usage: bound cluster [options] src out epsMeters minPts");
+
+    char* srcPath = checkDir(argv[0], "provided source path was invalid");
+    char* remain;
+    double eps = strtod(argv[2], &remain);
+    if (strlen(remain) > 0 || !(eps > 0))
+        err("cluster radius must be a positive number of meters");
+    if (eps < CLUSTER_MIN_EPS)
+        err("cluster radius must be at least 0.01 meters");
+
+    long minPts = strtol(argv[3], &remain, 10);
+    if (strlen(remain) > 0 || minPts < 1)
+        err("cluster minimum must be a positive integer");
+
+    //one partial point set per worker
+    ClusterSet* partials[BOUND_MAX_THREADS];
+    for (int i = 0; i < options.threads; i++) {
+        partials[i] = clusterCreate();
+        if (partials[i] == NULL) err("out of memory");
+    }
+
+    BoundConfig config;
+    boundConfigInit(&config, srcPath);
+    runScan(&config, clusterVisit, partials);
+
+    //fold the partials into the first
+    for (int i = 1; i < options.threads; i++) {
+        if (!clusterMerge(partials[0], partials[i])) err("out of memory");
+        clusterFree(partials[i]);
+    }
+
+    if (clusterRun(partials[0], eps, (int) minPts) < 0)
+        err("out of memory");
+
+    FILE* out = strcmp(argv[1], "-") == 0 ? stdout : fopen(argv[1], "w");
+    if (out == NULL) err("could not open cluster output");
+
+    bool written = clusterWrite(partials[0], out);
+    if (out != stdout && fclose(out) != 0) written = false;
+    if (!written) err("could not write cluster output");
+
+    clusterFree(partials[0]);
+    return 0;
+}
+
+/* Function: serveMain
+ * -------------------
+ * Runs the serve command on the
+ * positional parameters after the
+ * command name itself.
+ */
+
+static int serveMain(int argc, char* argv[]) {
+    if (argc < 2) // fatal error: missing parameters
+        err("usage: bound serve [options] socket src");
+
+    ServeConfig config = {argv[0], NULL, options.threads,
+        options.cachePath, options.interval};
+    config.srcPath = checkDir(argv[1], "provided source path was invalid");
+
+    err(serveRun(&config)); // returns only on failure
+    return 1;
+}
+
+/* Function: coordinateMain
+ * ------------------------
+ * Runs the coordinate command on the
+ * positional parameters after the
+ * command name itself.
+ */
+
+static int coordinateMain(int argc, char* argv[]) {
+    if (argc < 6) // fatal error: missing parameters
+        err("usage: bound coordinate port src latTL lonTL latBR lonBR");
+
+    double coords[4];
+    parseBounds(argv + 2, coords);
+    CoordinatorConfig config = {argv[0], checkDir(argv[1],
+        "provided source path was invalid"),
+        coords[0], coords[1], coords[2], coords[3]};
+
+    const char* error = distCoordinate(&config);
+    if (error != NULL) err(error);
+    return 0;
+}
+
+/* Function: workerMain
+ * --------------------
+ * Runs the worker command on the
+ * positional parameters after the
+ * command name itself.
+ */
+
+static int workerMain(int argc, char* argv[]) {
+    if (argc < 2) // fatal error: missing parameters
+        err("usage: bound worker [options] host port [dest]");
+
+    WorkerConfig config = {argv[0], argv[1], options.threads, NULL, options.cachePath};
+    if (argc > 2)
+        config.destPath = checkDir(argv[2], "provided destination path was invalid");
+
+    const char* error = distWork(&config);
+    if (error != NULL) err(error);
+    return 0;
+}
+
+/* Function: indexVisit
+ * --------------------
+ * Adds one file to the index build.
+ */
+
+static bool indexVisit(void* ctx, int worker, const BoundResult* result) {
+    if (!indexBuildAdd(ctx, worker, result -> lat, result -> lon, result -> path))
+        err("could not write index run");
+    return true;
+}
+
+/* Function: indexMain
+ * -------------------
+ * Runs the index command on the
+ * positional parameters after the
+ * command name itself.
+ */
+
+static int indexMain(int argc, char* argv[]) {
+    if (argc < 2) // fatal error: missing parameters
+        err("usage: bound index [options] src out");
+
+    char* srcPath = checkDir(argv[0], "provided source path was invalid");
+    IndexBuild* build = indexBuildCreate(argv[1], options.memory, options.threads);
+    if (build == NULL) err("out of memory");
+
+    BoundConfig config;
+    boundConfigInit(&config, srcPath);
+    runScan(&config, indexVisit, build);
+
+    bool written = indexBuildFinish(build);
+    indexBuildFree(build);
+    if (!written) err("could not write index");
+    return 0;
+}
+
+/* Function: ingestMain
+ * --------------------
+ * Runs the ingest command on the
+ * positional parameters after the
+ * command name itself.
+ */
+
+static int ingestMain(int argc, char* argv[]) {
+    if (argc < 2) // fatal error: missing parameters
+        err("usage: bound ingest [options] dir src");
+
+    //records and the tombstone must spell the folder alike
+    //whichever way it is given, so use its canonical path
+    char* srcPath = realpath(checkDir(argv[1], "provided source path was invalid"), NULL);
+    if (srcPath == NULL) err("provided source path was invalid");
+    SegmentSet* set = segmentsOpen(argv[0], true);
+    if (set == NULL) err("could not open index directory");
+
+    char* segment = segmentsReserve(set);
+    IndexBuild* build = segment != NULL
+        ? indexBuildCreate(segment, options.memory, options.threads) : NULL;
+    if (build == NULL) err("out of memory");
+
+    BoundConfig config;
+    boundConfigInit(&config, srcPath);
+    runScan(&config, indexVisit, build);
+
+    bool written = indexBuildFinish(build);
+    indexBuildFree(build);
+    if (!written || !segmentsAdd(set, segment, srcPath))
+        err("could not write index segment");
+
+    free(segment);
+    free(srcPath);
+    segmentsClose(set); // waits for compaction
+    return 0;
+}
+
+/* Function: printRecord
+ * ---------------------
+ * Prints one record found by a query.
+ */
+
+static bool printRecord(void* ctx, double lat, double lon, const char* path) {
+    return printf("%.7f,%.7f,%s\n", lat, lon, path) > 0;
+}
+
+/* Function: queryMain
+ * -------------------
+ * Runs the query command on the
+ * positional parameters after the
+ * command name itself.
+ */
+
+static int queryMain(int argc, char* argv[]) {
+    if (argc < 5) // fatal error: missing parameters
+        err("usage: bound query dir latTL lonTL latBR lonBR");
+
+    double coords[4];
+    parseBounds(argv + 1, coords);
+    SegmentSet* set = segmentsOpen(argv[0], false);
+    if (set == NULL) err("could not open index directory");
+
+    long found = segmentsQuery(set, coords[0], coords[1], coords[2], coords[3],
+        printRecord, NULL);
+    segmentsClose(set);
+    if (found < 0) err("could not read index");
+    return 0;
+}
+
+/* Function: printChange
+ * ---------------------
+ * Prints one change found by a diff as
+ * added or removed followed by the record,
+ * or moved followed by the old position
+ * and the new record.
+ */
+
+static bool printChange(void* ctx, DiffChange change,
+    const IndexRecord* before, const IndexRecord* after) {
+    if (change == DIFF_ADDED)
+        return printf("added,%.7f,%.7f,%s\n", after -> lat, after -> lon, after -> path) > 0;
+    if (change == DIFF_REMOVED)
+        return printf("removed,%.7f,%.7f,%s\n", before -> lat, before -> lon,
+            before -> path) > 0;
+    return printf("moved,%.7f,%.7f,%.7f,%.7f,%s\n", before -> lat, before -> lon,
+        after -> lat, after -> lon, after -> path) > 0;
+}
+
+/* Function: diffMain
  * ------------------
- * Applies fileInBounds to each file in a given
- * directory srcPath, and copies files that pass
- * the test to the provided destination path.
+ * Runs the diff command on the
+ * positional parameters after the
+ * command name itself.
  */
 
-static void boundDir(const char* srcPath, const char* destPath,
-    double latTL, double lonTL, double latBR, double lonBR) {
-    DIR* src = opendir(srcPath);
-    
-    //struct representing a file
-    struct dirent* fileEnt;
-    
-    //iterate through all such structs in a dir
-    while ((fileEnt = readdir(src)) != NULL) {
-        if (fileEnt -> d_type != DT_REG)
-            continue; // not a regular file
-        
-        //compute the image filename from struct and source path
-        char fileName[strlen(srcPath) + strlen(fileEnt -> d_name) + 1];
-        strcpy(fileName, srcPath); strcat(fileName, "/");
-        strcat(fileName, fileEnt -> d_name);
-        
-        if (fileInBounds(fileName, latTL, lonTL, latBR, lonBR)) {
-            //compute the image destination name from struct and source path
-            char destName[strlen(destPath) + strlen(fileEnt -> d_name) + 1];
-            strcpy(destName, destPath); strcat(destName, "/");
-            strcat(destName, fileEnt -> d_name);
-            
-            //uncomment the following line to enable copying
-            copyFile(fileName, destName); // note: see implementation
-            printf("copied: %s\n", fileEnt -> d_name); // verbose output
+static int diffMain(int argc, char* argv[]) {
+    if (argc < 6) // fatal error: missing parameters
+        err("usage: bound diff [options] before after latTL lonTL latBR lonBR");
+
+    double coords[4];
+    parseBounds(argv + 2, coords);
+    DiffConfig config = {argv[0], argv[1], coords[0], coords[1], coords[2], coords[3],
+        options.memory, getenv("TMPDIR")};
+
+    const char* error = diffRun(&config, printChange, NULL);
+    if (error != NULL) err(error);
+    return 0;
+}
+
+/* Function: catalogVisit
+ * ----------------------
+ * Adds the tags of one file to the
+ * catalog, whether it has a position
+ * or not.
+ */
+
+static bool catalogVisit(void* ctx, int worker, const char* path, void** ifdArray) {
+    if (!catalogAdd(ctx, worker, path, ifdArray))
+        err("could not write catalog");
+    return true;
+}
+
+/* Function: catalogSkip
+ * ---------------------
+ * Ignores a match; the catalog is
+ * filled from every file's tags.
+ */
+
+static bool catalogSkip(void* ctx, int worker, const BoundResult* result) {
+    return true;
+}
+
+/* Function: catalogMain
+ * ---------------------
+ * Runs the catalog command on the
+ * positional parameters after the
+ * command name itself.
+ */
+
+static int catalogMain(int argc, char* argv[]) {
+    if (argc < 2) // fatal error: missing parameters
+        err("usage: bound catalog [options] src out");
+    if (options.procs > 0) err("catalog cannot run with --procs");
+
+    char* srcPath = checkDir(argv[0], "provided source path was invalid");
+    FILE* out = strcmp(argv[1], "-") == 0 ? stdout : fopen(argv[1], "w");
+    if (out == NULL) err("could not open catalog file");
+
+    Catalog* catalog = catalogCreate(out, options.threads);
+    if (catalog == NULL) err("out of memory");
+
+    BoundConfig config;
+    boundConfigInit(&config, srcPath);
+    config.onTags = catalogVisit;
+    runScan(&config, catalogSkip, catalog);
+
+    bool written = catalogFinish(catalog);
+    catalogFree(catalog);
+    if (fflush(out) != 0 || (out != stdout && fclose(out) != 0)) written = false;
+    if (!written) err("could not write catalog");
+    return 0;
+}
+
+/* Function: parseOptions
+ * ----------------------
+ * Pulls --name and --name=value flags out
+ * of argv into the global options, leaving
+ * the positional parameters in order in
+ * argv. Returns the new argument count.
+ */
+
+static int parseOptions(int argc, char* argv[]) {
+    int kept = 1;
+
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--", 2) != 0) {
+            argv[kept++] = argv[i];
+            continue; // positional parameter
         }
+
+        //split an inline value off the flag name
+        char* name = argv[i] + 2;
+        char* value = strchr(name, '=');
+        size_t nameLen = value ? (size_t) (value - name) : strlen(name);
+        if (value) value += 1;
+
+        if (nameLen == 7 && strncmp(name, "threads", 7) == 0) {
+            if (!value && i + 1 < argc) value = argv[++i];
+            char* remain;
+            long threads = value ? strtol(value, &remain, 10) : 0;
+            if (!value || strlen(remain) > 0 || threads < 1 || threads > BOUND_MAX_THREADS)
+                err("invalid thread count");
+            options.threads = (int) threads;
+        } else if (nameLen == 6 && strncmp(name, "binary", 6) == 0) {
+            options.binary = true;
+        } else if (nameLen == 6 && strncmp(name, "thumbs", 6) == 0) {
+            if (!value && i + 1 < argc) value = argv[++i];
+            if (!value) err("no thumbnail path provided");
+            options.thumbsPath = checkDir(value, "provided thumbnail path was invalid");
+        } else if (nameLen == 11 && strncmp(name, "nogps-cache", 11) == 0) {
+            if (!value && i + 1 < argc) value = argv[++i];
+            if (!value) err("no cache path provided");
+            options.cachePath = value;
+        } else if (nameLen == 6 && strncmp(name, "dedupe", 6) == 0) {
+            if (!value && i + 1 < argc) value = argv[++i];
+            if (value && strcmp(value, "meta") == 0) options.dedupe = true;
+            else if (value && strcmp(value, "meta,verify") == 0)
+                options.dedupe = options.verify = true;
+            else err("dedupe mode must be meta or meta,verify");
+        } else if (nameLen == 6 && strncmp(name, "io-sim", 6) == 0) {
+            if (!value && i + 1 < argc) value = argv[++i];
+            if (!value) err("no I/O simulation provided");
+            options.ioSim = value;
+        } else if (nameLen == 5 && strncmp(name, "procs", 5) == 0) {
+            if (!value && i + 1 < argc) value = argv[++i];
+            char* remain;
+            long procs = value ? strtol(value, &remain, 10) : 0;
+            if (!value || strlen(remain) > 0 || procs < 1 || procs > BOUND_MAX_PROCS)
+                err("invalid process count");
+            options.procs = (int) procs;
+        } else if (nameLen == 8 && strncmp(name, "interval", 8) == 0) {
+            if (!value && i + 1 < argc) value = argv[++i];
+            char* remain;
+            long interval = value ? strtol(value, &remain, 10) : -1;
+            if (!value || strlen(remain) > 0 || interval < 0 || interval > 86400 * 365)
+                err("invalid rescan interval");
+            options.interval = (int) interval;
+        } else if (nameLen == 6 && strncmp(name, "memory", 6) == 0) {
+            if (!value && i + 1 < argc) value = argv[++i];
+            char* remain;
+            long memory = value ? strtol(value, &remain, 10) : 0;
+            if (!value || strlen(remain) > 0 || memory < INDEX_MIN_MEMORY / (1024 * 1024)
+                || memory > 1024 * 1024)
+                err("invalid memory budget");
+            options.memory = (size_t) memory * 1024 * 1024;
+        } else {
+            err("unknown option");
+        }
+    }
+
+    //default to one worker per online processor
+    if (options.threads == 0) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        options.threads = online < 1 ? 1
+            : (online > BOUND_MAX_THREADS ? BOUND_MAX_THREADS : (int) online);
     }
-    
-    //avoid mem leak
-    closedir(src);
+
+    argv[kept] = NULL;
+    return kept;
 }
 
 int main(int argc, char* argv[]) {
+    argc = parseOptions(argc, argv);
+
+    //route every source read through the backend
+    IoBackend* io = ioPosix();
+    if (options.ioSim != NULL && (io = ioSimCreate(options.ioSim, io)) == NULL)
+        err("invalid I/O simulation");
+    ioSetBackend(io);
+
+    int status = 0;
+    if (argc > 1 && strcmp(argv[1], "tiles") == 0)
+        status = tilesMain(argc - 2, argv + 2);
+    else if (argc > 1 && strcmp(argv[1], "cluster") == 0)
+        status = clusterMain(argc - 2, argv + 2);
+    else if (argc > 1 && strcmp(argv[1], "serve") == 0)
+        status = serveMain(argc - 2, argv + 2);
+    else if (argc > 1 && strcmp(argv[1], "coordinate") == 0)
+        status = coordinateMain(argc - 2, argv + 2);
+    else if (argc > 1 && strcmp(argv[1], "worker") == 0)
+        status = workerMain(argc - 2, argv + 2);
+    else if (argc > 1 && strcmp(argv[1], "index") == 0)
+        status = indexMain(argc - 2, argv + 2);
+    else if (argc > 1 && strcmp(argv[1], "ingest") == 0)
+        status = ingestMain(argc - 2, argv + 2);
+    else if (argc > 1 && strcmp(argv[1], "query") == 0)
+        status = queryMain(argc - 2, argv + 2);
+    else if (argc > 1 && strcmp(argv[1], "diff") == 0)
+        status = diffMain(argc - 2, argv + 2);
+    else if (argc > 1 && strcmp(argv[1], "catalog") == 0)
+        status = catalogMain(argc - 2, argv + 2);
+    else boundMain(argc, argv);
+
+    ioFree(io);
+    return status;
+}
+
+/* Function: boundMain
+ * -------------------
+ * Checks the parameters of the default
+ * bound command and copies the images
+ * of the source folder that fall in the
+ * bounding rectangle. Quits on bad input.
+ */
+
+static void boundMain(int argc, char* argv[]) {
+
     if (argc < 2) // fatal error: no source path provided
         err("no source path provided");
-    
-    struct stat srcStat;
-    char* srcPath;
-    
-    if (stat(argv[1], &srcStat) == 0 && S_ISDIR(srcStat.st_mode)
-        && argv[1][strlen(argv[1]) - 1] != '/') // no trailing slash
-        srcPath = argv[1]; // source path exists
-    
-    else // fatal error: invalid source path
-        err("provided source path was invalid");
-        
-    if (argc < 3) // fatal error: no destination path provided
-        err("no destination path provided");
-        
-    struct stat destStat;
-    char* destPath;
-    
-    if (stat(argv[2], &destStat) == 0 && S_ISDIR(destStat.st_mode)
-        && argv[2][strlen(argv[2]) - 1] != '/') // no trailing slash
-        destPath = argv[2]; // destination path exists
-    
-    else // fatal error: invalid destination path
-        err("provided destination path was invalid");
-    
-    if (argc < 7) // missing bounding coords
+
+    char* srcPath = checkDir(argv[1], "provided source path was invalid");
+
+    //thumbnails alone need no destination
+    char* destPath = NULL;
+    int first = 2;
+    if (options.thumbsPath == NULL || argc != 6) {
+        if (argc < 3) // fatal error: no destination path provided
+            err("no destination path provided");
+
+        destPath = checkDir(argv[2], "provided destination path was invalid");
+        first = 3;
+    }
+
+    if (argc < first + 4) // missing bounding coords
         err("some bounding coords are missing");
-    
-    char* remain;
+
     double coords[4];
-    
+    parseBounds(argv + first, coords);
+
+    //call bounding function with processed params
+    boundDir(srcPath, destPath, coords[0], coords[1], coords[2], coords[3]);
+}
+
+/* Function: parseBounds
+ * ---------------------
+ * Reads the four bounding rectangle params
+ * at argv into coords, in the same order.
+ * Quits if they do not form a rectangle.
+ */
+
+static void parseBounds(char* argv[], double coords[4]) {
+    char* remain;
+
     //process remaining params as doubles
     //and throw fatal errors as necessary
     //odd params are latitude params
-    for (int i = 3; i < 7; i += 1) {
+    for (int i = 0; i < 4; i += 1) {
+        errno = 0;
         double param = strtod(argv[i], &remain);
         if (strlen(remain) > 0 || errno == ERANGE)
             err("invalid floating point parameter");
-        
+
         //make sure latitude parameters in range
-        if (i % 2 == 1 && (param < -90 || param > 90))
+        if (i % 2 == 0 && (param < -90 || param > 90))
             err("latitude parameter out of range");
-        
+
         //make sure longitude parameters in range
-        if (i % 2 == 0 && (param < -180 || param > 180))
+        if (i % 2 == 1 && (param < -180 || param > 180))
             err("longitude parameter out of range");
-        
+
         //set coords array
-        coords[i-3] = param;
+        coords[i] = param;
     }
-    
-    double latTL = coords[0];
-    double lonTL = coords[1];
-    double latBR = coords[2];
-    double lonBR = coords[3];
-    
+
     //make sure parameters form a bounding rectangle
-    if (latTL <= latBR || lonTL >= lonBR)
+    if (coords[0] <= coords[2] || coords[1] >= coords[3])
         err("deformed bounding rectangle defined");
-    
-    //call bounding function with processed params
-    boundDir(srcPath, destPath, latTL, lonTL, latBR, lonBR);
-    
-    //success
-    return 0;
-}   
+}
@@ -0,0 +1,443 @@
+/* File: catalog.c
+ * ---------------
+ * Implements the catalog declared in catalog.h.
+ * Each worker formats lines into a buffer of
+ * its own and only takes the lock to look up a
+ * dictionary string or to write a full buffer,
+ * so formatting runs on all workers at once.
+ * Dictionary lines wait in a pending buffer
+ * that is always written ahead of any worker
+ * buffer, so every id is defined before use.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include "catalog.h"
+#include "exif.h"
+
+#define FLUSH_SIZE (256 * 1024)
+
+/* Type: Buffer
+ * ------------
+ * Text being built, grown by doubling.
+ * failed is set once memory runs out, after
+ * which appends are ignored.
+ */
+
+typedef struct {
+    char* data;
+    size_t used, capacity;
+    bool failed;
+} Buffer;
+
+/* Constant: dictTags
+ * ------------------
+ * The tags whose strings are interned, by
+ * name and tag ID; the index of a tag here
+ * is the number of its dictionary.
+ */
+
+static const struct {
+    const char* name;
+    unsigned short tagId;
+} dictTags[] = {
+    {"Make", TAG_Make},
+    {"Model", TAG_Model},
+    {"Software", TAG_Software},
+    {"LensMake", TAG_LensMake},
+    {"LensModel", TAG_LensModel}
+};
+
+#define DICT_COUNT (sizeof(dictTags) / sizeof(dictTags[0]))
+
+typedef struct {
+    char* value; // NULL if the slot is free
+    uint64_t hash;
+    uint32_t dict, id;
+} DictEntry;
+
+struct Catalog {
+    FILE* out;
+    int workers;
+    Buffer* buffers;
+    pthread_mutex_t lock; // guards everything below
+    DictEntry* entries;
+    size_t capacity, count;
+    uint32_t nextIds[DICT_COUNT];
+    Buffer pending; // dictionary lines not yet written
+    bool failed;
+};
+
+/* Section: buffers
+ * ----------------
+ */
+
+static bool reserve(Buffer* buffer, size_t more) {
+    if (buffer -> failed) return false;
+    if (buffer -> used + more <= buffer -> capacity) return true;
+
+    size_t capacity = buffer -> capacity ? buffer -> capacity : 4096;
+    while (capacity < buffer -> used + more) capacity *= 2;
+    char* data = realloc(buffer -> data, capacity);
+    if (data == NULL) {
+        buffer -> failed = true;
+        return false;
+    }
+    buffer -> data = data;
+    buffer -> capacity = capacity;
+    return true;
+}
+
+static void appendBytes(Buffer* buffer, const char* bytes, size_t len) {
+    if (!reserve(buffer, len)) return;
+    memcpy(buffer -> data + buffer -> used, bytes, len);
+    buffer -> used += len;
+}
+
+static void appendText(Buffer* buffer, const char* text) {
+    appendBytes(buffer, text, strlen(text));
+}
+
+static void appendUnsigned(Buffer* buffer, uint32_t value) {
+    char digits[10];
+    int len = 0;
+    do {
+        digits[sizeof(digits) - ++len] = (char) ('0' + value % 10);
+        value /= 10;
+    } while (value > 0);
+    appendBytes(buffer, digits + sizeof(digits) - len, (size_t) len);
+}
+
+static void appendSigned(Buffer* buffer, int32_t value) {
+    if (value < 0) appendBytes(buffer, "-", 1);
+    appendUnsigned(buffer, value < 0 ? 0U - (uint32_t) value : (uint32_t) value);
+}
+
+/* Function: utf8Length
+ * --------------------
+ * Returns the length of the well-formed
+ * UTF-8 sequence starting text, which holds
+ * len bytes, or zero if it is not one.
+ */
+
+static size_t utf8Length(const unsigned char* text, size_t len) {
+    unsigned char c = text[0];
+    size_t need = c >= 0xC2 && c <= 0xDF ? 2 : (c >= 0xE0 && c <= 0xEF ? 3
+        : (c >= 0xF0 && c <= 0xF4 ? 4 : 0));
+    if (need == 0 || need > len) return 0;
+
+    //the second byte also rules out overlong forms,
+    //surrogates and code points past U+10FFFF
+    unsigned char lo = 0x80, hi = 0xBF;
+    if (c == 0xE0) lo = 0xA0;
+    else if (c == 0xED) hi = 0x9F;
+    else if (c == 0xF0) lo = 0x90;
+    else if (c == 0xF4) hi = 0x8F;
+    if (text[1] < lo || text[1] > hi) return 0;
+    for (size_t i = 2; i < need; i++)
+        if ((text[i] & 0xC0) != 0x80) return 0;
+    return need;
+}
+
+/* Function: appendString
+ * ----------------------
+ * Appends len bytes of text as a quoted
+ * JSON string. Well-formed UTF-8 is kept
+ * as it is; any other byte above 0x7F,
+ * as from Latin-1 or Shift-JIS text, is
+ * escaped as the code point of that value.
+ */
+
+static void appendString(Buffer* buffer, const char* text, size_t len) {
+    static const char hex[] = "0123456789abcdef";
+    if (!reserve(buffer, len * 6 + 2)) return;
+
+    const unsigned char* bytes = (const unsigned char*) text;
+    char* out = buffer -> data + buffer -> used;
+    *out++ = '"';
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = bytes[i];
+        size_t sequence = c >= 0x80 ? utf8Length(bytes + i, len - i) : 1;
+        if (c == '"' || c == '\\') {
+            *out++ = '\\';
+            *out++ = (char) c;
+        } else if (c < 0x20 || sequence == 0) {
+            memcpy(out, "\\u00", 4);
+            out[4] = hex[c >> 4];
+            out[5] = hex[c & 0xF];
+            out += 6;
+        } else {
+            memcpy(out, bytes + i, sequence);
+            out += sequence;
+            i += sequence - 1;
+        }
+    }
+    *out++ = '"';
+    buffer -> used = (size_t) (out - buffer -> data);
+}
+
+static void appendHex(Buffer* buffer, const unsigned char* bytes, size_t len) {
+    static const char hex[] = "0123456789abcdef";
+    if (!reserve(buffer, len * 2 + 2)) return;
+
+    char* out = buffer -> data + buffer -> used;
+    *out++ = '"';
+    for (size_t i = 0; i < len; i++) {
+        *out++ = hex[bytes[i] >> 4];
+        *out++ = hex[bytes[i] & 0xF];
+    }
+    *out++ = '"';
+    buffer -> used = (size_t) (out - buffer -> data);
+}
+
+/* Section: dictionaries
+ * ---------------------
+ */
+
+static uint64_t hashString(uint32_t dict, const char* text, size_t len) {
+    uint64_t hash = 14695981039346656037ULL ^ dict;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char) text[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static bool growDict(Catalog* catalog) {
+    size_t capacity = catalog -> capacity ? catalog -> capacity * 2 : 1024;
+    DictEntry* entries = calloc(capacity, sizeof(DictEntry));
+    if (entries == NULL) return false;
+
+    for (size_t i = 0; i < catalog -> capacity; i++) {
+        DictEntry* entry = &catalog -> entries[i];
+        if (entry -> value == NULL) continue;
+        size_t slot = entry -> hash & (capacity - 1);
+        while (entries[slot].value != NULL) slot = (slot + 1) & (capacity - 1);
+        entries[slot] = *entry;
+    }
+
+    free(catalog -> entries);
+    catalog -> entries = entries;
+    catalog -> capacity = capacity;
+    return true;
+}
+
+/* Function: intern
+ * ----------------
+ * Returns the id of a string in the given
+ * dictionary, adding it and queueing its
+ * line if it is new. Returns -1 if out of
+ * memory.
+ */
+
+static long intern(Catalog* catalog, uint32_t dict, const char* text, size_t len) {
+    uint64_t hash = hashString(dict, text, len);
+    long id = -1;
+    pthread_mutex_lock(&catalog -> lock);
+
+    if (catalog -> count * 4 >= catalog -> capacity * 3 && !growDict(catalog)) {
+        pthread_mutex_unlock(&catalog -> lock);
+        return -1;
+    }
+
+    size_t slot = hash & (catalog -> capacity - 1);
+    for (;; slot = (slot + 1) & (catalog -> capacity - 1)) {
+        DictEntry* entry = &catalog -> entries[slot];
+        if (entry -> value == NULL) break;
+        if (entry -> hash == hash && entry -> dict == dict &&
+            strncmp(entry -> value, text, len) == 0 && entry -> value[len] == '\0') {
+            id = entry -> id;
+            break;
+        }
+    }
+
+    DictEntry* entry = &catalog -> entries[slot];
+    if (id < 0 && (entry -> value = strndup(text, len)) != NULL) {
+        entry -> hash = hash;
+        entry -> dict = dict;
+        entry -> id = catalog -> nextIds[dict]++;
+        catalog -> count += 1;
+        id = entry -> id;
+
+        Buffer* pending = &catalog -> pending;
+        appendText(pending, "{\"dict\":\"");
+        appendText(pending, dictTags[dict].name);
+        appendText(pending, "\",\"id\":");
+        appendUnsigned(pending, entry -> id);
+        appendText(pending, ",\"value\":");
+        appendString(pending, text, len);
+        appendText(pending, "}\n");
+        if (pending -> failed) id = -1;
+    }
+
+    pthread_mutex_unlock(&catalog -> lock);
+    return id;
+}
+
+/* Section: lines
+ * --------------
+ */
+
+static int dictOf(IFD_TYPE ifdType, unsigned short tagId) {
+    if (ifdType != IFD_0TH && ifdType != IFD_1ST && ifdType != IFD_EXIF) return -1;
+    for (size_t i = 0; i < DICT_COUNT; i++)
+        if (dictTags[i].tagId == tagId) return (int) i;
+    return -1;
+}
+
+/* Function: appendValue
+ * ---------------------
+ * Appends the value of one tag in the
+ * form described in catalog.h.
+ */
+
+static void appendValue(Catalog* catalog, Buffer* buffer, IFD_TYPE ifdType,
+    const TagNodeInfo* tag) {
+    bool numeric = tag -> type != TYPE_ASCII && tag -> type != TYPE_UNDEFINED;
+    if (tag -> error || (numeric ? tag -> numData == NULL
+        : tag -> byteData == NULL && tag -> count > 0)) {
+        appendText(buffer, "null");
+        return;
+    }
+
+    if (tag -> type == TYPE_ASCII) {
+        const char* text = (const char*) tag -> byteData;
+        size_t len = text != NULL ? strnlen(text, tag -> count) : 0;
+        int dict = dictOf(ifdType, tag -> tagId);
+        long id = dict >= 0 ? intern(catalog, (uint32_t) dict, text, len) : -1;
+        if (dict >= 0 && id < 0) buffer -> failed = true;
+        else if (id >= 0) appendUnsigned(buffer, (uint32_t) id);
+        else appendString(buffer, text, len);
+        return;
+    }
+
+    if (tag -> type == TYPE_UNDEFINED) {
+        appendHex(buffer, tag -> byteData, tag -> count);
+        return;
+    }
+
+    bool rational = tag -> type == TYPE_RATIONAL || tag -> type == TYPE_SRATIONAL;
+    bool list = tag -> count != 1 || rational;
+    if (list) appendBytes(buffer, "[", 1);
+    for (unsigned int i = 0; i < tag -> count; i++) {
+        if (i > 0) appendBytes(buffer, ",", 1);
+        const unsigned int* value = tag -> numData + (rational ? i * 2 : i);
+        switch (tag -> type) {
+        case TYPE_SBYTE: appendSigned(buffer, (signed char) *value); break;
+        case TYPE_SSHORT: appendSigned(buffer, (short) *value); break;
+        case TYPE_SLONG: appendSigned(buffer, (int32_t) *value); break;
+        case TYPE_SRATIONAL:
+            if (tag -> count > 1) appendBytes(buffer, "[", 1);
+            appendSigned(buffer, (int32_t) value[0]);
+            appendBytes(buffer, ",", 1);
+            appendSigned(buffer, (int32_t) value[1]);
+            if (tag -> count > 1) appendBytes(buffer, "]", 1);
+            break;
+        case TYPE_RATIONAL:
+            if (tag -> count > 1) appendBytes(buffer, "[", 1);
+            appendUnsigned(buffer, value[0]);
+            appendBytes(buffer, ",", 1);
+            appendUnsigned(buffer, value[1]);
+            if (tag -> count > 1) appendBytes(buffer, "]", 1);
+            break;
+        default: appendUnsigned(buffer, *value); break;
+        }
+    }
+    if (list) appendBytes(buffer, "]", 1);
+}
+
+/* Function: writeOut
+ * ------------------
+ * Writes the pending dictionary lines and
+ * then the lines of buffer, emptying both.
+ */
+
+static bool writeOut(Catalog* catalog, Buffer* buffer) {
+    pthread_mutex_lock(&catalog -> lock);
+    Buffer* pending = &catalog -> pending;
+    if (pending -> failed || buffer -> failed ||
+        fwrite(pending -> data, 1, pending -> used, catalog -> out) != pending -> used ||
+        fwrite(buffer -> data, 1, buffer -> used, catalog -> out) != buffer -> used)
+        catalog -> failed = true;
+    pending -> used = 0;
+    buffer -> used = 0;
+    bool ok = !catalog -> failed;
+    pthread_mutex_unlock(&catalog -> lock);
+    return ok;
+}
+
+Catalog* catalogCreate(FILE* out, int workers) {
+    Catalog* catalog = calloc(1, sizeof(Catalog));
+    if (catalog == NULL) return NULL;
+    catalog -> buffers = calloc(workers, sizeof(Buffer));
+    if (catalog -> buffers == NULL || !growDict(catalog)) {
+        free(catalog -> buffers);
+        free(catalog);
+        return NULL;
+    }
+
+    catalog -> out = out;
+    catalog -> workers = workers;
+    pthread_mutex_init(&catalog -> lock, NULL);
+    return catalog;
+}
+
+bool catalogAdd(Catalog* catalog, int worker, const char* path, void** ifdArray) {
+    static const char* ifdNames[] = {"", "0th", "1st", "exif", "gps", "interop"};
+    Buffer* buffer = &catalog -> buffers[worker];
+    if (ifdArray == NULL) return true;
+
+    appendText(buffer, "{\"path\":");
+    appendString(buffer, path, strlen(path));
+    for (int i = 0; ifdArray[i] != NULL; i++) {
+        IFD_TYPE ifdType = getIfdType(ifdArray[i]);
+        if (ifdType < IFD_0TH || ifdType > IFD_IO) continue;
+        appendText(buffer, ",\"");
+        appendText(buffer, ifdNames[ifdType]);
+        appendText(buffer, "\":{");
+
+        TagNodeInfo* tag = NULL;
+        bool first = true;
+        while ((tag = getNextTagInfoFromIfd(ifdArray[i], tag)) != NULL) {
+            if (!first) appendBytes(buffer, ",", 1);
+            first = false;
+
+            const char* name = getTagNameFromId(ifdType, tag -> tagId);
+            char id[12];
+            if (name == NULL) {
+                sprintf(id, "0x%04X", tag -> tagId);
+                name = id;
+            }
+            appendString(buffer, name, strlen(name));
+            appendBytes(buffer, ":", 1);
+            appendValue(catalog, buffer, ifdType, tag);
+        }
+        appendBytes(buffer, "}", 1);
+    }
+    appendText(buffer, "}\n");
+
+    if (buffer -> failed) return false;
+    return buffer -> used < FLUSH_SIZE || writeOut(catalog, buffer);
+}
+
+bool catalogFinish(Catalog* catalog) {
+    bool ok = true;
+    for (int i = 0; i < catalog -> workers; i++)
+        if (!writeOut(catalog, &catalog -> buffers[i])) ok = false;
+    return ok;
+}
+
+void catalogFree(Catalog* catalog) {
+    if (catalog == NULL) return;
+    for (int i = 0; i < catalog -> workers; i++)
+        free(catalog -> buffers[i].data);
+    for (size_t i = 0; i < catalog -> capacity; i++)
+        free(catalog -> entries[i].value);
+    pthread_mutex_destroy(&catalog -> lock);
+    free(catalog -> pending.data);
+    free(catalog -> entries);
+    free(catalog -> buffers);
+    free(catalog);
+}
@@ -0,0 +1,70 @@
+/* File: catalog.h
+ * ---------------
+ * Writes every EXIF tag of every file handed to
+ * it as NDJSON, one line per file:
+ *
+ *   {"path":"/a/x.jpg","0th":{"Make":0,
+ *    "XResolution":[72,1]},"exif":{...}}
+ *
+ * grouped by IFD as 0th, 1st, exif, gps and
+ * interop. Numbers of a single value are bare,
+ * more are arrays, rationals are numerator and
+ * denominator pairs, undefined bytes are a hex
+ * string and unreadable tags are null. Bytes
+ * of strings that are not valid UTF-8 are
+ * escaped one by one as \u0080 to \u00ff. Tags
+ * without a known name are keyed by their hex
+ * id. Make, Model, Software, LensMake and
+ * LensModel repeat across millions of files,
+ * so each of their strings is written once as
+ *
+ *   {"dict":"Make","id":0,"value":"Canon"}
+ *
+ * before the first line using it, which then
+ * holds only the id.
+ */
+
+#ifndef _CATALOG_H_
+#define _CATALOG_H_
+
+#include <stdio.h>
+#include <stdbool.h>
+
+typedef struct Catalog Catalog;
+
+/* Function: catalogCreate
+ * -----------------------
+ * Creates a catalog writing to out for the
+ * given number of workers, each of which
+ * adds files on its own. Returns NULL if
+ * out of memory.
+ */
+
+Catalog* catalogCreate(FILE* out, int workers);
+
+/* Function: catalogAdd
+ * --------------------
+ * Adds the tags of the file at path from
+ * the given worker. Files without IFD
+ * tables are left out. Returns false if
+ * the output could not be written.
+ */
+
+bool catalogAdd(Catalog* catalog, int worker, const char* path, void** ifdArray);
+
+/* Function: catalogFinish
+ * -----------------------
+ * Writes out whatever the workers still
+ * hold. Returns false on failure.
+ */
+
+bool catalogFinish(Catalog* catalog);
+
+/* Function: catalogFree
+ * ---------------------
+ * Releases all memory held by catalog.
+ */
+
+void catalogFree(Catalog* catalog);
+
+#endif
@@ -0,0 +1,575 @@
+/* File: cluster.c
+ * ---------------
+ * Implements the grid-accelerated DBSCAN declared
+ * in cluster.h. Points are mapped to unit vectors
+ * and binned into cubes with an edge of eps/sqrt(3)
+ * so that any two points sharing a cube are within
+ * eps of each other. That makes every point of a
+ * cube holding minPts or more a core without any
+ * distance test, and lets clusters be joined per
+ * cube with a union-find instead of per point.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include "cluster.h"
+
+#define EARTH_RADIUS 6371008.8
+#define REACH 2 // cubes searched on each side
+
+/* Type: Point
+ * -----------
+ * One image position as a unit vector
+ * together with its grid cube and the
+ * offset of its label in the arena.
+ */
+
+typedef struct {
+    double x, y, z;
+    int32_t ix, iy, iz;
+    bool core;
+    uint64_t label;
+} Point;
+
+/* Type: Cell
+ * ----------
+ * A run of points sharing one cube after
+ * sorting. parent links cells into the
+ * union-find forest of clusters.
+ */
+
+typedef struct {
+    int32_t ix, iy, iz;
+    size_t start;
+    size_t count;
+    size_t parent;
+    size_t cores;
+    long cluster;
+} Cell;
+
+struct ClusterSet {
+    Point* points;
+    size_t count, capacity;
+    char* labels;
+    uint64_t labelsUsed, labelsCapacity;
+
+    //results of clusterRun
+    Cell* cells;
+    size_t cellCount;
+    size_t* owner; // cell of the core a point joined
+    long clusters;
+};
+
+ClusterSet* clusterCreate(void) {
+    return calloc(1, sizeof(ClusterSet));
+}
+
+/* Function: reserve
+ * -----------------
+ * Makes room for one more point and a
+ * label of len bytes. Returns false if
+ * out of memory.
+ */
+
+static bool reserve(ClusterSet* set, size_t len) {
+    if (set -> count == set -> capacity) {
+        size_t capacity = set -> capacity ? set -> capacity * 2 : 1024;
+        Point* points = realloc(set -> points, capacity * sizeof(Point));
+        if (points == NULL) return false;
+        set -> points = points;
+        set -> capacity = capacity;
+    }
+
+    if (set -> labelsUsed + len > set -> labelsCapacity) {
+        uint64_t capacity = set -> labelsCapacity ? set -> labelsCapacity * 2 : 16384;
+        while (capacity < set -> labelsUsed + len) capacity *= 2;
+        char* labels = realloc(set -> labels, capacity);
+        if (labels == NULL) return false;
+        set -> labels = labels;
+        set -> labelsCapacity = capacity;
+    }
+
+    return true;
+}
+
+static void append(ClusterSet* set, const Point* point, const char* label) {
+    size_t len = strlen(label) + 1;
+    set -> points[set -> count] = *point;
+    set -> points[set -> count++].label = set -> labelsUsed;
+    memcpy(set -> labels + set -> labelsUsed, label, len);
+    set -> labelsUsed += len;
+}
+
+bool clusterAdd(ClusterSet* set, double lat, double lon, const char* label) {
+    if (!reserve(set, strlen(label) + 1)) return false;
+
+    //store the position as a unit vector
+    double phi = lat * M_PI / 180.0, lambda = lon * M_PI / 180.0;
+    Point point = {0};
+    point.x = cos(phi) * cos(lambda);
+    point.y = cos(phi) * sin(lambda);
+    point.z = sin(phi);
+
+    append(set, &point, label);
+    return true;
+}
+
+bool clusterMerge(ClusterSet* into, ClusterSet* from) {
+    for (size_t i = 0; i < from -> count; i++) {
+        const char* label = from -> labels + from -> points[i].label;
+        if (!reserve(into, strlen(label) + 1)) return false;
+        append(into, &from -> points[i], label);
+    }
+
+    free(from -> points);
+    free(from -> labels);
+    memset(from, 0, sizeof(ClusterSet));
+    return true;
+}
+
+static bool sameCube(const Point* p, const Point* q) {
+    return p -> ix == q -> ix && p -> iy == q -> iy && p -> iz == q -> iz;
+}
+
+/* Type: SortKey
+ * -------------
+ * Cube of one point with the sign bits
+ * flipped so that unsigned order matches
+ * signed order, plus the point index.
+ */
+
+typedef struct {
+    uint32_t key[3];
+    uint32_t index;
+} SortKey;
+
+/* Function: sortPoints
+ * --------------------
+ * Orders the points by x, y and then z cube
+ * with an LSD radix sort on 16-bit digits,
+ * which keeps the sort linear in the number
+ * of points. Digits on which all points agree
+ * are skipped. Returns false if out of memory.
+ */
+
+static bool sortPoints(ClusterSet* set) {
+    size_t n = set -> count;
+    SortKey* keys = malloc(n * sizeof(SortKey));
+    SortKey* spare = malloc(n * sizeof(SortKey));
+    size_t* counts = malloc(65536 * sizeof(size_t));
+    bool ok = keys && spare && counts;
+
+    for (size_t i = 0; ok && i < n; i++) {
+        keys[i].key[0] = (uint32_t) set -> points[i].ix ^ 0x80000000U;
+        keys[i].key[1] = (uint32_t) set -> points[i].iy ^ 0x80000000U;
+        keys[i].key[2] = (uint32_t) set -> points[i].iz ^ 0x80000000U;
+        keys[i].index = (uint32_t) i;
+    }
+
+    //least significant digit first: z, then y, then x
+    for (int pass = 0; ok && pass < 6; pass++) {
+        int field = 2 - pass / 2, shift = (pass % 2) * 16;
+        memset(counts, 0, 65536 * sizeof(size_t));
+        for (size_t i = 0; i < n; i++)
+            counts[(keys[i].key[field] >> shift) & 0xFFFF]++;
+        if (counts[(keys[0].key[field] >> shift) & 0xFFFF] == n)
+            continue; // every point shares this digit
+
+        size_t sum = 0;
+        for (int d = 0; d < 65536; d++) {
+            size_t count = counts[d];
+            counts[d] = sum;
+            sum += count;
+        }
+        for (size_t i = 0; i < n; i++)
+            spare[counts[(keys[i].key[field] >> shift) & 0xFFFF]++] = keys[i];
+
+        SortKey* swap = keys; keys = spare; spare = swap;
+    }
+
+    //gather the points in key order
+    Point* sorted = ok ? malloc(set -> capacity * sizeof(Point)) : NULL;
+    if (sorted != NULL) {
+        for (size_t i = 0; i < n; i++)
+            sorted[i] = set -> points[keys[i].index];
+        free(set -> points);
+        set -> points = sorted;
+    }
+
+    free(keys);
+    free(spare);
+    free(counts);
+    return sorted != NULL;
+}
+
+/* Type: Column
+ * ------------
+ * The cells sharing an x and y cube index,
+ * which are adjacent after sorting and run
+ * from first to last in increasing z.
+ */
+
+typedef struct {
+    int32_t ix, iy;
+    size_t first, last;
+} Column;
+
+/* Type: Sweep
+ * -----------
+ * Walks the columns alongside the cells.
+ * Cells are visited in sorted order, so the
+ * first neighbour column at each x offset
+ * only ever moves forward and every lookup
+ * is a short, sequential step instead of a
+ * random probe into a hash table.
+ */
+
+typedef struct {
+    Column* columns;
+    size_t count;
+    size_t cursor[2 * REACH + 1];
+} Sweep;
+
+static bool sweepBuild(Sweep* sweep, const ClusterSet* set) {
+    memset(sweep, 0, sizeof(Sweep));
+    sweep -> columns = malloc(set -> cellCount * sizeof(Column));
+    if (sweep -> columns == NULL) return false;
+
+    for (size_t c = 0; c < set -> cellCount; c++) {
+        const Cell* cell = &set -> cells[c];
+        Column* column = sweep -> count ? &sweep -> columns[sweep -> count - 1] : NULL;
+        if (column && column -> ix == cell -> ix && column -> iy == cell -> iy) {
+            column -> last = c;
+            continue; // same column as the previous cell
+        }
+
+        column = &sweep -> columns[sweep -> count++];
+        column -> ix = cell -> ix;
+        column -> iy = cell -> iy;
+        column -> first = column -> last = c;
+    }
+
+    return true;
+}
+
+static void sweepRewind(Sweep* sweep) {
+    memset(sweep -> cursor, 0, sizeof(sweep -> cursor));
+}
+
+static bool columnBefore(const Column* column, int32_t ix, int32_t iy) {
+    return column -> ix < ix || (column -> ix == ix && column -> iy < iy);
+}
+
+/* Function: neighbourCells
+ * ------------------------
+ * Fills out with the cells that can hold
+ * points within eps of cell c, including c
+ * itself. Returns how many were found. The
+ * cells passed in over one sweep must come
+ * in increasing order.
+ */
+
+static int neighbourCells(Sweep* sweep, const ClusterSet* set,
+    size_t c, long* out) {
+    const Cell* cell = &set -> cells[c];
+    int found = 0;
+
+    for (int dx = -REACH; dx <= REACH; dx++) {
+        size_t* cursor = &sweep -> cursor[dx + REACH];
+        int32_t ix = cell -> ix + dx;
+        while (*cursor < sweep -> count &&
+            columnBefore(&sweep -> columns[*cursor], ix, cell -> iy - REACH))
+            *cursor += 1;
+
+        for (size_t k = *cursor; k < sweep -> count &&
+            !columnBefore(&sweep -> columns[k], ix, cell -> iy - REACH) &&
+            columnBefore(&sweep -> columns[k], ix, cell -> iy + REACH + 1); k++) {
+            //cells of a column are ordered by z
+            const Column* column = &sweep -> columns[k];
+            for (size_t n = column -> first; n <= column -> last; n++) {
+                int32_t iz = set -> cells[n].iz;
+                if (iz > cell -> iz + REACH) break;
+                if (iz >= cell -> iz - REACH) out[found++] = (long) n;
+            }
+        }
+    }
+
+    return found;
+}
+
+static bool withinReach(const Point* p, const Point* q, double eps2) {
+    double dx = p -> x - q -> x, dy = p -> y - q -> y, dz = p -> z - q -> z;
+    return dx * dx + dy * dy + dz * dz <= eps2;
+}
+
+static size_t findRoot(Cell* cells, size_t c) {
+    while (cells[c].parent != c) {
+        cells[c].parent = cells[cells[c].parent].parent; // path halving
+        c = cells[c].parent;
+    }
+    return c;
+}
+
+/* Function: markCores
+ * -------------------
+ * Flags the core points of cell c. Cubes
+ * that hold minPts points are all cores;
+ * others count neighbours point by point,
+ * stopping as soon as minPts is reached.
+ */
+
+static void markCores(ClusterSet* set, size_t c, const long* near,
+    int nearCount, double eps2, int minPts) {
+    Cell* cell = &set -> cells[c];
+
+    for (size_t i = cell -> start; i < cell -> start + cell -> count; i++) {
+        Point* p = &set -> points[i];
+        size_t seen = cell -> count; // own cube is within reach
+
+        for (int n = 0; n < nearCount && seen < (size_t) minPts; n++) {
+            if ((size_t) near[n] == c) continue;
+            Cell* other = &set -> cells[near[n]];
+            for (size_t j = other -> start; j < other -> start + other -> count
+                && seen < (size_t) minPts; j++)
+                if (withinReach(p, &set -> points[j], eps2)) seen++;
+        }
+
+        p -> core = seen >= (size_t) minPts;
+        if (p -> core) cell -> cores++;
+    }
+}
+
+/* Function: boxDistance2
+ * ----------------------
+ * Returns the squared distance from a
+ * point to the nearest point of a cube.
+ */
+
+static double boxDistance2(const Point* p, const Cell* cell, double edge) {
+    double pos[3] = {p -> x, p -> y, p -> z};
+    int32_t cube[3] = {cell -> ix, cell -> iy, cell -> iz};
+    double sum = 0;
+
+    for (int axis = 0; axis < 3; axis++) {
+        double low = cube[axis] * edge, high = low + edge;
+        double gap = pos[axis] < low ? low - pos[axis]
+            : (pos[axis] > high ? pos[axis] - high : 0);
+        sum += gap * gap;
+    }
+
+    return sum;
+}
+
+/* Function: coresTouch
+ * --------------------
+ * Checks whether some core of cell a lies
+ * within eps of some core of cell b. Only
+ * cores within eps of the other cube can
+ * pair up, so both sides are filtered by
+ * that first; for dense cells this keeps
+ * the pairwise test to a thin boundary.
+ * Scratch must hold b -> count indices.
+ */
+
+static bool coresTouch(const ClusterSet* set, const Cell* a,
+    const Cell* b, double eps2, double edge, size_t* scratch) {
+    size_t edgeCount = 0;
+    for (size_t j = b -> start; j < b -> start + b -> count; j++)
+        if (set -> points[j].core && boxDistance2(&set -> points[j], a, edge) <= eps2)
+            scratch[edgeCount++] = j;
+
+    for (size_t i = a -> start; i < a -> start + a -> count && edgeCount > 0; i++) {
+        const Point* p = &set -> points[i];
+        if (!p -> core || boxDistance2(p, b, edge) > eps2) continue;
+
+        for (size_t k = 0; k < edgeCount; k++)
+            if (withinReach(p, &set -> points[scratch[k]], eps2))
+                return true;
+    }
+
+    return false;
+}
+
+long clusterRun(ClusterSet* set, double epsMeters, int minPts) {
+    long near[(2 * REACH + 1) * (2 * REACH + 1) * (2 * REACH + 1)];
+    double chord = 2.0 * sin(epsMeters / (2.0 * EARTH_RADIUS));
+    double eps2 = chord * chord;
+    double edge = chord / sqrt(3.0);
+    Sweep sweep;
+
+    free(set -> cells); set -> cells = NULL;
+    free(set -> owner); set -> owner = NULL;
+    set -> cellCount = 0;
+    set -> clusters = 0;
+    if (!(epsMeters >= CLUSTER_MIN_EPS)) return -1; // cube indices would overflow
+    if (set -> count == 0) return 0;
+
+    //bin every point and sort the points by cube
+    for (size_t i = 0; i < set -> count; i++) {
+        Point* p = &set -> points[i];
+        p -> ix = (int32_t) floor(p -> x / edge);
+        p -> iy = (int32_t) floor(p -> y / edge);
+        p -> iz = (int32_t) floor(p -> z / edge);
+        p -> core = false;
+    }
+    if (!sortPoints(set)) return -1;
+
+    //one cell per run of equal cubes
+    set -> cells = malloc(set -> count * sizeof(Cell));
+    set -> owner = malloc(set -> count * sizeof(size_t));
+    if (set -> cells == NULL || set -> owner == NULL) return -1;
+    for (size_t i = 0; i < set -> count; i++) {
+        if (i == 0 || !sameCube(&set -> points[i - 1], &set -> points[i])) {
+            Cell* cell = &set -> cells[set -> cellCount];
+            cell -> ix = set -> points[i].ix;
+            cell -> iy = set -> points[i].iy;
+            cell -> iz = set -> points[i].iz;
+            cell -> start = i;
+            cell -> count = 0;
+            cell -> parent = set -> cellCount++;
+            cell -> cores = 0;
+            cell -> cluster = -1;
+        }
+        set -> cells[set -> cellCount - 1].count++;
+    }
+
+    if (!sweepBuild(&sweep, set)) return -1;
+    size_t largest = 0;
+    for (size_t c = 0; c < set -> cellCount; c++)
+        if (set -> cells[c].count > largest) largest = set -> cells[c].count;
+    size_t* scratch = malloc(largest * sizeof(size_t));
+    if (scratch == NULL) { free(sweep.columns); return -1; }
+
+    //first pass finds the cores of every cell
+    for (size_t c = 0; c < set -> cellCount; c++) {
+        int nearCount = neighbourCells(&sweep, set, c, near);
+        markCores(set, c, near, nearCount, eps2, minPts);
+    }
+
+    //second pass joins cells whose cores touch
+    sweepRewind(&sweep);
+    for (size_t c = 0; c < set -> cellCount; c++) {
+        if (set -> cells[c].cores == 0) continue;
+        int nearCount = neighbourCells(&sweep, set, c, near);
+
+        for (int n = 0; n < nearCount; n++) {
+            size_t o = (size_t) near[n];
+            if (o <= c || set -> cells[o].cores == 0) continue;
+            size_t rc = findRoot(set -> cells, c), ro = findRoot(set -> cells, o);
+            if (rc == ro) continue;
+            if (coresTouch(set, &set -> cells[c], &set -> cells[o], eps2, edge, scratch))
+                set -> cells[ro].parent = rc;
+        }
+    }
+
+    //third pass gives every point the cell of a core in reach
+    sweepRewind(&sweep);
+    for (size_t c = 0; c < set -> cellCount; c++) {
+        Cell* cell = &set -> cells[c];
+        int nearCount = cell -> cores == cell -> count ? 0
+            : neighbourCells(&sweep, set, c, near);
+
+        for (size_t i = cell -> start; i < cell -> start + cell -> count; i++) {
+            set -> owner[i] = SIZE_MAX; // noise until proven otherwise
+            if (cell -> cores > 0) { set -> owner[i] = c; continue; }
+
+            for (int n = 0; n < nearCount && set -> owner[i] == SIZE_MAX; n++) {
+                Cell* other = &set -> cells[near[n]];
+                if (other -> cores == 0) continue;
+                for (size_t j = other -> start; j < other -> start + other -> count; j++)
+                    if (set -> points[j].core
+                        && withinReach(&set -> points[i], &set -> points[j], eps2)) {
+                        set -> owner[i] = (size_t) near[n];
+                        break;
+                    }
+            }
+        }
+    }
+
+    //number the clusters by their root cells
+    for (size_t c = 0; c < set -> cellCount; c++) {
+        if (set -> cells[c].cores == 0) continue;
+        Cell* root = &set -> cells[findRoot(set -> cells, c)];
+        if (root -> cluster < 0) root -> cluster = set -> clusters++;
+    }
+    for (size_t i = 0; i < set -> count; i++)
+        if (set -> owner[i] != SIZE_MAX)
+            set -> owner[i] = findRoot(set -> cells, set -> owner[i]);
+
+    free(sweep.columns);
+    free(scratch);
+    return set -> clusters;
+}
+
+/* Function: writeQuoted
+ * ---------------------
+ * Writes text as a quoted CSV field,
+ * doubling any quotes in it, so that
+ * commas and line breaks stay inside.
+ */
+
+static bool writeQuoted(FILE* out, const char* text) {
+    if (fputc('"', out) == EOF) return false;
+    for (; *text != '\0'; text++)
+        if ((*text == '"' && fputc('"', out) == EOF) || fputc(*text, out) == EOF)
+            return false;
+    return fputc('"', out) != EOF;
+}
+
+bool clusterWrite(const ClusterSet* set, FILE* out) {
+    size_t clusters = (size_t) set -> clusters;
+    if (clusters == 0) return true;
+
+    //bucket the members of every cluster
+    size_t* counts = calloc(clusters + 1, sizeof(size_t));
+    double* sums = calloc(clusters * 3, sizeof(double));
+    size_t* order = malloc((set -> count + 1) * sizeof(size_t));
+    bool ok = counts && sums && order;
+
+    for (size_t i = 0; ok && i < set -> count; i++) {
+        if (set -> owner[i] == SIZE_MAX) continue;
+        long id = set -> cells[set -> owner[i]].cluster;
+        counts[id + 1]++;
+        sums[id * 3] += set -> points[i].x;
+        sums[id * 3 + 1] += set -> points[i].y;
+        sums[id * 3 + 2] += set -> points[i].z;
+    }
+    for (size_t id = 0; ok && id < clusters; id++)
+        counts[id + 1] += counts[id]; // prefix sums give bucket starts
+    for (size_t i = 0; ok && i < set -> count; i++)
+        if (set -> owner[i] != SIZE_MAX)
+            order[counts[set -> cells[set -> owner[i]].cluster]++] = i;
+
+    //counts[id] now marks the end of bucket id
+    for (size_t id = 0; ok && id < clusters; id++) {
+        size_t start = id == 0 ? 0 : counts[id - 1];
+        double x = sums[id * 3], y = sums[id * 3 + 1], z = sums[id * 3 + 2];
+        double norm = sqrt(x * x + y * y + z * z);
+        double lat = norm > 0 ? asin(z / norm) * 180.0 / M_PI : 0;
+        double lon = atan2(y, x) * 180.0 / M_PI;
+
+        if (fprintf(out, "cluster,%zu,%.7f,%.7f,%zu\n", id, lat, lon,
+            counts[id] - start) < 0) ok = false;
+
+        for (size_t k = start; ok && k < counts[id]; k++)
+            ok = fprintf(out, "member,%zu,", id) >= 0 &&
+                writeQuoted(out, set -> labels + set -> points[order[k]].label) &&
+                fputc('\n', out) != EOF;
+    }
+
+    free(counts);
+    free(sums);
+    free(order);
+    return ok;
+}
+
+void clusterFree(ClusterSet* set) {
+    if (set == NULL) return;
+    free(set -> points);
+    free(set -> labels);
+    free(set -> cells);
+    free(set -> owner);
+    free(set);
+}
@@ -0,0 +1,79 @@
+/* File: cluster.h
+ * ---------------
+ * Groups image coordinates into spatial clusters
+ * with DBSCAN: points with at least minPts points
+ * (themselves included) within eps metres are
+ * cores, cores within eps of each other share a
+ * cluster and other points join the cluster of a
+ * nearby core or are left out as noise.
+ */
+
+#ifndef _CLUSTER_H_
+#define _CLUSTER_H_
+
+#include <stdio.h>
+#include <stdbool.h>
+
+#define CLUSTER_MIN_EPS 0.01 // metres; keeps grid indices in 32 bits
+
+typedef struct ClusterSet ClusterSet;
+
+/* Function: clusterCreate
+ * -----------------------
+ * Creates an empty set of points.
+ */
+
+ClusterSet* clusterCreate(void);
+
+/* Function: clusterAdd
+ * --------------------
+ * Adds a point with the given decimal
+ * coordinate. The label is copied and
+ * listed as the member name in output.
+ * Returns false if out of memory.
+ */
+
+bool clusterAdd(ClusterSet* set, double lat, double lon, const char* label);
+
+/* Function: clusterMerge
+ * ----------------------
+ * Moves all points of from into into,
+ * leaving from empty. Used to combine
+ * per-thread partial sets.
+ */
+
+bool clusterMerge(ClusterSet* into, ClusterSet* from);
+
+/* Function: clusterRun
+ * --------------------
+ * Clusters all points of the set. Neighbour
+ * searches go through a uniform grid over the
+ * unit sphere, so running time stays close to
+ * linear in the number of points. Returns the
+ * number of clusters, or -1 if out of memory
+ * or epsMeters is below CLUSTER_MIN_EPS.
+ */
+
+long clusterRun(ClusterSet* set, double epsMeters, int minPts);
+
+/* Function: clusterWrite
+ * ----------------------
+ * Writes the result of clusterRun as CSV.
+ * Each cluster is one cluster,id,lat,lon,count
+ * line with its centroid, followed by one
+ * member,id,"label" line per point in it,
+ * the label quoted as in RFC 4180. Noise
+ * points are not written. Returns false if a
+ * write failed.
+ */
+
+bool clusterWrite(const ClusterSet* set, FILE* out);
+
+/* Function: clusterFree
+ * ---------------------
+ * Releases all memory held by set.
+ */
+
+void clusterFree(ClusterSet* set);
+
+#endif
@@ -0,0 +1,349 @@
+/* File: dedupe.c
+ * --------------
+ * Implements the duplicate set declared in
+ * dedupe.h as a chained hash table keyed by
+ * fingerprint. Every distinct file kept under
+ * a fingerprint is one entry; its size and
+ * content hash are only filled in once some
+ * later file collides with it while verifying,
+ * so the common case never reads file data.
+ * Sizes and hashes are looked up without the
+ * lock held and recorded under it afterwards.
+ * Equal hashes are confirmed by comparing
+ * the two files byte for byte.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "dedupe.h"
+#include "io.h"
+
+#define INITIAL_BUCKETS 4096
+#define HASH_BLOCK 65536
+
+#define SIZE_UNKNOWN -1 // not looked up yet
+#define SIZE_FAILED -2  // could not be looked up
+
+/* Type: Entry
+ * -----------
+ * One kept file. hashed tells whether
+ * contentHash holds the hash of the whole
+ * file, and unhashable that it could not be
+ * read. The path never changes once added,
+ * so it may be read without the lock.
+ */
+
+typedef struct Entry {
+    uint64_t fingerprint;
+    char* path;
+    long long size;
+    uint64_t contentHash;
+    bool hashed;
+    bool unhashable;
+    struct Entry* next;
+} Entry;
+
+struct DedupeSet {
+    Entry** buckets;
+    size_t bucketCount;
+    size_t entryCount;
+    bool verify;
+    pthread_mutex_t lock;
+};
+
+DedupeSet* dedupeCreate(bool verify) {
+    DedupeSet* set = calloc(1, sizeof(DedupeSet));
+    if (set == NULL) return NULL;
+
+    set -> buckets = calloc(INITIAL_BUCKETS, sizeof(Entry*));
+    if (set -> buckets == NULL) {
+        free(set);
+        return NULL;
+    }
+
+    set -> bucketCount = INITIAL_BUCKETS;
+    set -> verify = verify;
+    pthread_mutex_init(&set -> lock, NULL);
+    return set;
+}
+
+/* Function: fileSize
+ * ------------------
+ * Returns the size of the file at path,
+ * or -1 if it cannot be looked up.
+ */
+
+static long long fileSize(const char* path) {
+    struct stat fileStat;
+    return ioStat(path, &fileStat) == 0 ? (long long) fileStat.st_size : -1;
+}
+
+/* Function: hashFile
+ * ------------------
+ * Computes the 64-bit FNV-1a hash of the
+ * whole file at path. Returns false if it
+ * could not be read to the end.
+ */
+
+static bool hashFile(const char* path, uint64_t* hash) {
+    FILE* file = ioFopen(path, "rb");
+    if (file == NULL) return false;
+
+    unsigned char* block = malloc(HASH_BLOCK);
+    uint64_t h = 0xcbf29ce484222325ULL;
+    size_t len;
+
+    while (block != NULL && (len = fread(block, 1, HASH_BLOCK, file)) > 0)
+        for (size_t i = 0; i < len; i++) {
+            h ^= block[i];
+            h *= 0x100000001b3ULL;
+        }
+
+    bool ok = block != NULL && !ferror(file);
+    free(block);
+    fclose(file);
+    *hash = h;
+    return ok;
+}
+
+/* Function: sameBytes
+ * -------------------
+ * Compares the files at a and b byte for
+ * byte. Returns false if they differ or
+ * either could not be read to the end.
+ */
+
+static bool sameBytes(const char* a, const char* b) {
+    FILE* fileA = ioFopen(a, "rb");
+    FILE* fileB = fileA != NULL ? ioFopen(b, "rb") : NULL;
+    unsigned char* blockA = malloc(HASH_BLOCK);
+    unsigned char* blockB = malloc(HASH_BLOCK);
+    bool same = fileB != NULL && blockA != NULL && blockB != NULL;
+
+    while (same) {
+        size_t lenA = fread(blockA, 1, HASH_BLOCK, fileA);
+        size_t lenB = fread(blockB, 1, HASH_BLOCK, fileB);
+        same = lenA == lenB && memcmp(blockA, blockB, lenA) == 0;
+        if (lenA < HASH_BLOCK) break;
+    }
+    if (same) same = !ferror(fileA) && !ferror(fileB);
+
+    free(blockA);
+    free(blockB);
+    if (fileA != NULL) fclose(fileA);
+    if (fileB != NULL) fclose(fileB);
+    return same;
+}
+
+static Entry** bucketOf(DedupeSet* set, uint64_t fingerprint) {
+    uint64_t h = fingerprint ^ (fingerprint >> 31);
+    return &set -> buckets[(h * 0x9E3779B97F4A7C15ULL) >> 32 & (set -> bucketCount - 1)];
+}
+
+/* Function: growBuckets
+ * ---------------------
+ * Doubles the bucket array once entries
+ * outnumber buckets. Failure to grow only
+ * makes the chains longer.
+ */
+
+static void growBuckets(DedupeSet* set) {
+    size_t oldCount = set -> bucketCount;
+    Entry** oldBuckets = set -> buckets;
+    Entry** buckets = calloc(oldCount * 2, sizeof(Entry*));
+    if (buckets == NULL) return;
+
+    set -> buckets = buckets;
+    set -> bucketCount = oldCount * 2;
+    for (size_t b = 0; b < oldCount; b++)
+        while (oldBuckets[b] != NULL) {
+            Entry* entry = oldBuckets[b];
+            oldBuckets[b] = entry -> next;
+            Entry** bucket = bucketOf(set, entry -> fingerprint);
+            entry -> next = *bucket;
+            *bucket = entry;
+        }
+
+    free(oldBuckets);
+}
+
+/* Function: addEntry
+ * ------------------
+ * Adds a kept file to the set. Must be
+ * called with the lock held. Returns
+ * false if out of memory.
+ */
+
+static bool addEntry(DedupeSet* set, uint64_t fingerprint, const char* path,
+    long long size, uint64_t contentHash, bool hashed) {
+    Entry* entry = malloc(sizeof(Entry));
+    char* copy = strdup(path);
+    if (entry == NULL || copy == NULL) {
+        free(entry);
+        free(copy);
+        return false;
+    }
+
+    if (set -> entryCount >= set -> bucketCount) growBuckets(set);
+
+    entry -> fingerprint = fingerprint;
+    entry -> path = copy;
+    entry -> size = size;
+    entry -> contentHash = contentHash;
+    entry -> hashed = hashed;
+    entry -> unhashable = false;
+
+    Entry** bucket = bucketOf(set, fingerprint);
+    entry -> next = *bucket;
+    *bucket = entry;
+    set -> entryCount += 1;
+    return true;
+}
+
+/* Function: sameSizeKept
+ * ----------------------
+ * Checks whether some kept file with the
+ * given fingerprint has the given size, and
+ * keeps the file at path with that size if
+ * none does. Sizes of kept files are looked
+ * up on first need without holding the lock.
+ */
+
+static bool sameSizeKept(DedupeSet* set, uint64_t fingerprint, long long size,
+    const char* path) {
+    for (;;) {
+        pthread_mutex_lock(&set -> lock);
+        Entry* unknown = NULL;
+        bool same = false;
+        for (Entry* entry = *bucketOf(set, fingerprint); entry && !same;
+            entry = entry -> next) {
+            if (entry -> fingerprint != fingerprint) continue;
+            same = entry -> size == size;
+            if (entry -> size == SIZE_UNKNOWN) unknown = entry;
+        }
+
+        //decide only once every candidate size is known
+        if (same || unknown == NULL) {
+            if (!same) addEntry(set, fingerprint, path, size, 0, false);
+            pthread_mutex_unlock(&set -> lock);
+            return same;
+        }
+        pthread_mutex_unlock(&set -> lock);
+
+        long long found = fileSize(unknown -> path);
+        pthread_mutex_lock(&set -> lock);
+        if (unknown -> size == SIZE_UNKNOWN)
+            unknown -> size = found < 0 ? SIZE_FAILED : found;
+        pthread_mutex_unlock(&set -> lock);
+    }
+}
+
+/* Function: sameContentKept
+ * -------------------------
+ * Checks whether some kept file with the
+ * given fingerprint has the same contents
+ * as the file at path, going by size and
+ * content hash and then comparing bytes,
+ * and keeps the file at path if none does.
+ * Kept files are hashed on first need and
+ * compared without holding the lock.
+ */
+
+static bool sameContentKept(DedupeSet* set, uint64_t fingerprint,
+    long long size, uint64_t contentHash, const char* path) {
+    //kept files whose hash matched but whose bytes did not;
+    //entries live as long as the set, so pointers stay valid
+    Entry** differing = NULL;
+    size_t differingCount = 0;
+
+    for (;;) {
+        pthread_mutex_lock(&set -> lock);
+        Entry* unhashed = NULL;
+        Entry* candidate = NULL;
+        for (Entry* entry = *bucketOf(set, fingerprint); entry && !candidate;
+            entry = entry -> next) {
+            if (entry -> fingerprint != fingerprint || entry -> size != size) continue;
+            if (!entry -> hashed && !entry -> unhashable) unhashed = entry;
+            if (!entry -> hashed || entry -> contentHash != contentHash) continue;
+            candidate = entry;
+            for (size_t i = 0; i < differingCount && candidate; i++)
+                if (differing[i] == entry) candidate = NULL;
+        }
+
+        if (candidate == NULL && unhashed == NULL) {
+            addEntry(set, fingerprint, path, size, contentHash, true);
+            pthread_mutex_unlock(&set -> lock);
+            free(differing);
+            return false;
+        }
+        pthread_mutex_unlock(&set -> lock);
+
+        //a hash match only stands once the bytes agree
+        if (candidate != NULL) {
+            if (sameBytes(path, candidate -> path)) {
+                free(differing);
+                return true;
+            }
+            Entry** grown = realloc(differing, (differingCount + 1) * sizeof(Entry*));
+            if (grown == NULL) {
+                free(differing);
+                return false; // keep the file rather than guess
+            }
+            differing = grown;
+            differing[differingCount++] = candidate;
+            continue;
+        }
+
+        uint64_t found;
+        bool hashed = hashFile(unhashed -> path, &found);
+        pthread_mutex_lock(&set -> lock);
+        if (!unhashed -> hashed && !unhashed -> unhashable) {
+            unhashed -> hashed = hashed;
+            unhashed -> unhashable = !hashed;
+            unhashed -> contentHash = found;
+        }
+        pthread_mutex_unlock(&set -> lock);
+    }
+}
+
+bool dedupeClaim(DedupeSet* set, uint64_t fingerprint, const char* path) {
+    bool seen = false;
+
+    pthread_mutex_lock(&set -> lock);
+    for (Entry* entry = *bucketOf(set, fingerprint); entry && !seen; entry = entry -> next)
+        seen = entry -> fingerprint == fingerprint;
+
+    //first of its kind, or no confirmation wanted
+    if (!seen) addEntry(set, fingerprint, path, SIZE_UNKNOWN, 0, false);
+    pthread_mutex_unlock(&set -> lock);
+    if (!seen) return true;
+    if (!set -> verify) return false;
+
+    //files of different sizes cannot be equal
+    long long size = fileSize(path);
+    if (size < 0 || !sameSizeKept(set, fingerprint, size, path)) return true;
+
+    //hash the new file outside the lock
+    uint64_t contentHash;
+    if (!hashFile(path, &contentHash)) return true;
+    return !sameContentKept(set, fingerprint, size, contentHash, path);
+}
+
+void dedupeFree(DedupeSet* set) {
+    if (set == NULL) return;
+
+    for (size_t b = 0; b < set -> bucketCount; b++)
+        while (set -> buckets[b] != NULL) {
+            Entry* entry = set -> buckets[b];
+            set -> buckets[b] = entry -> next;
+            free(entry -> path);
+            free(entry);
+        }
+
+    pthread_mutex_destroy(&set -> lock);
+    free(set -> buckets);
+    free(set);
+}
@@ -0,0 +1,52 @@
+/* File: dedupe.h
+ * --------------
+ * Tracks which images have already been copied
+ * by a fingerprint of their metadata, so that
+ * only the first of a set of duplicates is kept.
+ * Fingerprints are computed by the caller; this
+ * module only remembers them and, if asked to,
+ * confirms a collision by comparing the files,
+ * first by hash and then byte for byte.
+ * All functions are safe to call from several
+ * threads at once.
+ */
+
+#ifndef _DEDUPE_H_
+#define _DEDUPE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef struct DedupeSet DedupeSet;
+
+/* Function: dedupeCreate
+ * ----------------------
+ * Creates an empty set. With verify, two
+ * files count as duplicates only if their
+ * fingerprints match and so do their full
+ * contents; without it the fingerprint
+ * alone decides.
+ */
+
+DedupeSet* dedupeCreate(bool verify);
+
+/* Function: dedupeClaim
+ * ---------------------
+ * Records the file at path under the given
+ * fingerprint. Returns true if the file is
+ * the first of its kind and should be kept,
+ * or false if it duplicates an earlier one.
+ * Files whose contents cannot be read while
+ * verifying are always kept.
+ */
+
+bool dedupeClaim(DedupeSet* set, uint64_t fingerprint, const char* path);
+
+/* Function: dedupeFree
+ * --------------------
+ * Releases all memory held by set.
+ */
+
+void dedupeFree(DedupeSet* set);
+
+#endif
@@ -0,0 +1,125 @@
+/* File: diff.c
+ * ------------
+ * Implements the index comparison declared
+ * in diff.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include "diff.h"
+
+/* Function: sortByPath
+ * --------------------
+ * Writes the records of the index at src
+ * inside the region to a new index at dest,
+ * sorted by path. Returns false on failure.
+ */
+
+static bool sortByPath(const DiffConfig* config, const char* src, const char* dest) {
+    IndexReader* reader = indexOpen(src);
+    IndexBuild* build = reader != NULL ? indexBuildCreate(dest, config -> memory, 1) : NULL;
+    bool ok = build != NULL;
+
+    if (ok) {
+        indexSetBox(reader, config -> latTL, config -> lonTL,
+            config -> latBR, config -> lonBR);
+        indexBuildByPath(build);
+    }
+
+    IndexRecord record;
+    while (ok && indexNext(reader, &record))
+        ok = indexBuildAdd(build, 0, record.lat, record.lon, record.path);
+    if (ok) ok = !indexFailed(reader) && indexBuildFinish(build);
+
+    indexBuildFree(build);
+    indexClose(reader);
+    return ok;
+}
+
+/* Function: joinByPath
+ * --------------------
+ * Walks two indexes sorted by path side by
+ * side, visiting each path found on one
+ * side only and each whose position changed.
+ */
+
+static const char* joinByPath(const char* beforePath, const char* afterPath,
+    DiffVisitor visit, void* ctx) {
+    IndexReader* before = indexOpen(beforePath);
+    IndexReader* after = indexOpen(afterPath);
+    const char* error = before == NULL || after == NULL ? "could not read sorted index" : NULL;
+
+    //the path of a record is only valid until the next read on
+    //its side, which is never before it has been compared
+    IndexRecord a, b;
+    bool hasA = error == NULL && indexNext(before, &a);
+    bool hasB = error == NULL && indexNext(after, &b);
+    bool going = true;
+
+    while (going && (hasA || hasB) && !indexFailed(before) && !indexFailed(after)) {
+        int order = !hasA ? 1 : (!hasB ? -1 : strcmp(a.path, b.path));
+        if (order < 0) {
+            going = visit(ctx, DIFF_REMOVED, &a, NULL);
+            hasA = indexNext(before, &a);
+        } else if (order > 0) {
+            going = visit(ctx, DIFF_ADDED, NULL, &b);
+            hasB = indexNext(after, &b);
+        } else {
+            if (a.lat != b.lat || a.lon != b.lon)
+                going = visit(ctx, DIFF_MOVED, &a, &b);
+            hasA = indexNext(before, &a);
+            hasB = indexNext(after, &b);
+        }
+    }
+    if (error == NULL && (indexFailed(before) || indexFailed(after)))
+        error = "could not read sorted index";
+
+    indexClose(before);
+    indexClose(after);
+    return error;
+}
+
+/* Function: removeDir
+ * -------------------
+ * Deletes the private folder at path along
+ * with whatever the builds left in it.
+ */
+
+static void removeDir(const char* path) {
+    DIR* dir = opendir(path);
+    struct dirent* entry;
+    while (dir != NULL && (entry = readdir(dir)) != NULL) {
+        if (strcmp(entry -> d_name, ".") == 0 || strcmp(entry -> d_name, "..") == 0)
+            continue;
+        char file[strlen(path) + strlen(entry -> d_name) + 2];
+        sprintf(file, "%s/%s", path, entry -> d_name);
+        remove(file);
+    }
+    if (dir != NULL) closedir(dir);
+    rmdir(path);
+}
+
+const char* diffRun(const DiffConfig* config, DiffVisitor visit, void* ctx) {
+    //build in a folder of our own, so nobody else can plant
+    //links where the sorted indexes and their runs go
+    const char* temp = config -> tempDir != NULL ? config -> tempDir : "/tmp";
+    size_t len = strlen(temp) + 32;
+    char dir[len], beforeSorted[len], afterSorted[len];
+    sprintf(dir, "%s/bound-diff-XXXXXX", temp);
+    if (mkdtemp(dir) == NULL) return "could not create temporary folder";
+    sprintf(beforeSorted, "%s/a.bidx", dir);
+    sprintf(afterSorted, "%s/b.bidx", dir);
+
+    const char* error = NULL;
+    if (!sortByPath(config, config -> before, beforeSorted))
+        error = "could not sort first index";
+    else if (!sortByPath(config, config -> after, afterSorted))
+        error = "could not sort second index";
+    else error = joinByPath(beforeSorted, afterSorted, visit, ctx);
+
+    removeDir(dir);
+    return error;
+}
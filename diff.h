@@ -0,0 +1,66 @@
+/* File: diff.h
+ * ------------
+ * Compares two index files over a region and
+ * reports the images that appeared in it, left
+ * it or moved within it. Both indexes are first
+ * cut down to the region and sorted by path
+ * within a memory budget, then joined in a
+ * single pass, so memory stays fixed however
+ * large the indexes are.
+ */
+
+#ifndef _DIFF_H_
+#define _DIFF_H_
+
+#include <stddef.h>
+#include <stdbool.h>
+#include "index.h"
+
+/* Type: DiffChange
+ * ----------------
+ * How an image differs between the two
+ * indexes, seen from inside the region.
+ */
+
+typedef enum {
+    DIFF_ADDED,   // only in the region after
+    DIFF_REMOVED, // only in the region before
+    DIFF_MOVED    // in it both times, elsewhere
+} DiffChange;
+
+/* Type: DiffVisitor
+ * -----------------
+ * Called once per change in path order with
+ * the record before, after, or both. Returns
+ * false to end the comparison early.
+ */
+
+typedef bool (*DiffVisitor)(void* ctx, DiffChange change,
+    const IndexRecord* before, const IndexRecord* after);
+
+/* Type: DiffConfig
+ * ----------------
+ * The two index files, the region, the
+ * memory for sorting and the folder to
+ * make a private temporary folder in,
+ * /tmp if NULL.
+ */
+
+typedef struct {
+    const char* before;
+    const char* after;
+    double latTL, lonTL, latBR, lonBR;
+    size_t memory;
+    const char* tempDir;
+} DiffConfig;
+
+/* Function: diffRun
+ * -----------------
+ * Visits every change between the two
+ * indexes. Returns NULL, or a description
+ * of the error that ended it.
+ */
+
+const char* diffRun(const DiffConfig* config, DiffVisitor visit, void* ctx);
+
+#endif
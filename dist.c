@@ -0,0 +1,588 @@
+/* File: dist.c
+ * ------------
+ * Implements the distributed scan declared in
+ * dist.h. The coordinator is a single thread
+ * polling all of its connections; each worker
+ * runs one unit at a time with boundScan and
+ * its usual threads.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include "dist.h"
+#include "scan.h"
+#include "io.h"
+
+#define MAX_PEERS 1024
+#define MAX_DEPTH 64
+#define MAX_LINE 65536
+#define SLOW_MIN 5.0    // seconds before a unit may count as slow
+#define SLOW_FACTOR 3.0 // times the mean unit time
+#define POLL_MS 1000
+
+enum { UNIT_PENDING, UNIT_RUNNING, UNIT_DONE };
+
+/* Type: Unit
+ * ----------
+ * One folder to scan. The estimate is the
+ * number of regular files it holds, and
+ * runners the number of workers on it.
+ */
+
+typedef struct {
+    char* path;
+    size_t estimate;
+    int state;
+    int runners;
+    double started;
+} Unit;
+
+typedef struct {
+    Unit* items;
+    size_t count, capacity;
+} UnitList;
+
+/* Type: Peer
+ * ----------
+ * One connected worker with its unread
+ * input and the matches of its current
+ * unit, held back until the unit is done.
+ */
+
+typedef struct {
+    int fd;
+    char* in;
+    size_t inUsed, inCapacity;
+    long unit; // -1 while idle
+    char* results;
+    size_t resultsUsed, resultsCapacity;
+} Peer;
+
+typedef struct {
+    const CoordinatorConfig* config;
+    UnitList units;
+    size_t unitsDone;
+    double totalTime;
+    size_t timedUnits;
+    Peer peers[MAX_PEERS];
+    int peerCount;
+} Coordinator;
+
+static double now(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+/* Function: append
+ * ----------------
+ * Appends len bytes to a growable buffer.
+ * Returns false if out of memory.
+ */
+
+static bool append(char** buffer, size_t* used, size_t* capacity,
+    const char* data, size_t len) {
+    if (*used + len > *capacity) {
+        size_t grown = *capacity ? *capacity * 2 : 4096;
+        while (grown < *used + len) grown *= 2;
+        char* bigger = realloc(*buffer, grown);
+        if (bigger == NULL) return false;
+        *buffer = bigger;
+        *capacity = grown;
+    }
+
+    memcpy(*buffer + *used, data, len);
+    *used += len;
+    return true;
+}
+
+static bool sendLine(int fd, const char* line) {
+    size_t len = strlen(line), done = 0;
+    while (done < len) {
+        ssize_t sent = send(fd, line + done, len - done, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent <= 0) return false;
+        done += sent;
+    }
+    return true;
+}
+
+/* Function: escapePath
+ * --------------------
+ * Writes path to out with backslashes,
+ * newlines and carriage returns escaped,
+ * so that it fits on one protocol line.
+ * out must hold 2 * strlen(path) + 1 bytes.
+ */
+
+static void escapePath(const char* path, char* out) {
+    for (; *path != '\0'; path++) {
+        if (*path == '\\') { *out++ = '\\'; *out++ = '\\'; }
+        else if (*path == '\n') { *out++ = '\\'; *out++ = 'n'; }
+        else if (*path == '\r') { *out++ = '\\'; *out++ = 'r'; }
+        else *out++ = *path;
+    }
+    *out = '\0';
+}
+
+/* Function: unescapePath
+ * ----------------------
+ * Undoes escapePath in place. Returns
+ * false if text holds an invalid escape.
+ */
+
+static bool unescapePath(char* text) {
+    char* out = text;
+    for (; *text != '\0'; text++) {
+        if (*text != '\\') { *out++ = *text; continue; }
+        text++;
+        if (*text == '\\') *out++ = '\\';
+        else if (*text == 'n') *out++ = '\n';
+        else if (*text == 'r') *out++ = '\r';
+        else return false;
+    }
+    *out = '\0';
+    return true;
+}
+
+/* Function: collectUnits
+ * ----------------------
+ * Adds path and every folder below it to
+ * units, each with its count of regular
+ * files. Folders without files are left
+ * out. Returns false if out of memory.
+ */
+
+static bool collectUnits(const char* path, UnitList* units, int depth) {
+    void* dir = ioOpenDir(path);
+    if (dir == NULL) return true; // unreadable folders hold no units
+
+    Unit unit = {NULL, 0, UNIT_PENDING, 0, 0};
+    char** subdirs = NULL;
+    size_t subdirCount = 0;
+    bool ok = true;
+
+    const char* name;
+    bool regular;
+    while (ok && (name = ioReadDir(dir, &regular)) != NULL) {
+        if (regular) {
+            unit.estimate += 1;
+            continue;
+        }
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) continue;
+
+        //other entries count if they are folders
+        char child[strlen(path) + strlen(name) + 2];
+        sprintf(child, "%s/%s", path, name);
+        struct stat fileStat;
+        if (depth >= MAX_DEPTH || ioStat(child, &fileStat) != 0 ||
+            !S_ISDIR(fileStat.st_mode))
+            continue;
+
+        char** grown = realloc(subdirs, (subdirCount + 1) * sizeof(char*));
+        if (grown == NULL || (grown[subdirCount] = strdup(child)) == NULL) ok = false;
+        if (grown != NULL) subdirs = grown;
+        if (ok) subdirCount += 1;
+    }
+    ioCloseDir(dir);
+
+    if (ok && unit.estimate > 0) {
+        if (units -> count == units -> capacity) {
+            size_t capacity = units -> capacity ? units -> capacity * 2 : 64;
+            Unit* items = realloc(units -> items, capacity * sizeof(Unit));
+            if (items == NULL) ok = false;
+            else {
+                units -> items = items;
+                units -> capacity = capacity;
+            }
+        }
+        if (ok && (unit.path = strdup(path)) == NULL) ok = false;
+        if (ok) units -> items[units -> count++] = unit;
+    }
+
+    for (size_t i = 0; i < subdirCount; i++) {
+        if (ok) ok = collectUnits(subdirs[i], units, depth + 1);
+        free(subdirs[i]);
+    }
+    free(subdirs);
+    return ok;
+}
+
+static int compareUnits(const void* a, const void* b) {
+    const Unit* p = a;
+    const Unit* q = b;
+    return p -> estimate > q -> estimate ? -1 : (p -> estimate < q -> estimate);
+}
+
+/* Function: slowLimit
+ * -------------------
+ * Returns how long a unit may run before
+ * idle workers are sent to it as well.
+ */
+
+static double slowLimit(const Coordinator* coordinator) {
+    double mean = coordinator -> timedUnits
+        ? coordinator -> totalTime / coordinator -> timedUnits : 0;
+    return mean * SLOW_FACTOR > SLOW_MIN ? mean * SLOW_FACTOR : SLOW_MIN;
+}
+
+/* Function: assign
+ * ----------------
+ * Gives an idle peer the largest pending
+ * unit or, if none is left, a unit that
+ * runs slowly on a single other worker.
+ * Returns false if the peer is gone.
+ */
+
+static bool assign(Coordinator* coordinator, Peer* peer) {
+    UnitList* units = &coordinator -> units;
+    long chosen = -1;
+    double time = now();
+
+    for (size_t i = 0; i < units -> count && chosen < 0; i++)
+        if (units -> items[i].state == UNIT_PENDING) chosen = (long) i;
+
+    for (size_t i = 0; i < units -> count && chosen < 0; i++) {
+        const Unit* unit = &units -> items[i];
+        if (unit -> state == UNIT_RUNNING && unit -> runners == 1 &&
+            time - unit -> started > slowLimit(coordinator))
+            chosen = (long) i;
+    }
+    if (chosen < 0) return true; // stay idle for now
+
+    Unit* unit = &units -> items[chosen];
+    char path[2 * strlen(unit -> path) + 1];
+    escapePath(unit -> path, path);
+    char line[strlen(path) + 32];
+    sprintf(line, "unit %ld %s\n", chosen, path);
+    if (unit -> state == UNIT_PENDING) unit -> started = time;
+    unit -> state = UNIT_RUNNING;
+    unit -> runners += 1;
+    peer -> unit = chosen;
+    peer -> resultsUsed = 0;
+    return sendLine(peer -> fd, line);
+}
+
+/* Function: finishUnit
+ * --------------------
+ * Ends the current unit of a peer. The first
+ * finished run of a unit has its matches
+ * written out; other runs are discarded.
+ */
+
+static void finishUnit(Coordinator* coordinator, Peer* peer, bool failed) {
+    Unit* unit = &coordinator -> units.items[peer -> unit];
+    unit -> runners -= 1;
+    peer -> unit = -1;
+    if (unit -> state == UNIT_DONE) return; // another worker was faster
+
+    unit -> state = UNIT_DONE;
+    coordinator -> unitsDone += 1;
+    if (failed) {
+        fprintf(stderr, "bound: warning: could not scan %s\n", unit -> path);
+        return;
+    }
+
+    coordinator -> totalTime += now() - unit -> started;
+    coordinator -> timedUnits += 1;
+    fwrite(peer -> results, 1, peer -> resultsUsed, stdout);
+    fflush(stdout);
+}
+
+/* Function: dropPeer
+ * ------------------
+ * Closes a peer. A unit only it was
+ * running goes back to the queue.
+ */
+
+static void dropPeer(Coordinator* coordinator, int index) {
+    Peer* peer = &coordinator -> peers[index];
+    if (peer -> unit >= 0) {
+        Unit* unit = &coordinator -> units.items[peer -> unit];
+        unit -> runners -= 1;
+        if (unit -> state == UNIT_RUNNING && unit -> runners == 0)
+            unit -> state = UNIT_PENDING;
+    }
+
+    close(peer -> fd);
+    free(peer -> in);
+    free(peer -> results);
+    coordinator -> peers[index] = coordinator -> peers[--coordinator -> peerCount];
+}
+
+/* Function: handleLine
+ * --------------------
+ * Acts on one line from a peer. A line
+ * that does not follow the protocol fails
+ * the peer's current unit. Returns false
+ * if the peer should be dropped.
+ */
+
+static bool handleLine(Coordinator* coordinator, Peer* peer, char* line) {
+    long id;
+    int used = 0;
+    double lat, lon;
+
+    if (sscanf(line, "match %ld %lf %lf %n", &id, &lat, &lon, &used) == 3 && used > 0 &&
+        unescapePath(line + used)) {
+        if (id != peer -> unit) return true; // stale
+        char text[64];
+        int len = snprintf(text, sizeof(text), "%.7f,%.7f,", lat, lon);
+        return append(&peer -> results, &peer -> resultsUsed, &peer -> resultsCapacity,
+                text, len) &&
+            append(&peer -> results, &peer -> resultsUsed, &peer -> resultsCapacity,
+                line + used, strlen(line + used)) &&
+            append(&peer -> results, &peer -> resultsUsed, &peer -> resultsCapacity, "\n", 1);
+    }
+
+    long count;
+    bool done = sscanf(line, "done %ld %ld", &id, &count) == 2;
+    bool failed = !done && sscanf(line, "fail %ld", &id) == 1;
+    if (!done && !failed) {
+        //the unit cannot be trusted, but the peer may do others
+        if (peer -> unit < 0) return true;
+        id = peer -> unit;
+        failed = true;
+    }
+    if (id != peer -> unit) return true;
+
+    finishUnit(coordinator, peer, failed);
+    return assign(coordinator, peer);
+}
+
+/* Function: readPeer
+ * ------------------
+ * Reads what a peer sent and acts on every
+ * complete line. Returns false if the peer
+ * hung up or misbehaved.
+ */
+
+static bool readPeer(Coordinator* coordinator, Peer* peer) {
+    char buffer[65536];
+    ssize_t got = recv(peer -> fd, buffer, sizeof(buffer), 0);
+    if (got < 0 && errno == EINTR) return true;
+    if (got <= 0) return false;
+    if (!append(&peer -> in, &peer -> inUsed, &peer -> inCapacity, buffer, got))
+        return false;
+
+    size_t start = 0;
+    for (size_t i = 0; i < peer -> inUsed; i++) {
+        if (peer -> in[i] != '\n') continue;
+        peer -> in[i] = '\0';
+        if (!handleLine(coordinator, peer, peer -> in + start)) return false;
+        start = i + 1;
+    }
+
+    memmove(peer -> in, peer -> in + start, peer -> inUsed - start);
+    peer -> inUsed -= start;
+    return peer -> inUsed <= MAX_LINE;
+}
+
+/* Function: openSocket
+ * --------------------
+ * Resolves host and port and returns a
+ * socket listening on them when listening,
+ * or connected to them otherwise. Returns
+ * -1 on failure.
+ */
+
+static int openSocket(const char* host, const char* port, bool listening) {
+    struct addrinfo hints = {0}, *found;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = listening ? AI_PASSIVE : 0;
+    if (getaddrinfo(host, port, &hints, &found) != 0) return -1;
+
+    int fd = -1;
+    for (struct addrinfo* addr = found; addr != NULL && fd < 0; addr = addr -> ai_next) {
+        fd = socket(addr -> ai_family, addr -> ai_socktype, addr -> ai_protocol);
+        if (fd < 0) continue;
+
+        int on = 1;
+        bool ok = listening
+            ? setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == 0 &&
+                bind(fd, addr -> ai_addr, addr -> ai_addrlen) == 0 &&
+                listen(fd, SOMAXCONN) == 0
+            : connect(fd, addr -> ai_addr, addr -> ai_addrlen) == 0;
+        if (!ok) {
+            close(fd);
+            fd = -1;
+        }
+    }
+
+    freeaddrinfo(found);
+    return fd;
+}
+
+static void freeUnits(UnitList* units) {
+    for (size_t i = 0; i < units -> count; i++)
+        free(units -> items[i].path);
+    free(units -> items);
+}
+
+const char* distCoordinate(const CoordinatorConfig* config) {
+    Coordinator* coordinator = calloc(1, sizeof(Coordinator));
+    if (coordinator == NULL) return "out of memory";
+    coordinator -> config = config;
+
+    if (!collectUnits(config -> srcPath, &coordinator -> units, 0)) {
+        freeUnits(&coordinator -> units);
+        free(coordinator);
+        return "out of memory";
+    }
+    qsort(coordinator -> units.items, coordinator -> units.count, sizeof(Unit), compareUnits);
+
+    int listener = openSocket(NULL, config -> port, true);
+    if (listener < 0) {
+        freeUnits(&coordinator -> units);
+        free(coordinator);
+        return "could not listen on port";
+    }
+
+    char job[128];
+    snprintf(job, sizeof(job), "job %.7f %.7f %.7f %.7f\n",
+        config -> latTL, config -> lonTL, config -> latBR, config -> lonBR);
+
+    struct pollfd fds[MAX_PEERS + 1];
+    const char* error = NULL;
+    while (coordinator -> unitsDone < coordinator -> units.count) {
+        fds[0].fd = listener;
+        fds[0].events = POLLIN;
+        for (int i = 0; i < coordinator -> peerCount; i++) {
+            fds[i + 1].fd = coordinator -> peers[i].fd;
+            fds[i + 1].events = POLLIN;
+        }
+
+        int ready = poll(fds, coordinator -> peerCount + 1, POLL_MS);
+        if (ready < 0 && errno != EINTR) {
+            error = "could not poll connections";
+            break;
+        }
+
+        //peers are read before new ones shift their slots
+        for (int i = coordinator -> peerCount - 1; ready > 0 && i >= 0; i--)
+            if (fds[i + 1].revents && !readPeer(coordinator, &coordinator -> peers[i]))
+                dropPeer(coordinator, i);
+
+        if (ready > 0 && (fds[0].revents & POLLIN)) {
+            int fd = accept(listener, NULL, NULL);
+            if (fd >= 0 && coordinator -> peerCount < MAX_PEERS && sendLine(fd, job)) {
+                Peer* peer = &coordinator -> peers[coordinator -> peerCount++];
+                memset(peer, 0, sizeof(Peer));
+                peer -> fd = fd;
+                peer -> unit = -1;
+            } else if (fd >= 0) close(fd);
+        }
+
+        //hand out work to idle peers, slow units included
+        for (int i = coordinator -> peerCount - 1; i >= 0; i--)
+            if (coordinator -> peers[i].unit < 0 &&
+                !assign(coordinator, &coordinator -> peers[i]))
+                dropPeer(coordinator, i);
+    }
+
+    while (coordinator -> peerCount > 0) {
+        sendLine(coordinator -> peers[0].fd, "bye\n");
+        dropPeer(coordinator, 0);
+    }
+
+    close(listener);
+    freeUnits(&coordinator -> units);
+    free(coordinator);
+    return error;
+}
+
+/* Section: worker
+ * ---------------
+ */
+
+typedef struct {
+    FILE* out;
+    long unit;
+    long count;
+} UnitRun;
+
+static bool sendMatch(void* ctx, int worker, const BoundResult* result) {
+    UnitRun* run = ctx;
+    if (result -> duplicate) return true;
+    __sync_fetch_and_add(&run -> count, 1);
+    char path[2 * strlen(result -> path) + 1];
+    escapePath(result -> path, path);
+    return fprintf(run -> out, "match %ld %.7f %.7f %s\n", run -> unit,
+        result -> lat, result -> lon, path) > 0;
+}
+
+const char* distWork(const WorkerConfig* config) {
+    int fd = openSocket(config -> host, config -> port, false);
+    if (fd < 0) return "could not connect to coordinator";
+
+    int outFd = dup(fd);
+    FILE* in = fdopen(fd, "r");
+    FILE* out = outFd >= 0 ? fdopen(outFd, "w") : NULL;
+    if (in == NULL || out == NULL) {
+        if (in != NULL) fclose(in); else close(fd);
+        if (out != NULL) fclose(out); else if (outFd >= 0) close(outFd);
+        return "out of memory";
+    }
+
+    BoundConfig scan;
+    boundConfigInit(&scan, NULL);
+    scan.threads = config -> threads;
+    scan.destPath = config -> destPath;
+
+    //one cache across all units, loaded and saved only once
+    if (config -> cachePath != NULL &&
+        (scan.noGps = noGpsLoad(config -> cachePath)) == NULL) {
+        fclose(in);
+        fclose(out);
+        return "out of memory";
+    }
+
+    const char* error = "lost connection to coordinator";
+    char* line = NULL;
+    size_t capacity = 0;
+    signal(SIGPIPE, SIG_IGN);
+
+    while (getline(&line, &capacity, in) >= 0) {
+        line[strcspn(line, "\r\n")] = '\0';
+        UnitRun run = {out, 0, 0};
+        int used = 0;
+
+        if (strcmp(line, "bye") == 0) {
+            if (scan.noGps != NULL && !noGpsSave(scan.noGps))
+                fprintf(stderr, "bound: warning: could not write no-GPS cache\n");
+            error = NULL;
+            break;
+        } else if (sscanf(line, "job %lf %lf %lf %lf", &scan.latTL, &scan.lonTL,
+            &scan.latBR, &scan.lonBR) == 4) {
+            continue;
+        } else if (sscanf(line, "unit %ld %n", &run.unit, &used) == 1 && used > 0) {
+            scan.srcPath = line + used;
+            int status = unescapePath(line + used)
+                ? boundScan(&scan, sendMatch, &run) : BOUND_ERR_SOURCE;
+            if (status == BOUND_OK || status == BOUND_ERR_CACHE)
+                fprintf(out, "done %ld %ld\n", run.unit, run.count);
+            else fprintf(out, "fail %ld\n", run.unit);
+            fflush(out); // a coordinator that is gone is seen on the next read
+        } else {
+            error = "unexpected message from coordinator";
+            break;
+        }
+    }
+
+    free(line);
+    noGpsFree(scan.noGps);
+    fclose(in);
+    fclose(out);
+    return error;
+}
@@ -0,0 +1,79 @@
+/* File: dist.h
+ * ------------
+ * Spreads a scan over worker processes, on this
+ * machine or others, connected over TCP. The
+ * coordinator splits a folder tree into work
+ * units, one per folder, and hands them out
+ * largest first to whichever worker is free.
+ * The protocol is line based:
+ *
+ *   coordinator: job latTL lonTL latBR lonBR
+ *                unit id path
+ *                bye
+ *   worker:      match id lat lon path
+ *                done id count
+ *                fail id
+ *
+ * Paths escape backslashes, newlines and
+ * carriage returns as \\, \n and \r. A line
+ * a worker sends outside the protocol fails
+ * the unit it is on.
+ *
+ * A unit's matches are only printed once its
+ * done line arrives, so a unit whose worker
+ * dies is simply handed out again. When no
+ * units are left, units that have run much
+ * longer than usual are handed to idle workers
+ * as well, and the first to finish counts.
+ */
+
+#ifndef _DIST_H_
+#define _DIST_H_
+
+/* Type: CoordinatorConfig
+ * -----------------------
+ * The port to listen on, the root of the
+ * tree to scan and the rectangle to match.
+ */
+
+typedef struct {
+    const char* port;
+    const char* srcPath;
+    double latTL, lonTL, latBR, lonBR;
+} CoordinatorConfig;
+
+/* Type: WorkerConfig
+ * ------------------
+ * Where to find the coordinator and how to
+ * scan; matches are copied to destPath on
+ * the worker's machine unless it is NULL.
+ */
+
+typedef struct {
+    const char* host;
+    const char* port;
+    int threads;
+    const char* destPath;
+    const char* cachePath;
+} WorkerConfig;
+
+/* Function: distCoordinate
+ * ------------------------
+ * Runs the coordinator until every unit is
+ * done, writing each match to stdout as a
+ * lat,lon,path line. Returns NULL, or a
+ * description of the error that ended it.
+ */
+
+const char* distCoordinate(const CoordinatorConfig* config);
+
+/* Function: distWork
+ * ------------------
+ * Runs a worker until the coordinator says
+ * bye. Returns NULL, or a description of
+ * the error that ended it.
+ */
+
+const char* distWork(const WorkerConfig* config);
+
+#endif
@@ -25,12 +25,25 @@
 #include <string.h>
 #include <memory.h>
 #include <ctype.h>
+#ifdef _MSC_VER
+#include <io.h>
+#define write _write
+#else
+#include <unistd.h>
+#endif
 #include "exif.h"
 
 #pragma pack(2)
 
 #define VERSION  "1.0.1"
 
+// per-thread parser state so that several files can be parsed at once
+#ifdef _MSC_VER
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL __thread
+#endif
+
 // TIFF Header
 typedef struct _tiff_Header {
     unsigned short byteOrder;
@@ -54,6 +67,19 @@ typedef struct {
     unsigned int offset;
 } IFD_TAG;
 
+// range of the file relative to the TIFF header - internal use
+typedef struct {
+    unsigned int offset;
+    unsigned int length;
+} READ_RANGE;
+
+// coalesced block of the file read ahead by the read planner - internal use
+typedef struct {
+    unsigned int offset;
+    unsigned int length;
+    unsigned char *data;
+} READ_SPAN;
+
 // tag node - internal use
 typedef struct _tagNode TagNode;
 struct _tagNode {
@@ -77,13 +103,37 @@ struct _ifdTable {
     unsigned short offset;
     unsigned short length;
     unsigned char *p;
+    unsigned int pFileOffset; // where the thumbnail starts in the file
+    unsigned int pFileLength;
 };
 
+// destination of a table dump - internal use
+typedef struct {
+    FILE *fp;    // stream written to directly, or NULL
+    int fd;      // descriptor the text is flushed to, or -1
+    char *text;  // text built so far, always NUL terminated
+    size_t len;
+    size_t size;
+    int error;   // 0, ERR_MEMALLOC or ERR_WRITE_FILE
+} DUMP_SINK;
+
+// text held before it is flushed to a descriptor
+#define DUMP_FLUSH_SIZE 65536
+
 static int init(FILE*);
+static int initTiff(FILE*);
+static int initHeif(FILE*);
+static int initPng(FILE*);
+static int initWebp(FILE*);
+static int initAnyFormat(FILE*);
 static int systemIsLittleEndian();
 static int dataIsLittleEndian();
 static void freeIfdTable(void*);
 static void *parseIFD(FILE*, unsigned int, IFD_TYPE);
+static void prefetchRanges(FILE*, READ_RANGE*, int);
+static int readRelative(FILE*, unsigned int, void*, unsigned int);
+static void clearReadSpans(void);
+static unsigned int getValueLength(unsigned short type, unsigned int count);
 static TagNode *getTagNodePtrFromIfd(IfdTable*, unsigned short);
 static TagNode *duplicateTagNode(TagNode*);
 static void freeTagNode(void*);
@@ -99,14 +149,39 @@ static int fixLengthAndOffsetInIfdTables(void **ifdTableArray);
 static int setSingleNumDataToTag(TagNode *tag, unsigned int value);
 static int getApp1StartOffset(FILE *fp, const char *App1IDString,
                               size_t App1IDStringLength, int *pDQTOffset);
+static int findApp1Segment(FILE *fp, unsigned short marker,
+                           const char *App1IDString,
+                           size_t App1IDStringLength, int *pDQTOffset);
+static unsigned char *readXmpPacket(FILE *fp, int sts, unsigned int *pLength,
+                                    int *pResult);
+static unsigned char *readXmpOfJpeg(FILE *fp, unsigned int *pLength);
 static unsigned short swab16(unsigned short us);
-static void PRINTF(char **ms, const char *fmt, ...);
-static void _dumpIfdTable(void *pIfd, char **p);
+static void dumpPrintf(DUMP_SINK *sink, const char *fmt, ...);
+static void dumpFlush(DUMP_SINK *sink);
+static void _dumpIfdTable(void *pIfd, DUMP_SINK *sink);
 
 static int Verbose = 0;
-static int App1StartOffset = -1;
-static int JpegDQTOffset = -1;
-static APP1_HEADER App1Header;
+static int LoadThumbnail = 1;
+static FILE *(*FileOpener)(const char*, const char*) = fopen;
+static THREAD_LOCAL int App1StartOffset = -1;
+static THREAD_LOCAL int JpegDQTOffset = -1;
+static THREAD_LOCAL APP1_HEADER App1Header;
+static THREAD_LOCAL unsigned int TiffHeaderOffset = 0; // file offset of the TIFF header
+static THREAD_LOCAL unsigned int TiffDataLength = 0;   // upper bound of a tag value's size
+
+static THREAD_LOCAL int FileIsJpeg = 0;
+static THREAD_LOCAL int XmpStartOffset = -1; // XMP segment passed while looking for Exif
+
+#define ADOBE_METADATA_ID     "http://ns.adobe.com/xap/"
+#define ADOBE_METADATA_ID_LEN 24
+
+// read planner: ranges closer than READ_GAP bytes are read as one span
+#define READ_GAP        8192
+#define READ_MAX_SPAN   (1024 * 1024)
+#define MAX_READ_SPANS  32
+#define IFD_WINDOW      (sizeof(short) + sizeof(IFD_TAG) * 32 + sizeof(int))
+static THREAD_LOCAL READ_SPAN ReadSpans[MAX_READ_SPANS];
+static THREAD_LOCAL int ReadSpanCount = 0;
 
 // public funtions
 
@@ -123,6 +198,40 @@ void setVerbose(int v)
     Verbose = v;
 }
 
+/**
+ * setLoadThumbnail()
+ *
+ * Thumbnail loading on/off
+ *
+ * parameters
+ *  [in] v : 1=on (default)  0=off
+ *
+ * note
+ * With loading off, createIfdTableArray() only records where the
+ * thumbnail is. getThumbnailRangeOnIfdTableArray() still works but
+ * getThumbnailDataOnIfdTableArray() returns ERR_NOT_EXIST.
+ */
+void setLoadThumbnail(int v)
+{
+    LoadThumbnail = v;
+}
+
+/**
+ * setFileOpener()
+ *
+ * Replace the function used to open input files
+ *
+ * parameters
+ *  [in] opener : called like fopen() with mode "rb", or NULL for fopen()
+ *
+ * note
+ * Output files are always opened with fopen().
+ */
+void setFileOpener(FILE *(*opener)(const char*, const char*))
+{
+    FileOpener = opener ? opener : fopen;
+}
+
 /**
  * removeExifSegmentFromJPEGFile()
  *
@@ -150,7 +259,7 @@ int removeExifSegmentFromJPEGFile(const char *inJPEGFileName,
     unsigned char buf[8192], *p;
     FILE *fpr = NULL, *fpw = NULL;
 
-    fpr = fopen(inJPEGFileName, "rb");
+    fpr = FileOpener(inJPEGFileName, "rb");
     if (!fpr) {
         sts = ERR_READ_FILE;
         goto DONE;
@@ -221,9 +330,10 @@ DONE:
  * createIfdTableArray()
  *
  * Parse the JPEG header and create the pointer array of the IFD tables
+ * TIFF-based files (TIFF, DNG, CR2, NEF, ARW, ...) are also accepted
  *
  * parameters
- *  [in] JPEGFileName : target JPEG file
+ *  [in] JPEGFileName : target JPEG or TIFF-based file
  *  [out] result : result status value 
  *   n: number of IFD tables
  *   0: the Exif segment is not found
@@ -232,12 +342,36 @@ DONE:
  *      ERR_INVALID_JPEG
  *      ERR_INVALID_APP1HEADER
  *      ERR_INVALID_IFD
+ *      ERR_UNKNOWN_FORMAT
  *
  * return
  *   NULL: error or no Exif segment
  *  !NULL: pointer array of the IFD tables
  */
 void **createIfdTableArray(const char *JPEGFileName, int *result)
+{
+    return createIfdTableArrayAndXmp(JPEGFileName, result, NULL, NULL);
+}
+
+/**
+ * createIfdTableArrayAndXmp()
+ *
+ * Same as createIfdTableArray(), but for a JPEG file whose Exif data
+ * has no GPS position also read its XMP packet in the same pass
+ *
+ * parameters
+ *  [in] JPEGFileName : target JPEG or TIFF-based file
+ *  [out] result : result status value, as for createIfdTableArray()
+ *  [out] pXmp : the XMP packet, NUL-terminated (must be freed by the
+ *               caller), or NULL
+ *  [out] pXmpLength : length of the packet
+ *
+ * return
+ *   NULL: error or no Exif segment
+ *  !NULL: pointer array of the IFD tables
+ */
+void **createIfdTableArrayAndXmp(const char *JPEGFileName, int *result,
+                                 unsigned char **pXmp, unsigned int *pXmpLength)
 {
     #define FMT_ERR "critical error in %s IFD\n"
 
@@ -251,16 +385,21 @@ void **createIfdTableArray(const char *JPEGFileName, int *result)
 
     ifd_0th = ifd_exif = ifd_gps = ifd_io = ifd_1st = NULL;
     memset(ifdArray, 0, sizeof(ifdArray));
+    if (pXmp) {
+        *pXmp = NULL;
+        *pXmpLength = 0;
+    }
 
-    fp = fopen(JPEGFileName, "rb");
+    fp = FileOpener(JPEGFileName, "rb");
     if (!fp) {
         sts = ERR_READ_FILE;
         goto DONE;
     }
-    sts = init(fp);
+    sts = initAnyFormat(fp);
     if (sts <= 0) {
         goto DONE;
     }
+    clearReadSpans();
     if (Verbose) {
         printf("system: %s-endian\n  data: %s-endian\n", 
             systemIsLittleEndian() ? "little" : "big",
@@ -352,9 +491,18 @@ DONE:
             ppIfdArray[i] = ifdArray[i];
         }
     }
+    // the XMP packet of a JPEG file is only wanted for its position,
+    // so it is not read when the Exif data holds one
+    if (pXmp && fp && FileIsJpeg && sts != ERR_READ_FILE &&
+        (!ifd_gps ||
+         !getTagNodePtrFromIfd(ifd_gps, TAG_GPSLatitude) ||
+         !getTagNodePtrFromIfd(ifd_gps, TAG_GPSLongitude))) {
+        *pXmp = readXmpOfJpeg(fp, pXmpLength);
+    }
     if (fp) {
         fclose(fp);
     }
+    clearReadSpans();
     return ppIfdArray;
 }
 
@@ -406,18 +554,90 @@ IFD_TYPE getIfdType(void *pIfd)
 
 void dumpIfdTable(void *pIfd)
 {
-    _dumpIfdTable(pIfd, NULL);
+    writeIfdTableDump(pIfd, stdout);
 }
 
+/**
+ * getIfdTableDump()
+ *
+ * Get the dump of the IFD table as a string
+ *
+ * parameters
+ *  [in] pIfd: target IFD
+ *  [out] pp: the dump, to be freed by the caller; NULL if
+ *            there was nothing to dump or memory ran out
+ */
 void getIfdTableDump(void *pIfd, char **pp)
 {
-    if (pp) {
-        *pp = NULL;
+    DUMP_SINK sink = {NULL, -1, NULL, 0, 0, 0};
+    if (!pp) {
+        dumpIfdTable(pIfd);
+        return;
+    }
+    *pp = NULL;
+    _dumpIfdTable(pIfd, &sink);
+    if (sink.error) {
+        free(sink.text);
+        return;
+    }
+    *pp = sink.text;
+}
+
+/**
+ * writeIfdTableDump()
+ *
+ * Write the dump of the IFD table to a stream
+ *
+ * parameters
+ *  [in] pIfd: target IFD
+ *  [in] fp: stream to write to
+ *
+ * return
+ *   0: OK
+ *  -n: error
+ *      ERR_INVALID_POINTER
+ *      ERR_WRITE_FILE
+ */
+int writeIfdTableDump(void *pIfd, FILE *fp)
+{
+    DUMP_SINK sink = {fp, -1, NULL, 0, 0, 0};
+    if (!fp) {
+        return ERR_INVALID_POINTER;
+    }
+    _dumpIfdTable(pIfd, &sink);
+    return sink.error;
+}
+
+/**
+ * writeIfdTableDumpToFd()
+ *
+ * Write the dump of the IFD table to a file descriptor,
+ * through a buffer flushed every DUMP_FLUSH_SIZE bytes
+ *
+ * parameters
+ *  [in] pIfd: target IFD
+ *  [in] fd: descriptor to write to
+ *
+ * return
+ *   0: OK
+ *  -n: error
+ *      ERR_INVALID_POINTER
+ *      ERR_MEMALLOC
+ *      ERR_WRITE_FILE
+ */
+int writeIfdTableDumpToFd(void *pIfd, int fd)
+{
+    DUMP_SINK sink = {NULL, fd, NULL, 0, 0, 0};
+    if (fd < 0) {
+        return ERR_INVALID_POINTER;
     }
-    _dumpIfdTable(pIfd, pp);
+    _dumpIfdTable(pIfd, &sink);
+    dumpFlush(&sink);
+    free(sink.text);
+    return sink.error;
 }
 
-static void _dumpIfdTable(void *pIfd, char **p)
+static void _dumpIfdTable(void *pIfd, DUMP_SINK *sink)
 {
     int i;
     IfdTable *ifd;
@@ -431,7 +651,7 @@ static void _dumpIfdTable(void *pIfd, char **p)
     }
     ifd = (IfdTable*)pIfd;
 
-    PRINTF(p, "\n{%s IFD}",
+    dumpPrintf(sink, "\n{%s IFD}",
         (ifd->ifdType == IFD_0TH)  ? "0TH" :
         (ifd->ifdType == IFD_1ST)  ? "1ST" :
         (ifd->ifdType == IFD_EXIF) ? "EXIF" :
@@ -439,57 +659,57 @@ static void _dumpIfdTable(void *pIfd, char **p)
         (ifd->ifdType == IFD_IO)   ? "Interoperability" : "");
 
     if (Verbose) {
-        PRINTF(p, " tags=%u\n", ifd->tagCount);
+        dumpPrintf(sink, " tags=%u\n", ifd->tagCount);
     } else {
-        PRINTF(p, "\n");
+        dumpPrintf(sink, "\n");
     }
 
     tag = ifd->tags;
     while (tag) {
         if (Verbose) {
-            PRINTF(p, "tag[%02d] 0x%04X %s\n",
+            dumpPrintf(sink, "tag[%02d] 0x%04X %s\n",
                 cnt++, tag->tagId, getTagName(ifd->ifdType, tag->tagId));
-            PRINTF(p, "\ttype=%u count=%u ", tag->type, tag->count);
-            PRINTF(p, "val=");
+            dumpPrintf(sink, "\ttype=%u count=%u ", tag->type, tag->count);
+            dumpPrintf(sink, "val=");
         } else {
             strcpy(tagName, getTagName(ifd->ifdType, tag->tagId));
-            PRINTF(p, " - %s: ", (strlen(tagName) > 0) ? tagName : "(unknown)");
+            dumpPrintf(sink, " - %s: ", (strlen(tagName) > 0) ? tagName : "(unknown)");
         }
         if (tag->error) {
-            PRINTF(p, "(error)");
+            dumpPrintf(sink, "(error)");
         } else {
             switch (tag->type) {
             case TYPE_BYTE:
                 for (i = 0; i < (int)tag->count; i++) {
-                    PRINTF(p, "%u ", (unsigned char)tag->numData[i]);
+                    dumpPrintf(sink, "%u ", (unsigned char)tag->numData[i]);
                 }
                 break;
 
             case TYPE_ASCII:
-                PRINTF(p, "[%s]", (char*)tag->byteData);
+                dumpPrintf(sink, "[%s]", (char*)tag->byteData);
                 break;
 
             case TYPE_SHORT:
                 for (i = 0; i < (int)tag->count; i++) {
-                    PRINTF(p, "%hu ", (unsigned short)tag->numData[i]);
+                    dumpPrintf(sink, "%hu ", (unsigned short)tag->numData[i]);
                 }
                 break;
 
             case TYPE_LONG:
                 for (i = 0; i < (int)tag->count; i++) {
-                    PRINTF(p, "%u ", tag->numData[i]);
+                    dumpPrintf(sink, "%u ", tag->numData[i]);
                 }
                 break;
 
             case TYPE_RATIONAL:
                 for (i = 0; i < (int)tag->count; i++) {
-                    PRINTF(p, "%u/%u ", tag->numData[i*2], tag->numData[i*2+1]);
+                    dumpPrintf(sink, "%u/%u ", tag->numData[i*2], tag->numData[i*2+1]);
                 }
                 break;
 
             case TYPE_SBYTE:
                 for (i = 0; i < (int)tag->count; i++) {
-                    PRINTF(p, "%d ", (char)tag->numData[i]);
+                    dumpPrintf(sink, "%d ", (char)tag->numData[i]);
                 }
                 break;
 
@@ -502,31 +722,31 @@ static void _dumpIfdTable(void *pIfd, char **p)
                 for (i = 0; i < (int)count; i++) {
                     // if character is printable
                     if (isgraph(tag->byteData[i])) {
-                        PRINTF(p, "%c ", tag->byteData[i]);
+                        dumpPrintf(sink, "%c ", tag->byteData[i]);
                     } else {
-                        PRINTF(p, "0x%02x ", tag->byteData[i]);
+                        dumpPrintf(sink, "0x%02x ", tag->byteData[i]);
                     }
                 }
                 if (count < tag->count) {
-                    PRINTF(p, "(omitted)");
+                    dumpPrintf(sink, "(omitted)");
                 }
                 break;
 
             case TYPE_SSHORT:
                 for (i = 0; i < (int)tag->count; i++) {
-                    PRINTF(p, "%hd ", (short)tag->numData[i]);
+                    dumpPrintf(sink, "%hd ", (short)tag->numData[i]);
                 }
                 break;
 
             case TYPE_SLONG:
                 for (i = 0; i < (int)tag->count; i++) {
-                    PRINTF(p, "%d ", (int)tag->numData[i]);
+                    dumpPrintf(sink, "%d ", (int)tag->numData[i]);
                 }
                 break;
 
             case TYPE_SRATIONAL:
                 for (i = 0; i < (int)tag->count; i++) {
-                    PRINTF(p, "%d/%d ", (int)tag->numData[i*2], (int)tag->numData[i*2+1]);
+                    dumpPrintf(sink, "%d/%d ", (int)tag->numData[i*2], (int)tag->numData[i*2+1]);
                 }
                 break;
 
@@ -534,7 +754,7 @@ static void _dumpIfdTable(void *pIfd, char **p)
                 break;
             }
         }
-        PRINTF(p, "\n");
+        dumpPrintf(sink, "\n");
 
         tag = tag->next;
     }
@@ -615,6 +835,59 @@ TagNodeInfo *getTagInfoFromIfd(void *ifd,
     return (TagNodeInfo*)getTagNodePtrFromIfd(ifd, tagId);
 }
 
+/**
+ * getNextTagInfoFromIfd()
+ *
+ * Walk the tags of the IFD in the order they were read
+ *
+ * parameters
+ *  [in] ifd : target IFD table
+ *  [in] tag : the tag returned before, or NULL for the first one
+ *
+ * return
+ *  NULL: no more tags
+ *  !NULL: address of the TagNodeInfo structure, which belongs
+ *         to the IFD table and must not be freed
+ */
+TagNodeInfo *getNextTagInfoFromIfd(void *ifd,
+                                   TagNodeInfo *tag)
+{
+    if (!ifd) {
+        return NULL;
+    }
+    if (!tag) {
+        return (TagNodeInfo*)((IfdTable*)ifd)->tags;
+    }
+    return (TagNodeInfo*)((TagNode*)tag)->next;
+}
+
+/**
+ * getTagNameFromId()
+ *
+ * Get the name of the tag
+ *
+ * parameters
+ *  [in] ifdType : IFD TYPE the tag was found in
+ *  [in] tagId : target tag ID
+ *
+ * return
+ *  NULL: the tag is unknown
+ *  !NULL: the name, valid until the next call on the same thread
+ */
+const char *getTagNameFromId(IFD_TYPE ifdType,
+                             unsigned short tagId)
+{
+    const char *name;
+    if (ifdType < IFD_0TH || ifdType > IFD_IO) {
+        return NULL;
+    }
+    name = getTagName(ifdType, tagId);
+    if (strcmp(name, "(unknown)") == 0) {
+        return NULL;
+    }
+    return name;
+}
+
 /**
  * freeTagInfo()
  *
@@ -994,6 +1267,40 @@ unsigned char *getThumbnailDataOnIfdTableArray(void **ifdTableArray,
     return retp;
 }
 
+/**
+ * getThumbnailRangeOnIfdTableArray()
+ *
+ * Get where the thumbnail data of the 1st IFD table lies in the file
+ * it was parsed from, so that it can be read without the main image
+ *
+ * parameters
+ *  [in] ifdTableArray : address of the IFD tables array
+ *  [out] pOffset : returns the offset from the beginning of the file
+ *  [out] pLength : returns the length of the thumbnail data
+ *
+ * return
+ *   0: OK
+ *  -n: error
+ *      ERR_INVALID_POINTER
+ *      ERR_NOT_EXIST
+ */
+int getThumbnailRangeOnIfdTableArray(void **ifdTableArray,
+                                     unsigned int *pOffset,
+                                     unsigned int *pLength)
+{
+    IfdTable *ifd;
+    if (!ifdTableArray || !pOffset || !pLength) {
+        return ERR_INVALID_POINTER;
+    }
+    ifd = getIfdTableFromIfdTableArray(ifdTableArray, IFD_1ST);
+    if (!ifd || ifd->pFileLength == 0) {
+        return ERR_NOT_EXIST;
+    }
+    *pOffset = ifd->pFileOffset;
+    *pLength = ifd->pFileLength;
+    return 0;
+}
+
 /**
  * setThumbnailDataOnIfdTableArray()
  *
@@ -1050,6 +1357,8 @@ int setThumbnailDataOnIfdTableArray(void **ifdTableArray,
         addTagNodeToIfd(ifd, TAG_JPEGInterchangeFormat,
                             TYPE_LONG, 1, &zero, NULL);
     }
+    // the new data no longer comes from the file
+    ifd->pFileOffset = ifd->pFileLength = 0;
     ifd->p = (unsigned char*)malloc(length);
     if (!ifd->p) {
         return ERR_MEMALLOC;
@@ -1093,7 +1402,7 @@ int updateExifSegmentInJPEGFile(const char *inJPEGFileName,
     if (sts != 0) {
         goto DONE;
     }
-    fpr = fopen(inJPEGFileName, "rb");
+    fpr = FileOpener(inJPEGFileName, "rb");
     if (!fpr) {
         sts = ERR_READ_FILE;
         goto DONE;
@@ -1196,9 +1505,6 @@ DONE:
 int removeAdobeMetadataSegmentFromJPEGFile(const char *inJPEGFileName,
                                            const char *outJPGEFileName)
 {
-#define ADOBE_METADATA_ID     "http://ns.adobe.com/xap/"
-#define ADOBE_METADATA_ID_LEN 24
-
     typedef struct _SegmentHeader {
         unsigned short marker;
         unsigned short length;
@@ -1211,7 +1517,7 @@ int removeAdobeMetadataSegmentFromJPEGFile(const char *inJPEGFileName,
     unsigned char buf[8192], *p;
     FILE *fpr = NULL, *fpw = NULL;
 
-    fpr = fopen(inJPEGFileName, "rb");
+    fpr = FileOpener(inJPEGFileName, "rb");
     if (!fpr) {
         sts = ERR_READ_FILE;
         goto DONE;
@@ -1287,8 +1593,144 @@ DONE:
     return sts;
 }
 
+/**
+ * getXmpPacketFromJPEGFile()
+ *
+ * Read Adobe's XMP metadata packet from a JPEG file
+ *
+ * parameters
+ *  [in] JPEGFileName : target JPEG file
+ *  [out] pLength : length of the packet
+ *  [out] pResult : result status value
+ *   1: OK
+ *   0: Adobe's metadata segment is not found
+ *  -n: error
+ *      ERR_READ_FILE
+ *      ERR_INVALID_JPEG
+ *      ERR_INVALID_APP1HEADER
+ *      ERR_MEMALLOC
+ *
+ * return
+ *   NULL: error or no XMP packet
+ *  !NULL: the packet, NUL-terminated (must be freed by the caller)
+ */
+unsigned char *getXmpPacketFromJPEGFile(const char *JPEGFileName,
+                                        unsigned int *pLength,
+                                        int *pResult)
+{
+    unsigned char *p;
+    int sts;
+    FILE *fp;
+
+    *pLength = 0;
+    fp = FileOpener(JPEGFileName, "rb");
+    if (!fp) {
+        *pResult = ERR_READ_FILE;
+        return NULL;
+    }
+    sts = getApp1StartOffset(fp, ADOBE_METADATA_ID, ADOBE_METADATA_ID_LEN, NULL);
+    p = readXmpPacket(fp, sts, pLength, pResult);
+    fclose(fp);
+    return p;
+}
+
 // private functions
 
+/**
+ * Read the XMP packet of the APP1 segment starting at file offset sts,
+ * as found by getApp1StartOffset(), for getXmpPacketFromJPEGFile()
+ */
+static unsigned char *readXmpPacket(FILE *fp, int sts, unsigned int *pLength,
+                                    int *pResult)
+{
+    unsigned short len;
+    unsigned char *p = NULL;
+    unsigned int i, idLen;
+
+    *pLength = 0;
+    if (sts <= 0) { // target segment is not exist or something error
+        goto DONE;
+    }
+    // the segment length follows the marker and counts itself
+    if (fseek(fp, sts + sizeof(short), SEEK_SET) != 0 ||
+        fread(&len, 1, sizeof(short), fp) < sizeof(short)) {
+        sts = ERR_READ_FILE;
+        goto DONE;
+    }
+    if (systemIsLittleEndian()) {
+        len = swab16(len);
+    }
+    if (len <= sizeof(short) + ADOBE_METADATA_ID_LEN) {
+        sts = ERR_INVALID_APP1HEADER;
+        goto DONE;
+    }
+    len -= sizeof(short);
+    p = (unsigned char*)malloc(len + 1);
+    if (!p) {
+        sts = ERR_MEMALLOC;
+        goto DONE;
+    }
+    if (fread(p, 1, len, fp) < len) {
+        sts = ERR_READ_FILE;
+        goto DONE;
+    }
+    if (memcmp(p, ADOBE_METADATA_ID, ADOBE_METADATA_ID_LEN) != 0) {
+        sts = ERR_INVALID_APP1HEADER;
+        goto DONE;
+    }
+    // the namespace ID ("http://ns.adobe.com/xap/1.0/") ends with NUL
+    for (i = ADOBE_METADATA_ID_LEN; i < len && p[i] != 0; i++);
+    if (i >= len) {
+        sts = ERR_INVALID_APP1HEADER;
+        goto DONE;
+    }
+    idLen = i + 1;
+    memmove(p, p + idLen, len - idLen);
+    p[len - idLen] = 0;
+    *pLength = len - idLen;
+    sts = 1;
+DONE:
+    if (sts <= 0 && p) {
+        free(p);
+        p = NULL;
+    }
+    *pResult = sts;
+    return p;
+}
+
+/**
+ * Read the XMP packet of the JPEG file whose Exif segment was just
+ * looked for by init(). The XMP segment was either passed on the way,
+ * or lies after the Exif segment, so the markers before are not
+ * walked again.
+ */
+static unsigned char *readXmpOfJpeg(FILE *fp, unsigned int *pLength)
+{
+    unsigned short len, marker;
+    int sts = XmpStartOffset, result;
+
+    if (sts <= 0 && App1StartOffset > 0) {
+        // resume the marker walk after the Exif segment
+        if (fseek(fp, App1StartOffset + sizeof(short), SEEK_SET) != 0 ||
+            fread(&len, 1, sizeof(short), fp) < sizeof(short)) {
+            return NULL;
+        }
+        if (systemIsLittleEndian()) {
+            len = swab16(len);
+        }
+        if (fseek(fp, len - sizeof(short), SEEK_CUR) != 0 ||
+            fread(&marker, 1, sizeof(short), fp) < sizeof(short)) {
+            return NULL;
+        }
+        if (systemIsLittleEndian()) {
+            marker = swab16(marker);
+        }
+        sts = findApp1Segment(fp, marker, ADOBE_METADATA_ID,
+                              ADOBE_METADATA_ID_LEN, NULL);
+    }
+    return readXmpPacket(fp, sts, pLength, &result);
+}
+
 static int dataIsLittleEndian()
 {
     return (App1Header.tiff.byteOrder == 0x4949) ? 1 : 0;
@@ -1326,38 +1768,175 @@ static unsigned int fix_int(unsigned int ui)
 
 static int seekToRelativeOffset(FILE *fp, unsigned int ofs)
 {
-    static int start = offsetof(APP1_HEADER, tiff);
-    return fseek(fp, (App1StartOffset + start) + ofs, SEEK_SET);
+    return fseek(fp, (long)TiffHeaderOffset + ofs, SEEK_SET);
 }
 
-static char *getTagName(int ifdType, unsigned short tagId)
+/**
+ * Get the number of bytes taken by the values of a tag
+ *
+ * return
+ *   n: the length, or 0xFFFFFFFF if it does not fit
+ */
+static unsigned int getValueLength(unsigned short type, unsigned int count)
 {
-    static char tagName[128];
-    if (ifdType == IFD_0TH || ifdType == IFD_1ST || ifdType == IFD_EXIF) {
-        strcpy(tagName,
-            (tagId == 0x0100) ? "ImageWidth" :
-            (tagId == 0x0101) ? "ImageLength" :
-            (tagId == 0x0102) ? "BitsPerSample" :
-            (tagId == 0x0103) ? "Compression" :
-            (tagId == 0x0106) ? "PhotometricInterpretation" :
-            (tagId == 0x0112) ? "Orientation" :
-            (tagId == 0x0115) ? "SamplesPerPixel" :
-            (tagId == 0x011C) ? "PlanarConfiguration" :
-            (tagId == 0x0212) ? "YCbCrSubSampling" :
-            (tagId == 0x0213) ? "YCbCrPositioning" :
-            (tagId == 0x011A) ? "XResolution" :
-            (tagId == 0x011B) ? "YResolution" :
-            (tagId == 0x0128) ? "ResolutionUnit" :
+    unsigned long long size = 0;
+    switch (type) {
+    case TYPE_BYTE: case TYPE_SBYTE: case TYPE_ASCII: case TYPE_UNDEFINED:
+        size = 1;
+        break;
+    case TYPE_SHORT: case TYPE_SSHORT:
+        size = 2;
+        break;
+    case TYPE_LONG: case TYPE_SLONG:
+        size = 4;
+        break;
+    case TYPE_RATIONAL: case TYPE_SRATIONAL:
+        size = 8;
+        break;
+    }
+    size *= count;
+    return (size > 0xFFFFFFFFULL) ? 0xFFFFFFFF : (unsigned int)size;
+}
 
-            (tagId == 0x0111) ? "StripOffsets" :
-            (tagId == 0x0116) ? "RowsPerStrip" :
-            (tagId == 0x0117) ? "StripByteCounts" :
-            (tagId == 0x0201) ? "JPEGInterchangeFormat" :
-            (tagId == 0x0202) ? "JPEGInterchangeFormatLength" :
+static int compareReadRanges(const void *a, const void *b)
+{
+    unsigned int x = ((const READ_RANGE*)a)->offset;
+    unsigned int y = ((const READ_RANGE*)b)->offset;
+    return (x > y) - (x < y);
+}
 
-            (tagId == 0x012D) ? "TransferFunction" :
-            (tagId == 0x013E) ? "WhitePoint" :
-            (tagId == 0x013F) ? "PrimaryChromaticities" :
+/**
+ * Free the spans read ahead for the current file
+ */
+static void clearReadSpans(void)
+{
+    int i;
+    for (i = 0; i < ReadSpanCount; i++) {
+        free(ReadSpans[i].data);
+    }
+    ReadSpanCount = 0;
+}
+
+/**
+ * Read ahead the given ranges (relative to the TIFF header)
+ *
+ * Ranges already held are dropped; the rest are sorted and merged
+ * wherever the gap between them is at most READ_GAP bytes, so that
+ * each merged span costs a single seek and read. On storage where a
+ * round trip costs more than the bytes, this keeps the number of
+ * requests per IFD to about one. Spans that cannot be read are
+ * skipped; readRelative() then falls back to reading directly.
+ *
+ * parameters
+ *  [in] fp: file pointer of opened file
+ *  [in,out] ranges: the ranges to read (reordered)
+ *  [in] count: number of ranges
+ */
+static void prefetchRanges(FILE *fp, READ_RANGE *ranges, int count)
+{
+    int i, j, kept = 0;
+    unsigned int start, end;
+
+    for (i = 0; i < count; i++) {
+        READ_RANGE r = ranges[i];
+        int held = 0;
+        if (r.offset >= TiffDataLength || r.length == 0) {
+            continue;
+        }
+        if (r.length > TiffDataLength - r.offset) {
+            r.length = TiffDataLength - r.offset; // windows may run past the end
+        }
+        for (j = 0; j < ReadSpanCount && !held; j++) {
+            held = r.offset >= ReadSpans[j].offset &&
+                   r.offset + r.length <= ReadSpans[j].offset + ReadSpans[j].length;
+        }
+        if (!held) {
+            ranges[kept++] = r;
+        }
+    }
+    qsort(ranges, kept, sizeof(READ_RANGE), compareReadRanges);
+
+    for (i = 0; i < kept && ReadSpanCount < MAX_READ_SPANS; i = j) {
+        READ_SPAN *span = &ReadSpans[ReadSpanCount];
+        size_t got;
+        start = ranges[i].offset;
+        end = start + ranges[i].length;
+        for (j = i + 1; j < kept; j++) {
+            unsigned int next = ranges[j].offset + ranges[j].length;
+            if (ranges[j].offset > end + READ_GAP ||
+                (next > end && next - start > READ_MAX_SPAN)) {
+                break;
+            }
+            if (next > end) {
+                end = next;
+            }
+        }
+        span->data = (unsigned char*)malloc(end - start);
+        if (!span->data) {
+            continue;
+        }
+        if (seekToRelativeOffset(fp, start) != 0 ||
+            (got = fread(span->data, 1, end - start, fp)) == 0) {
+            free(span->data);
+            continue;
+        }
+        span->offset = start;
+        span->length = (unsigned int)got;
+        ReadSpanCount++;
+    }
+}
+
+/**
+ * Read a range (relative to the TIFF header) from the spans read
+ * ahead, or from the file if no span holds all of it
+ *
+ * return
+ *   1: OK
+ *   0: error
+ */
+static int readRelative(FILE *fp, unsigned int ofs, void *dst, unsigned int len)
+{
+    int i;
+    for (i = 0; i < ReadSpanCount; i++) {
+        READ_SPAN *span = &ReadSpans[i];
+        if (ofs >= span->offset && len <= span->length &&
+            ofs - span->offset <= span->length - len) {
+            memcpy(dst, span->data + (ofs - span->offset), len);
+            return 1;
+        }
+    }
+    return seekToRelativeOffset(fp, ofs) == 0 &&
+           fread(dst, 1, len, fp) == len;
+}
+
+static char *getTagName(int ifdType, unsigned short tagId)
+{
+    static THREAD_LOCAL char tagName[128];
+    if (ifdType == IFD_0TH || ifdType == IFD_1ST || ifdType == IFD_EXIF) {
+        strcpy(tagName,
+            (tagId == 0x0100) ? "ImageWidth" :
+            (tagId == 0x0101) ? "ImageLength" :
+            (tagId == 0x0102) ? "BitsPerSample" :
+            (tagId == 0x0103) ? "Compression" :
+            (tagId == 0x0106) ? "PhotometricInterpretation" :
+            (tagId == 0x0112) ? "Orientation" :
+            (tagId == 0x0115) ? "SamplesPerPixel" :
+            (tagId == 0x011C) ? "PlanarConfiguration" :
+            (tagId == 0x0212) ? "YCbCrSubSampling" :
+            (tagId == 0x0213) ? "YCbCrPositioning" :
+            (tagId == 0x011A) ? "XResolution" :
+            (tagId == 0x011B) ? "YResolution" :
+            (tagId == 0x0128) ? "ResolutionUnit" :
+
+            (tagId == 0x0111) ? "StripOffsets" :
+            (tagId == 0x0116) ? "RowsPerStrip" :
+            (tagId == 0x0117) ? "StripByteCounts" :
+            (tagId == 0x0201) ? "JPEGInterchangeFormat" :
+            (tagId == 0x0202) ? "JPEGInterchangeFormatLength" :
+
+            (tagId == 0x012D) ? "TransferFunction" :
+            (tagId == 0x013E) ? "WhitePoint" :
+            (tagId == 0x013F) ? "PrimaryChromaticities" :
             (tagId == 0x0211) ? "YCbCrCoefficients" :
             (tagId == 0x0214) ? "ReferenceBlackWhite" :
 
@@ -2255,33 +2834,80 @@ static void *parseIFD(FILE *fp,
                       IFD_TYPE ifdType)
 {
     void *ifd;
-    unsigned char buf[8192];
+    unsigned char buf[8192], *table = NULL;
     unsigned short tagCount, us;
     unsigned int nextOffset = 0;
-    unsigned int *array, val, allocSize;
-    int size, cnt, i;
+    unsigned int *array, val, allocSize, tableSize;
+    int size, cnt, i, rangeCount;
     size_t len;
-    int pos;
-    
-    // get the count of the tags
-    if (seekToRelativeOffset(fp, startOffset) != 0 ||
-        fread(&tagCount, 1, sizeof(short), fp) < sizeof(short)) {
+    READ_RANGE range, *ranges = NULL;
+
+    // get the count of the tags, reading ahead for the entries that follow
+    range.offset = startOffset;
+    range.length = IFD_WINDOW;
+    prefetchRanges(fp, &range, 1);
+    if (!readRelative(fp, startOffset, &tagCount, sizeof(short))) {
         return NULL;
     }
     tagCount = fix_short(tagCount);
-    pos = ftell(fp);
+
+    // read all entries and the next IFD's offset at once
+    tableSize = sizeof(IFD_TAG) * tagCount + sizeof(int);
+    table = (unsigned char*)malloc(tableSize);
+    if (!table) {
+        return NULL;
+    }
+    if (!readRelative(fp, startOffset + sizeof(short), table, tableSize)) {
+        // the 1st IFD's offset is only needed after the 0th IFD
+        if (ifdType == IFD_0TH ||
+            !readRelative(fp, startOffset + sizeof(short), table, tableSize - sizeof(int))) {
+            free(table);
+            return NULL;
+        }
+        memset(table + tableSize - sizeof(int), 0, sizeof(int));
+    }
 
     // in case of the 0th IFD, check the offset of the 1st IFD
     if (ifdType == IFD_0TH) {
         // next IFD's offset is at the tail of the segment
-        if (seekToRelativeOffset(fp,
-                sizeof(TIFF_HEADER) + sizeof(short) + sizeof(IFD_TAG) * tagCount) != 0 ||
-            fread(&nextOffset, 1, sizeof(int), fp) < sizeof(int)) {
-            return NULL;
-        }
+        memcpy(&nextOffset, table + sizeof(IFD_TAG) * tagCount, sizeof(int));
         nextOffset = fix_int(nextOffset);
-        fseek(fp, pos, SEEK_SET);
     }
+
+    // plan the reads of all values stored outside the entries, and of
+    // the IFDs pointed to from here, then read them in as few spans as
+    // possible
+    ranges = (READ_RANGE*)malloc(sizeof(READ_RANGE) * (tagCount + 1));
+    rangeCount = 0;
+    for (cnt = 0; ranges && cnt < tagCount; cnt++) {
+        IFD_TAG tag;
+        unsigned int valueLen;
+        memcpy(&tag, table + sizeof(IFD_TAG) * cnt, sizeof(tag));
+        tag.tag = fix_short(tag.tag);
+        tag.type = fix_short(tag.type);
+        tag.count = fix_int(tag.count);
+        tag.offset = fix_int(tag.offset);
+        valueLen = getValueLength(tag.type, tag.count);
+        if (valueLen > 4 && valueLen < TiffDataLength) {
+            ranges[rangeCount].offset = tag.offset;
+            ranges[rangeCount++].length = valueLen;
+        } else if (tag.count == 1 && tag.offset != 0 &&
+                   (tag.tag == TAG_ExifIFDPointer ||
+                    tag.tag == TAG_GPSInfoIFDPointer ||
+                    tag.tag == TAG_InteroperabilityIFDPointer)) {
+            ranges[rangeCount].offset = tag.offset;
+            ranges[rangeCount++].length = IFD_WINDOW;
+        }
+    }
+    if (ranges && nextOffset != 0) {
+        ranges[rangeCount].offset = nextOffset;
+        ranges[rangeCount++].length = IFD_WINDOW;
+    }
+    if (ranges) {
+        prefetchRanges(fp, ranges, rangeCount);
+        free(ranges);
+    }
+
     // create new IFD table
     ifd = createIfdTable(ifdType, tagCount, nextOffset);
 
@@ -2289,16 +2915,12 @@ static void *parseIFD(FILE *fp,
     for (cnt = 0; cnt < tagCount; cnt++) {
         IFD_TAG tag;
         unsigned char data[4];
-        if (fseek(fp, pos, SEEK_SET) != 0 ||
-            fread(&tag, 1, sizeof(tag), fp) < sizeof(tag)) {
-            goto ERR;
-        }
+        memcpy(&tag, table + sizeof(IFD_TAG) * cnt, sizeof(tag));
         memcpy(data, &tag.offset, 4); // keep raw data temporary
         tag.tag = fix_short(tag.tag);
         tag.type = fix_short(tag.type);
         tag.count = fix_int(tag.count);
         tag.offset = fix_int(tag.offset);
-        pos = ftell(fp);
 
         //printf("tag=0x%04X type=%u count=%u offset=%u name=[%s]\n",
         //  tag.tag, tag.type, tag.count, tag.offset, getTagName(ifdType, tag.tag));
@@ -2313,7 +2935,7 @@ static void *parseIFD(FILE *fp,
                 unsigned char *p = buf;
                 if (tag.count > sizeof(buf)) {
                     // allocate new buffer if needed
-                    if (tag.count >= App1Header.length) { // illegal
+                    if (tag.count >= TiffDataLength) { // illegal
                         p = NULL;
                     } else {
                         p = (unsigned char*)malloc(tag.count);
@@ -2325,8 +2947,7 @@ static void *parseIFD(FILE *fp,
                     }
                     memset(p, 0, tag.count);
                 }
-                if (seekToRelativeOffset(fp, tag.offset) != 0 ||
-                    fread(p, 1, tag.count, fp) < tag.count) {
+                if (!readRelative(fp, tag.offset, p, tag.count)) {
                     if (p != &buf[0]) {
                         free(p);
                     }
@@ -2342,13 +2963,12 @@ static void *parseIFD(FILE *fp,
         else if (tag.type == TYPE_RATIONAL || tag.type == TYPE_SRATIONAL) {
             unsigned int realCount = tag.count * 2; // need double the space
             size_t len = realCount * sizeof(int);
-            if (len >= App1Header.length) { // illegal
+            if (len >= TiffDataLength) { // illegal
                 array = NULL;
             } else {
                 array = (unsigned int*)malloc(len);
                 if (array) {
-                    if (seekToRelativeOffset(fp, tag.offset) != 0 ||
-                        fread(array, 1, len , fp) < len) {
+                    if (!readRelative(fp, tag.offset, array, len)) {
                         free(array);
                         array = NULL;
                     } else {
@@ -2395,7 +3015,7 @@ static void *parseIFD(FILE *fp,
                 // for the sake of simplicity, using the 4bytes area for
                 // each numeric data type 
                 allocSize = sizeof(int) * tag.count;
-                if (allocSize >= App1Header.length) { // illegal
+                if (allocSize >= TiffDataLength) { // illegal
                     array = NULL;
                 } else {
                     array = (unsigned int*)malloc(allocSize);
@@ -2420,13 +3040,17 @@ static void *parseIFD(FILE *fp,
                         }
                     }
                 } else {
-                    if (seekToRelativeOffset(fp, tag.offset) != 0 ||
-                        fread(buf, 1, len , fp) < len) {
+                    // read the packed values into the array itself, then
+                    // widen them from the last one down so none is overwritten
+                    unsigned char *raw = (unsigned char*)array;
+                    if (!readRelative(fp, tag.offset, raw, len)) {
+                        free(array);
                         addTagNodeToIfd(ifd, tag.tag, tag.type, tag.count, NULL, NULL);
                         continue;
                     }
-                    for (i = 0; i < (int)tag.count; i++) {
-                        memcpy(&val, &buf[i*size], size);
+                    for (i = (int)tag.count - 1; i >= 0; i--) {
+                        val = 0;
+                        memcpy(&val, &raw[i*size], size);
                         if (size == sizeof(int)) {
                             val = fix_int(val);
                         } else if (size == sizeof(short)) {
@@ -2452,7 +3076,16 @@ static void *parseIFD(FILE *fp,
             tag = getTagNodePtrFromIfd(ifd, TAG_JPEGInterchangeFormatLength);
             if (tag) {
                 thumbnail_len = tag->numData[0];
+                // the thumbnail must lie within the Exif data
+                if (thumbnail_ofs >= TiffDataLength ||
+                    thumbnail_len > TiffDataLength - thumbnail_ofs) {
+                    thumbnail_len = 0;
+                }
                 if (thumbnail_len > 0) {
+                    ifdTable->pFileOffset = TiffHeaderOffset + thumbnail_ofs;
+                    ifdTable->pFileLength = thumbnail_len;
+                }
+                if (thumbnail_len > 0 && LoadThumbnail) {
                     ifdTable->p = (unsigned char*)malloc(thumbnail_len);
                     if (ifdTable->p) {
                         if (seekToRelativeOffset(fp, thumbnail_ofs) == 0) {
@@ -2475,12 +3108,8 @@ static void *parseIFD(FILE *fp,
             }
         }
     }
+    free(table);
     return ifd;
-ERR:
-    if (ifd) {
-        freeIfdTable(ifd);
-    }
-    return NULL;
 }
 
 
@@ -2545,12 +3174,11 @@ static int getApp1StartOffset(FILE *fp,
     #define EXIF_ID_STR     "Exif\0"
     #define EXIF_ID_STR_LEN 5
 
-    int pos;
-    unsigned char buf[64];
-    unsigned short len, marker;
+    unsigned short marker;
     if (!fp) {
         return ERR_READ_FILE;
     }
+    XmpStartOffset = -1;
     rewind(fp);
 
     // check JPEG SOI Marker (0xFFD8)
@@ -2579,6 +3207,29 @@ static int getApp1StartOffset(FILE *fp,
         return 0; // not found the Exif segment
     }
 
+    return findApp1Segment(fp, marker, App1IDString, App1IDStringLength,
+                           pDQTOffset);
+}
+
+/**
+ * Walk the application segments from the one whose marker was just
+ * read, looking for the APP1 segment with the given ID. An XMP
+ * segment passed on the way is remembered in XmpStartOffset.
+ *
+ * return
+ *   n: the start offset of the segment
+ *   0: the segment is not found
+ *  -n: error
+ */
+static int findApp1Segment(FILE *fp, unsigned short marker,
+                           const char *App1IDString,
+                           size_t App1IDStringLength, int *pDQTOffset)
+{
+    int pos;
+    size_t idLen;
+    unsigned char buf[64];
+    unsigned short len;
+
     pos = ftell(fp);
     for (;;) {
         // unexpected value. is not a APP[0-14] marker
@@ -2602,15 +3253,25 @@ static int getApp1StartOffset(FILE *fp,
                 return ERR_INVALID_JPEG;
             }
         } else {
-            // check if it is the Exif segment
-            if (fread(&buf, 1, App1IDStringLength, fp) < App1IDStringLength) {
+            // read enough to tell the wanted segment and XMP apart
+            idLen = (App1IDStringLength > ADOBE_METADATA_ID_LEN) ?
+                        App1IDStringLength : ADOBE_METADATA_ID_LEN;
+            if (len < sizeof(short) + idLen) {
+                idLen = (len > sizeof(short)) ? len - sizeof(short) : 0;
+            }
+            if (fread(&buf, 1, idLen, fp) < idLen) {
                 return ERR_READ_FILE;
             }
-            if (memcmp(buf, App1IDString, App1IDStringLength) == 0) {
-                // return the start offset of the Exif segment
+            if (idLen >= App1IDStringLength &&
+                memcmp(buf, App1IDString, App1IDStringLength) == 0) {
+                // return the start offset of the segment
                 return pos - sizeof(short);
             }
-            // if is not a Exif segment, move to next segment
+            if (idLen >= ADOBE_METADATA_ID_LEN && XmpStartOffset < 0 &&
+                memcmp(buf, ADOBE_METADATA_ID, ADOBE_METADATA_ID_LEN) == 0) {
+                XmpStartOffset = pos - sizeof(short);
+            }
+            // if is not the segment, move to next segment
             if (fseek(fp, pos, SEEK_SET) != 0 ||
                 fseek(fp, len, SEEK_CUR) != 0) {
                 return ERR_INVALID_JPEG;
@@ -2625,7 +3286,7 @@ static int getApp1StartOffset(FILE *fp,
         }
         pos = ftell(fp);
     }
-    return 0; // not found the Exif segment
+    return 0; // not found the segment
 }
 
 /**
@@ -2654,31 +3315,574 @@ static int init(FILE *fp)
     if (!readApp1SegmentHeader(fp)) {
         return ERR_INVALID_APP1HEADER;
     }
+    TiffHeaderOffset = App1StartOffset + offsetof(APP1_HEADER, tiff);
+    TiffDataLength = App1Header.length;
+    return 1;
+}
+
+/**
+ * Load a TIFF header found at the given file offset and make the IFD
+ * offsets relative to it
+ *
+ * parameters
+ *  [in] fp: file pointer of opened file
+ *  [in] ofs: file offset of the TIFF header
+ *  [in] length: number of bytes of Exif data from there on
+ *
+ * return
+ *   1: OK
+ *  -n: error
+ */
+static int readTiffHeader(FILE *fp, unsigned int ofs, unsigned int length)
+{
+    setDefaultApp1SegmentHader();
+    if (fseek(fp, (long)ofs, SEEK_SET) != 0 ||
+        fread(&App1Header.tiff, 1, sizeof(TIFF_HEADER), fp) <
+                                            sizeof(TIFF_HEADER)) {
+        return ERR_READ_FILE;
+    }
+    if (App1Header.tiff.byteOrder != 0x4D4D && // big-endian
+        App1Header.tiff.byteOrder != 0x4949) { // little-endian
+        return ERR_INVALID_APP1HEADER;
+    }
+    // TIFF version number, or the variants used by Olympus ("RO", "SR")
+    // and Panasonic (0x0055) raw files
+    App1Header.tiff.reserved = fix_short(App1Header.tiff.reserved);
+    if (App1Header.tiff.reserved != 0x002A &&
+        App1Header.tiff.reserved != 0x4F52 &&
+        App1Header.tiff.reserved != 0x5253 &&
+        App1Header.tiff.reserved != 0x0055) {
+        return ERR_INVALID_APP1HEADER;
+    }
+    App1Header.tiff.Ifd0thOffset = fix_int(App1Header.tiff.Ifd0thOffset);
+    App1StartOffset = -1;
+    TiffHeaderOffset = ofs;
+    TiffDataLength = length;
     return 1;
 }
 
-static void PRINTF(char **ms, const char *fmt, ...) {
-    char buf[4096];
-    char *p = NULL;
-    int len, cnt;
-    va_list args;
+/**
+ * Initialize for a TIFF-based file (TIFF, DNG and most camera RAW formats)
+ *
+ * The TIFF header is at the beginning of the file, so the IFDs are
+ * parsed in place and none of the image data is read.
+ *
+ * return
+ *   1: OK
+ *  -n: error
+ */
+static int initTiff(FILE *fp)
+{
+    long fileSize;
+    // no segment length here, so any value must fit in the file
+    if (fseek(fp, 0, SEEK_END) != 0 || (fileSize = ftell(fp)) < 0) {
+        return ERR_READ_FILE;
+    }
+    return readTiffHeader(fp, 0,
+        (fileSize > 0x7FFFFFFFL) ? 0x7FFFFFFF : (unsigned int)fileSize);
+}
+
+/**
+ * Initialize for Exif data embedded in a container chunk that starts
+ * at the given file offset; writers differ on whether an "Exif\0\0"
+ * identifier precedes the TIFF header
+ *
+ * return
+ *   1: OK
+ *  -n: error
+ */
+static int initEmbeddedTiff(FILE *fp, long ofs, unsigned long long length)
+{
+    unsigned char id[EXIF_ID_STR_LEN + 1];
+    if (length < sizeof(TIFF_HEADER) || ofs > 0x7FFFFFFFL ||
+        length > 0x7FFFFFFFULL - ofs) {
+        return ERR_INVALID_APP1HEADER;
+    }
+    if (fseek(fp, ofs, SEEK_SET) != 0 ||
+        fread(id, 1, sizeof(id), fp) < sizeof(id)) {
+        return ERR_READ_FILE;
+    }
+    if (memcmp(id, EXIF_ID_STR, EXIF_ID_STR_LEN) == 0) {
+        if (length < sizeof(id) + sizeof(TIFF_HEADER)) {
+            return ERR_INVALID_APP1HEADER;
+        }
+        ofs += sizeof(id);
+        length -= sizeof(id);
+    }
+    return readTiffHeader(fp, (unsigned int)ofs, (unsigned int)length);
+}
+
+// big-endian field of 0, 2, 4 or 8 bytes in an ISOBMFF box
+static unsigned long long readBoxField(const unsigned char *p, int size)
+{
+    unsigned long long v = 0;
+    int i;
+    for (i = 0; i < size; i++) {
+        v = (v << 8) | p[i];
+    }
+    return v;
+}
+
+/**
+ * Find a child box in a buffer holding the payload of an ISOBMFF box
+ *
+ * return
+ *   1: found, *body and *bodyLen set to the child's payload
+ *   0: not found
+ */
+static int findBox(const unsigned char *buf, size_t len, const char *type,
+                   const unsigned char **body, size_t *bodyLen)
+{
+    size_t pos = 0;
+    while (len - pos >= 8) {
+        unsigned long long size = readBoxField(buf + pos, 4);
+        size_t hdr = 8;
+        if (size == 1) {
+            if (len - pos < 16) {
+                return 0;
+            }
+            size = readBoxField(buf + pos + 8, 8);
+            hdr = 16;
+        } else if (size == 0) {
+            size = len - pos; // extends to the end
+        }
+        if (size < hdr || size > len - pos) {
+            return 0;
+        }
+        if (memcmp(buf + pos + 4, type, 4) == 0) {
+            *body = buf + pos + hdr;
+            *bodyLen = (size_t)size - hdr;
+            return 1;
+        }
+        pos += (size_t)size;
+    }
+    return 0;
+}
+
+/**
+ * Get the ID of the Exif item from the payload of an 'iinf' box
+ *
+ * return
+ *   n: the item ID
+ *   0: there is no Exif item
+ */
+static unsigned int findHeifExifItem(const unsigned char *p, size_t len)
+{
+    size_t pos;
+    unsigned int i, entryCount;
+    // full box header, then a 16 or 32 bit entry count
+    pos = (len > 0 && p[0] == 0) ? 6 : 8;
+    if (len < pos) {
+        return 0;
+    }
+    entryCount = (unsigned int)readBoxField(p + 4, (int)pos - 4);
+    for (i = 0; i < entryCount && len - pos >= 8; i++) {
+        const unsigned char *infe;
+        size_t infeLen;
+        unsigned long long size = readBoxField(p + pos, 4);
+        if (size < 8 || size > len - pos) {
+            return 0;
+        }
+        if (findBox(p + pos, (size_t)size, "infe", &infe, &infeLen) &&
+            infeLen > 0 && infe[0] >= 2) {
+            // only versions 2 and 3 carry an item type
+            int idSize = (infe[0] == 3) ? 4 : 2;
+            if (infeLen >= (size_t)(4 + idSize + 2 + 4) &&
+                memcmp(infe + 4 + idSize + 2, "Exif", 4) == 0) {
+                return (unsigned int)readBoxField(infe + 4, idSize);
+            }
+        }
+        pos += (size_t)size;
+    }
+    return 0;
+}
+
+/**
+ * Get the file range of an item from the payload of an 'iloc' box
+ * Only items stored as a single extent in the file are supported,
+ * which is how Exif is written in practice.
+ *
+ * return
+ *   1: found
+ *   0: not found or not stored in the file
+ */
+static int findHeifItemExtent(const unsigned char *p, size_t len,
+                              unsigned int itemId,
+                              unsigned long long *pOffset,
+                              unsigned long long *pLength)
+{
+    int version, offsetSize, lengthSize, baseOffsetSize, indexSize, idSize;
+    unsigned int i, j, itemCount, extentCount, id, method;
+    unsigned long long baseOffset;
+    size_t pos;
+    if (len < 10) {
+        return 0;
+    }
+    version = p[0];
+    offsetSize = p[4] >> 4;
+    lengthSize = p[4] & 0x0F;
+    baseOffsetSize = p[5] >> 4;
+    indexSize = (version == 1 || version == 2) ? (p[5] & 0x0F) : 0;
+    idSize = (version < 2) ? 2 : 4;
+    pos = 6;
+    itemCount = (unsigned int)readBoxField(p + pos, idSize);
+    pos += idSize;
+
+    for (i = 0; i < itemCount; i++) {
+        size_t itemLen = idSize + ((version == 1 || version == 2) ? 2 : 0) +
+                         2 + baseOffsetSize + 2;
+        if (len - pos < itemLen) {
+            return 0;
+        }
+        id = (unsigned int)readBoxField(p + pos, idSize);
+        pos += idSize;
+        method = 0;
+        if (version == 1 || version == 2) {
+            method = (unsigned int)readBoxField(p + pos, 2) & 0x0F;
+            pos += 2;
+        }
+        pos += 2; // data reference index
+        baseOffset = readBoxField(p + pos, baseOffsetSize);
+        pos += baseOffsetSize;
+        extentCount = (unsigned int)readBoxField(p + pos, 2);
+        pos += 2;
+        for (j = 0; j < extentCount; j++) {
+            size_t extentLen = indexSize + offsetSize + lengthSize;
+            if (len - pos < extentLen) {
+                return 0;
+            }
+            if (id == itemId) {
+                if (method != 0 || extentCount != 1) {
+                    return 0;
+                }
+                *pOffset = baseOffset +
+                    readBoxField(p + pos + indexSize, offsetSize);
+                *pLength = readBoxField(p + pos + indexSize + offsetSize, lengthSize);
+                return 1;
+            }
+            pos += extentLen;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Initialize for a HEIF file (HEIC, AVIF)
+ *
+ * Walks the top-level boxes by their sizes up to the 'meta' box, which
+ * is the only box read in full. The Exif item is located through its
+ * 'iinf' and 'iloc' entries; the image data in 'mdat' is never read.
+ *
+ * return
+ *   1: OK
+ *   0: the Exif item is not found
+ *  -n: error
+ */
+static int initHeif(FILE *fp)
+{
+    #define HEIF_MAX_META (4 * 1024 * 1024)
+
+    unsigned char hdr[16], *meta = NULL;
+    const unsigned char *iinf, *iloc;
+    size_t iinfLen, ilocLen, hdrLen;
+    unsigned long long size, exifOffset, exifLength;
+    unsigned int exifItem, tiffOffset;
+    long pos = 0;
+    int sts = 0;
+
+    for (;;) {
+        hdrLen = 8;
+        if (fseek(fp, pos, SEEK_SET) != 0 ||
+            fread(hdr, 1, 8, fp) < 8) {
+            return 0; // no 'meta' box before the end of the file
+        }
+        size = readBoxField(hdr, 4);
+        if (size == 1) {
+            if (fread(hdr + 8, 1, 8, fp) < 8) {
+                return ERR_READ_FILE;
+            }
+            size = readBoxField(hdr + 8, 8);
+            hdrLen = 16;
+        }
+        if (memcmp(hdr + 4, "meta", 4) == 0) {
+            if (size < hdrLen + 4 || size - hdrLen > HEIF_MAX_META) {
+                return ERR_INVALID_APP1HEADER;
+            }
+            break;
+        }
+        if (size == 0) {
+            return 0; // last box, and not 'meta'
+        }
+        if (size < hdrLen || size > 0x7FFFFFFFULL - pos) {
+            return ERR_INVALID_APP1HEADER;
+        }
+        pos += (long)size;
+    }
+
+    // read the whole 'meta' box; it holds the item tables only
+    size -= hdrLen;
+    meta = (unsigned char*)malloc((size_t)size);
+    if (!meta) {
+        return ERR_MEMALLOC;
+    }
+    if (fread(meta, 1, (size_t)size, fp) < (size_t)size) {
+        sts = ERR_READ_FILE;
+        goto DONE;
+    }
+    // skip the full box header of 'meta'
+    if (!findBox(meta + 4, (size_t)size - 4, "iinf", &iinf, &iinfLen) ||
+        !findBox(meta + 4, (size_t)size - 4, "iloc", &iloc, &ilocLen)) {
+        goto DONE;
+    }
+    exifItem = findHeifExifItem(iinf, iinfLen);
+    if (exifItem == 0 ||
+        !findHeifItemExtent(iloc, ilocLen, exifItem, &exifOffset, &exifLength)) {
+        goto DONE;
+    }
+
+    // the item starts with the offset of the TIFF header past that field
+    if (exifLength < 4 + sizeof(TIFF_HEADER) || exifOffset > 0x7FFFFFFFULL ||
+        fseek(fp, (long)exifOffset, SEEK_SET) != 0 ||
+        fread(hdr, 1, 4, fp) < 4) {
+        sts = ERR_INVALID_APP1HEADER;
+        goto DONE;
+    }
+    tiffOffset = (unsigned int)readBoxField(hdr, 4);
+    if (tiffOffset > exifLength - 4 - sizeof(TIFF_HEADER) ||
+        exifOffset + 4 + tiffOffset > 0x7FFFFFFFULL) {
+        sts = ERR_INVALID_APP1HEADER;
+        goto DONE;
+    }
+    sts = readTiffHeader(fp, (unsigned int)(exifOffset + 4 + tiffOffset),
+        (unsigned int)(exifLength - 4 - tiffOffset));
+
+DONE:
+    free(meta);
+    return sts;
+}
+
+/**
+ * Initialize for a PNG file
+ *
+ * Walks the chunks by their lengths, seeking past the image data, up
+ * to the 'eXIf' chunk, which holds a TIFF header and its IFDs.
+ *
+ * return
+ *   1: OK
+ *   0: there is no 'eXIf' chunk
+ *  -n: error
+ */
+static int initPng(FILE *fp)
+{
+    unsigned char hdr[8];
+    unsigned long long length;
+    long pos = 8; // past the signature
+
+    for (;;) {
+        if (fseek(fp, pos, SEEK_SET) != 0 ||
+            fread(hdr, 1, sizeof(hdr), fp) < sizeof(hdr)) {
+            return 0;
+        }
+        length = readBoxField(hdr, 4);
+        if (memcmp(hdr + 4, "eXIf", 4) == 0) {
+            return initEmbeddedTiff(fp, pos + 8, length);
+        }
+        if (memcmp(hdr + 4, "IEND", 4) == 0) {
+            return 0;
+        }
+        // chunk header, data and CRC
+        if (length + 12 > 0x7FFFFFFFULL - pos) {
+            return ERR_INVALID_APP1HEADER;
+        }
+        pos += (long)(length + 12);
+    }
+}
+
+/**
+ * Initialize for a WebP file
+ *
+ * Walks the RIFF chunks by their sizes, seeking past the image data,
+ * up to the 'EXIF' chunk, which holds a TIFF header and its IFDs.
+ *
+ * return
+ *   1: OK
+ *   0: there is no 'EXIF' chunk
+ *  -n: error
+ */
+static int initWebp(FILE *fp)
+{
+    unsigned char hdr[8];
+    unsigned long long size;
+    long pos = 12; // past "RIFF", the file size and "WEBP"
+
+    for (;;) {
+        if (fseek(fp, pos, SEEK_SET) != 0 ||
+            fread(hdr, 1, sizeof(hdr), fp) < sizeof(hdr)) {
+            return 0;
+        }
+        // RIFF sizes are little-endian
+        size = (unsigned long long)hdr[4] | (hdr[5] << 8) |
+               (hdr[6] << 16) | ((unsigned long long)hdr[7] << 24);
+        if (memcmp(hdr, "EXIF", 4) == 0) {
+            return initEmbeddedTiff(fp, pos + 8, size);
+        }
+        // chunk header, data and a pad byte to an even size
+        size += 8 + (size & 1);
+        if (size > 0x7FFFFFFFULL - pos) {
+            return ERR_INVALID_APP1HEADER;
+        }
+        pos += (long)size;
+    }
+}
+
+/**
+ * Check whether an 'ftyp' box names a HEIF brand, as its major brand
+ * or as one of the compatible brands within the first len bytes
+ */
+static int isHeifFile(const unsigned char *ftyp, size_t len)
+{
+    static const char *brands[] = {
+        "heic", "heix", "heim", "heis", "hevc", "hevx", "mif1", "msf1", "avif"
+    };
+    size_t pos, size = (size_t)readBoxField(ftyp, 4);
+    int i;
+    if (size < len) {
+        len = size;
+    }
+    // major brand at 8, minor version at 12, compatible brands from 16
+    for (pos = 8; pos + 4 <= len; pos += (pos == 8) ? 8 : 4) {
+        for (i = 0; i < (int)(sizeof(brands) / sizeof(brands[0])); i++) {
+            if (memcmp(ftyp + pos, brands[i], 4) == 0) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ * Initialize after sniffing the file format from its first bytes
+ *
+ * return
+ *   1: OK
+ *   0: the Exif segment is not found
+ *  -n: error
+ *      ERR_UNKNOWN_FORMAT: not JPEG, TIFF-based, HEIF, PNG or WebP
+ */
+static int initAnyFormat(FILE *fp)
+{
+    unsigned char magic[64];
+    size_t len;
+    FileIsJpeg = 0;
+    App1StartOffset = XmpStartOffset = -1;
+    rewind(fp);
+    len = fread(magic, 1, sizeof(magic), fp);
+    if (len < 12) {
+        return ferror(fp) ? ERR_READ_FILE : ERR_UNKNOWN_FORMAT;
+    }
+    if (magic[0] == 0xFF && magic[1] == 0xD8) {
+        FileIsJpeg = 1;
+        return init(fp);
+    }
+    if ((magic[0] == 'I' && magic[1] == 'I') ||
+        (magic[0] == 'M' && magic[1] == 'M')) {
+        return initTiff(fp);
+    }
+    if (memcmp(magic + 4, "ftyp", 4) == 0 && isHeifFile(magic, len)) {
+        return initHeif(fp);
+    }
+    if (memcmp(magic, "\x89PNG\r\n\x1a\n", 8) == 0) {
+        return initPng(fp);
+    }
+    if (memcmp(magic, "RIFF", 4) == 0 && memcmp(magic + 8, "WEBP", 4) == 0) {
+        return initWebp(fp);
+    }
+    return ERR_UNKNOWN_FORMAT;
+}
+
+/**
+ * dumpGrow()
+ *
+ * Make room for need more bytes and the terminating NUL in
+ * the text of a dump sink, at least doubling its size
+ */
+static int dumpGrow(DUMP_SINK *sink, size_t need)
+{
+    size_t size;
+    char *text;
+    if (sink->len + need < sink->size) {
+        return 1;
+    }
+    size = (sink->size) ? sink->size * 2 : 1024;
+    while (size <= sink->len + need) {
+        size *= 2;
+    }
+    text = (char*)realloc(sink->text, size);
+    if (!text) {
+        sink->error = ERR_MEMALLOC;
+        return 0;
+    }
+    sink->text = text;
+    sink->size = size;
+    return 1;
+}
+
+/**
+ * dumpPrintf()
+ *
+ * Append formatted text of any length to a dump sink, or
+ * write it straight to its stream if it has one
+ */
+static void dumpPrintf(DUMP_SINK *sink, const char *fmt, ...)
+{
+    va_list args, again;
+    int cnt;
+    if (sink->error) {
+        return;
+    }
     va_start(args, fmt);
-    cnt = vsnprintf(buf, sizeof(buf)-1, fmt, args);
-    if (!ms) {
-        printf("%s", buf);
+    if (sink->fp) {
+        if (vfprintf(sink->fp, fmt, args) < 0) {
+            sink->error = ERR_WRITE_FILE;
+        }
+        va_end(args);
         return;
     }
-    else if (*ms) {
-        len = (int)(strlen(*ms) + cnt + 1);
-        p = (char*)malloc(len);
-        strcpy(p, *ms);
-        strcat(p, buf);
-        free(*ms);
-    } else {
-        len = cnt + 1;
-        p = (char*)malloc(len);
-        strcpy(p, buf);
+    va_copy(again, args);
+    if (dumpGrow(sink, 128)) {
+        cnt = vsnprintf(sink->text + sink->len, sink->size - sink->len, fmt, args);
+        if (cnt >= 0 && sink->len + cnt >= sink->size && dumpGrow(sink, cnt)) {
+            cnt = vsnprintf(sink->text + sink->len, sink->size - sink->len, fmt, again);
+        }
+        if (cnt < 0) {
+            sink->error = ERR_UNKNOWN;
+        } else if (!sink->error) {
+            sink->len += cnt;
+        }
     }
-    *ms = p;
+    va_end(again);
     va_end(args);
+    if (sink->fd >= 0 && sink->len >= DUMP_FLUSH_SIZE) {
+        dumpFlush(sink);
+    }
+}
+
+/**
+ * dumpFlush()
+ *
+ * Write the text of a dump sink to its descriptor and empty it
+ */
+static void dumpFlush(DUMP_SINK *sink)
+{
+    size_t done = 0;
+    long cnt;
+    while (!sink->error && done < sink->len) {
+        cnt = (long)write(sink->fd, sink->text + done, sink->len - done);
+        if (cnt <= 0) {
+            sink->error = ERR_WRITE_FILE;
+        } else {
+            done += cnt;
+        }
+    }
+    sink->len = 0;
 }
@@ -17,6 +17,8 @@
 #if !defined(_EXIF_H_)
 #define _EXIF_H_
 
+#include <stdio.h>
+
 #ifdef _MSC_VER
 #define _CRTDBG_MAP_ALLOC
 #ifdef _DEBUG
@@ -25,6 +27,10 @@
 #endif
 #endif
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 /**
  *   Typical Usage:
  *
@@ -130,6 +136,7 @@ struct _tagNodeInfo {
 #define ERR_ALREADY_EXIST       -11
 #define ERR_UNKNOWN             -12
 #define ERR_MEMALLOC            -13
+#define ERR_UNKNOWN_FORMAT      -14
 
 // public funtions
 
@@ -143,6 +150,34 @@ struct _tagNodeInfo {
  */
 void setVerbose(int v);
 
+/**
+ * setLoadThumbnail()
+ *
+ * Thumbnail loading on/off
+ *
+ * parameters
+ *  [in] v : 1=on (default)  0=off
+ *
+ * note
+ * With loading off, createIfdTableArray() only records where the
+ * thumbnail is. getThumbnailRangeOnIfdTableArray() still works but
+ * getThumbnailDataOnIfdTableArray() returns ERR_NOT_EXIST.
+ */
+void setLoadThumbnail(int v);
+
+/**
+ * setFileOpener()
+ *
+ * Replace the function used to open input files
+ *
+ * parameters
+ *  [in] opener : called like fopen() with mode "rb", or NULL for fopen()
+ *
+ * note
+ * Output files are always opened with fopen().
+ */
+void setFileOpener(FILE *(*opener)(const char*, const char*));
+
 /**
  * removeExifSegmentFromJPEGFile()
  *
@@ -168,9 +203,10 @@ int removeExifSegmentFromJPEGFile(const char *inJPEGFileName,
  * createIfdTableArray()
  *
  * Parse the JPEG header and create the pointer array of the IFD tables
+ * TIFF-based files (TIFF, DNG, CR2, NEF, ARW, ...) are also accepted
  *
  * parameters
- *  [in] JPEGFileName : target JPEG file
+ *  [in] JPEGFileName : target JPEG or TIFF-based file
  *  [out] result : result status value 
  *   n: number of IFD tables
  *   0: the Exif segment is not found
@@ -179,6 +215,7 @@ int removeExifSegmentFromJPEGFile(const char *inJPEGFileName,
  *      ERR_INVALID_JPEG
  *      ERR_INVALID_APP1HEADER
  *      ERR_INVALID_IFD
+ *      ERR_UNKNOWN_FORMAT
  *
  * return
  *   NULL: error or no Exif segment
@@ -186,6 +223,26 @@ int removeExifSegmentFromJPEGFile(const char *inJPEGFileName,
  */
 void **createIfdTableArray(const char *JPEGFileName, int *result);
 
+/**
+ * createIfdTableArrayAndXmp()
+ *
+ * Same as createIfdTableArray(), but for a JPEG file whose Exif data
+ * has no GPS position also read its XMP packet in the same pass
+ *
+ * parameters
+ *  [in] JPEGFileName : target JPEG or TIFF-based file
+ *  [out] result : result status value, as for createIfdTableArray()
+ *  [out] pXmp : the XMP packet, NUL-terminated (must be freed by the
+ *               caller), or NULL
+ *  [out] pXmpLength : length of the packet
+ *
+ * return
+ *   NULL: error or no Exif segment
+ *  !NULL: pointer array of the IFD tables
+ */
+void **createIfdTableArrayAndXmp(const char *JPEGFileName, int *result,
+                                 unsigned char **pXmp, unsigned int *pXmpLength);
+
 /**
  * freeIfdTableArray()
  *
@@ -229,6 +286,53 @@ void dumpIfdTable(void *ifd);
  */
 void dumpIfdTableArray(void **ifdArray);
 
+/**
+ * getIfdTableDump()
+ *
+ * Get the dump of the IFD table as a string
+ *
+ * parameters
+ *  [in] ifd: target IFD
+ *  [out] pp: the dump, to be freed by the caller; NULL if
+ *            there was nothing to dump or memory ran out
+ */
+void getIfdTableDump(void *ifd, char **pp);
+
+/**
+ * writeIfdTableDump()
+ *
+ * Write the dump of the IFD table to a stream
+ *
+ * parameters
+ *  [in] ifd: target IFD
+ *  [in] fp: stream to write to
+ *
+ * return
+ *   0: OK
+ *  -n: error
+ *      ERR_INVALID_POINTER
+ *      ERR_WRITE_FILE
+ */
+int writeIfdTableDump(void *ifd, FILE *fp);
+
+/**
+ * writeIfdTableDumpToFd()
+ *
+ * Write the dump of the IFD table to a file descriptor
+ *
+ * parameters
+ *  [in] ifd: target IFD
+ *  [in] fd: descriptor to write to
+ *
+ * return
+ *   0: OK
+ *  -n: error
+ *      ERR_INVALID_POINTER
+ *      ERR_MEMALLOC
+ *      ERR_WRITE_FILE
+ */
+int writeIfdTableDumpToFd(void *ifd, int fd);
+
 /**
  * getTagInfo()
  *
@@ -262,6 +366,37 @@ TagNodeInfo *getTagInfo(void **ifdArray,
  */
 TagNodeInfo *getTagInfoFromIfd(void *ifd, unsigned short tagId);
 
+/**
+ * getNextTagInfoFromIfd()
+ *
+ * Walk the tags of the IFD in the order they were read
+ *
+ * parameters
+ *  [in] ifd : target IFD
+ *  [in] tag : the tag returned before, or NULL for the first one
+ *
+ * return
+ *  NULL: no more tags
+ *  !NULL: address of the TagNodeInfo structure, which belongs
+ *         to the IFD and must not be freed
+ */
+TagNodeInfo *getNextTagInfoFromIfd(void *ifd, TagNodeInfo *tag);
+
+/**
+ * getTagNameFromId()
+ *
+ * Get the name of the tag
+ *
+ * parameters
+ *  [in] ifdType : IFD TYPE the tag was found in
+ *  [in] tagId : target tag ID
+ *
+ * return
+ *  NULL: the tag is unknown
+ *  !NULL: the name, valid until the next call on the same thread
+ */
+const char *getTagNameFromId(IFD_TYPE ifdType, unsigned short tagId);
+
 /**
  * freeTagInfo()
  *
@@ -424,6 +559,27 @@ unsigned char *getThumbnailDataOnIfdTableArray(void **ifdTableArray,
                                                unsigned int *pLength,
                                                int *pResult);
 
+/**
+ * getThumbnailRangeOnIfdTableArray()
+ *
+ * Get where the thumbnail data of the 1st IFD table lies in the file
+ * it was parsed from, so that it can be read without the main image
+ *
+ * parameters
+ *  [in] ifdTableArray : address of the IFD tables array
+ *  [out] pOffset : returns the offset from the beginning of the file
+ *  [out] pLength : returns the length of the thumbnail data
+ *
+ * return
+ *   0: OK
+ *  -n: error
+ *      ERR_INVALID_POINTER
+ *      ERR_NOT_EXIST
+ */
+int getThumbnailRangeOnIfdTableArray(void **ifdTableArray,
+                                     unsigned int *pOffset,
+                                     unsigned int *pLength);
+
 /**
  * setThumbnailDataOnIfdTableArray()
  *
@@ -449,9 +605,6 @@ int setThumbnailDataOnIfdTableArray(void **ifdTableArray,
                                     unsigned char *pData,
                                     unsigned int length);
 
-void getIfdTableDump(void *pIfd, char **pp);
-
-
 /**
  * updateExifSegmentInJPEGFile()
  *
@@ -476,8 +629,6 @@ int updateExifSegmentInJPEGFile(const char *inJPEGFileName,
                                 const char *outJPGEFileName,
                                 void **ifdTableArray);
 
-void getIfdTableDump(void *pIfd, char **pp);
-
 /**
  * removeAdobeMetadataSegmentFromJPEGFile()
  *
@@ -499,6 +650,31 @@ void getIfdTableDump(void *pIfd, char **pp);
 int removeAdobeMetadataSegmentFromJPEGFile(const char *inJPEGFileName,
                                            const char *outJPGEFileName);
 
+/**
+ * getXmpPacketFromJPEGFile()
+ *
+ * Read Adobe's XMP metadata packet from a JPEG file
+ *
+ * parameters
+ *  [in] JPEGFileName : target JPEG file
+ *  [out] pLength : length of the packet
+ *  [out] pResult : result status value
+ *   1: OK
+ *   0: Adobe's metadata segment is not found
+ *  -n: error
+ *      ERR_READ_FILE
+ *      ERR_INVALID_JPEG
+ *      ERR_INVALID_APP1HEADER
+ *      ERR_MEMALLOC
+ *
+ * return
+ *   NULL: error or no XMP packet
+ *  !NULL: the packet, NUL-terminated (must be freed by the caller)
+ */
+unsigned char *getXmpPacketFromJPEGFile(const char *JPEGFileName,
+                                        unsigned int *pLength,
+                                        int *pResult);
+
 // Tag IDs
 // 0th IFD, 1st IFD, Exif IFD
 #define TAG_ImageWidth                   0x0100
@@ -657,4 +833,8 @@ int removeAdobeMetadataSegmentFromJPEGFile(const char *inJPEGFileName,
 #define TAG_InteroperabilityIndex        0x0001
 #define TAG_InteroperabilityVersion      0x0002
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif // _EXIF_H_
@@ -0,0 +1,873 @@
+/* File: index.c
+ * -------------
+ * Implements the index files declared in index.h.
+ * Each worker fills a fixed buffer of records;
+ * a full buffer is sorted and written out as a
+ * run. Finishing merges the runs through a heap,
+ * at most as many at once as the budget has room
+ * for large read buffers, in several passes if
+ * there are more runs than that. Blocks are
+ * decoded a column at a time into arrays.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include "index.h"
+
+#define INDEX_MAGIC "BIDX"
+#define INDEX_VERSION 3
+#define HEADER_SIZE 16
+#define INDEX_BLOCK 1024
+#define BLOCK_HEADER 24
+#define RUN_HEADER 24
+#define MAX_PAYLOAD (64 * 1024 * 1024)
+#define FIXED_SCALE 1e7
+#define IO_BUFFER (1024 * 1024)
+#define MIN_WORKER_MEMORY (64 * 1024)
+
+/* Type: Entry
+ * -----------
+ * One buffered record; its path sits at
+ * offset path of the worker's arena.
+ */
+
+typedef struct {
+    uint64_t key;
+    int32_t lat, lon; // fixed point
+    size_t path;
+} Entry;
+
+/* Type: RunBuffer
+ * ---------------
+ * The records of one worker not yet written.
+ * Half its budget holds entries and half the
+ * path arena, both allocated on first use.
+ */
+
+typedef struct {
+    Entry* entries;
+    size_t count, capacity;
+    char* arena;
+    size_t used, arenaCapacity;
+} RunBuffer;
+
+struct IndexBuild {
+    char* path;
+    size_t memory;
+    int workers;
+    RunBuffer* buffers;
+    pthread_mutex_t lock; // guards the run list
+    char** runs;
+    size_t runCount, runCapacity;
+    unsigned long nextRun;
+    bool byPath; // sorted by path rather than key
+    bool failed;
+};
+
+/* Type: Stream
+ * ------------
+ * A run or index being read record by
+ * record, with its current record. Index
+ * files are decoded a block at a time into
+ * the columns here.
+ */
+
+typedef struct {
+    FILE* file;
+    char* buffer; // stdio buffer
+    bool blocked; // an index rather than a run
+    size_t blockCount, blockNext;
+    int32_t lats[INDEX_BLOCK], lons[INDEX_BLOCK];
+    uint32_t deltas[INDEX_BLOCK];
+    size_t offsets[INDEX_BLOCK];
+    char* paths;
+    size_t pathsCapacity;
+    unsigned char* payload;
+    size_t payloadCapacity;
+    int32_t lat, lon; // of the current record
+    IndexRecord record;
+    bool boxed; // only records in the box below
+    double latTL, lonTL, latBR, lonBR;
+    uint64_t records, passed; // in the header and so far
+    bool ended; // no block after the last one
+    bool failed; // stopped short of the end
+} Stream;
+
+/* Type: BlockWriter
+ * -----------------
+ * Collects records into blocks and writes
+ * each one encoded when it is full.
+ */
+
+typedef struct {
+    FILE* file;
+    size_t count;
+    int32_t lats[INDEX_BLOCK], lons[INDEX_BLOCK];
+    size_t offsets[INDEX_BLOCK];
+    char* paths;
+    size_t pathsUsed, pathsCapacity;
+    unsigned char* payload;
+    size_t payloadCapacity;
+    uint64_t written;
+} BlockWriter;
+
+struct IndexReader {
+    Stream stream;
+    uint64_t count;
+};
+
+static int32_t toFixed(double degrees) {
+    return (int32_t) lround(degrees * FIXED_SCALE);
+}
+
+static double fromFixed(int32_t fixed) {
+    return fixed / FIXED_SCALE;
+}
+
+/* Function: indexKey
+ * ------------------
+ * Scales the latitude and longitude to 32
+ * bits each and returns the distance along
+ * a Hilbert curve through that grid. Unlike
+ * a Z-order key, the curve never jumps, so
+ * neighboring keys are neighbors on the map.
+ */
+
+uint64_t indexKey(double lat, double lon) {
+    double y = (lat + 90) / 180, x = (lon + 180) / 360;
+    uint32_t qy = y <= 0 ? 0 : (y >= 1 ? 0xFFFFFFFFU : (uint32_t) (y * 4294967296.0));
+    uint32_t qx = x <= 0 ? 0 : (x >= 1 ? 0xFFFFFFFFU : (uint32_t) (x * 4294967296.0));
+
+    uint64_t key = 0;
+    for (uint32_t s = 1U << 31; s > 0; s >>= 1) {
+        uint32_t rx = (qx & s) != 0, ry = (qy & s) != 0;
+        key += (uint64_t) s * s * ((3 * rx) ^ ry);
+
+        //turn the quadrant so the curve inside it lines up
+        if (ry == 0) {
+            if (rx == 1) {
+                qx = ~qx;
+                qy = ~qy;
+            }
+            uint32_t swap = qx; qx = qy; qy = swap;
+        }
+    }
+    return key;
+}
+
+static uint64_t fixedKey(int32_t lat, int32_t lon) {
+    return indexKey(fromFixed(lat), fromFixed(lon));
+}
+
+/* Section: encoding
+ * -----------------
+ * Fixed-width fields are little-endian
+ * whatever the host order. Varints hold
+ * seven bits a byte, low bits first, and
+ * signed deltas are zigzagged so that
+ * small steps either way stay short.
+ */
+
+static void putU32(unsigned char* out, uint32_t value) {
+    for (int i = 0; i < 4; i++) out[i] = (unsigned char) (value >> (8 * i));
+}
+
+static uint32_t getU32(const unsigned char* in) {
+    uint32_t value = 0;
+    for (int i = 3; i >= 0; i--) value = (value << 8) | in[i];
+    return value;
+}
+
+static void putU64(unsigned char* out, uint64_t value) {
+    for (int i = 0; i < 8; i++) out[i] = (unsigned char) (value >> (8 * i));
+}
+
+static uint64_t getU64(const unsigned char* in) {
+    uint64_t value = 0;
+    for (int i = 7; i >= 0; i--) value = (value << 8) | in[i];
+    return value;
+}
+
+static size_t putVarint(unsigned char* out, uint32_t value) {
+    size_t len = 0;
+    while (value >= 0x80) {
+        out[len++] = (unsigned char) (value | 0x80);
+        value >>= 7;
+    }
+    out[len++] = (unsigned char) value;
+    return len;
+}
+
+static bool getVarint(const unsigned char** in, const unsigned char* end,
+    uint32_t* value) {
+    *value = 0;
+    for (int shift = 0; shift < 35 && *in < end; shift += 7) {
+        unsigned char byte = *(*in)++;
+        *value |= (uint32_t) (byte & 0x7F) << shift;
+        if (byte < 0x80) return true;
+    }
+    return false;
+}
+
+//deltas wrap around in unsigned arithmetic, so any step fits
+static uint32_t zigzag(uint32_t delta) {
+    return (delta << 1) ^ (0U - (delta >> 31));
+}
+
+static uint32_t unzigzag(uint32_t value) {
+    return (value >> 1) ^ (0U - (value & 1));
+}
+
+/* Function: writeRun
+ * ------------------
+ * Writes one record to a run, whose records
+ * are plain: the key, the fixed-point
+ * latitude and longitude, then the path
+ * length and bytes.
+ */
+
+static bool writeRun(FILE* file, uint64_t key, int32_t lat, int32_t lon,
+    const char* path) {
+    unsigned char fixed[RUN_HEADER];
+    uint32_t len = (uint32_t) strlen(path);
+    putU64(fixed, key);
+    putU32(fixed + 8, (uint32_t) lat);
+    putU32(fixed + 12, (uint32_t) lon);
+    putU32(fixed + 16, len);
+    putU32(fixed + 20, 0);
+    return fwrite(fixed, 1, sizeof(fixed), file) == sizeof(fixed) &&
+        fwrite(path, 1, len, file) == len;
+}
+
+static bool reserve(void* buffer, size_t* capacity, size_t needed) {
+    if (needed <= *capacity) return true;
+    size_t grown = *capacity ? *capacity : 4096;
+    while (grown < needed) grown *= 2;
+    void* resized = realloc(*(void**) buffer, grown);
+    if (resized == NULL) return false;
+    *(void**) buffer = resized;
+    *capacity = grown;
+    return true;
+}
+
+/* Function: flushBlock
+ * --------------------
+ * Encodes the records collected by writer
+ * as one block and writes it out: the
+ * record count and payload size and the
+ * least and greatest latitude and longitude
+ * as fixed point, then the
+ * latitude deltas, the longitude deltas and
+ * the paths, each column after the other.
+ * A path is stored as the length it shares
+ * with the one before, then the length and
+ * bytes of the rest.
+ */
+
+static bool flushBlock(BlockWriter* writer) {
+    size_t count = writer -> count;
+    if (count == 0) return true;
+    if (!reserve(&writer -> payload, &writer -> payloadCapacity,
+        BLOCK_HEADER + count * 20 + writer -> pathsUsed))
+        return false;
+
+    unsigned char* out = writer -> payload + BLOCK_HEADER;
+    uint32_t prevLat = 0, prevLon = 0;
+    for (size_t i = 0; i < count; i++) {
+        out += putVarint(out, zigzag((uint32_t) writer -> lats[i] - prevLat));
+        prevLat = (uint32_t) writer -> lats[i];
+    }
+    for (size_t i = 0; i < count; i++) {
+        out += putVarint(out, zigzag((uint32_t) writer -> lons[i] - prevLon));
+        prevLon = (uint32_t) writer -> lons[i];
+    }
+
+    const char* prev = "";
+    for (size_t i = 0; i < count; i++) {
+        const char* path = writer -> paths + writer -> offsets[i];
+        size_t shared = 0;
+        while (prev[shared] != '\0' && prev[shared] == path[shared]) shared++;
+        size_t rest = strlen(path + shared);
+        out += putVarint(out, (uint32_t) shared);
+        out += putVarint(out, (uint32_t) rest);
+        memcpy(out, path + shared, rest);
+        out += rest;
+        prev = path;
+    }
+
+    int32_t latLo = writer -> lats[0], latHi = latLo;
+    int32_t lonLo = writer -> lons[0], lonHi = lonLo;
+    for (size_t i = 1; i < count; i++) {
+        if (writer -> lats[i] < latLo) latLo = writer -> lats[i];
+        if (writer -> lats[i] > latHi) latHi = writer -> lats[i];
+        if (writer -> lons[i] < lonLo) lonLo = writer -> lons[i];
+        if (writer -> lons[i] > lonHi) lonHi = writer -> lons[i];
+    }
+
+    size_t size = (size_t) (out - writer -> payload);
+    putU32(writer -> payload, (uint32_t) count);
+    putU32(writer -> payload + 4, (uint32_t) (size - BLOCK_HEADER));
+    putU32(writer -> payload + 8, (uint32_t) latLo);
+    putU32(writer -> payload + 12, (uint32_t) latHi);
+    putU32(writer -> payload + 16, (uint32_t) lonLo);
+    putU32(writer -> payload + 20, (uint32_t) lonHi);
+    writer -> written += count;
+    writer -> count = 0;
+    writer -> pathsUsed = 0;
+    return fwrite(writer -> payload, 1, size, writer -> file) == size;
+}
+
+static bool blockAdd(BlockWriter* writer, int32_t lat, int32_t lon, const char* path) {
+    size_t len = strlen(path) + 1;
+    if (!reserve(&writer -> paths, &writer -> pathsCapacity, writer -> pathsUsed + len))
+        return false;
+
+    writer -> lats[writer -> count] = lat;
+    writer -> lons[writer -> count] = lon;
+    writer -> offsets[writer -> count] = writer -> pathsUsed;
+    memcpy(writer -> paths + writer -> pathsUsed, path, len);
+    writer -> pathsUsed += len;
+    return ++writer -> count < INDEX_BLOCK || flushBlock(writer);
+}
+
+/* Function: overlaps
+ * ------------------
+ * Returns whether a block with the given
+ * header may hold records in the box of
+ * stream. Boxes with lonTL past lonBR
+ * wrap around the antimeridian.
+ */
+
+static bool overlaps(const Stream* stream, const unsigned char* header) {
+    double latLo = fromFixed((int32_t) getU32(header + 8));
+    double latHi = fromFixed((int32_t) getU32(header + 12));
+    double lonLo = fromFixed((int32_t) getU32(header + 16));
+    double lonHi = fromFixed((int32_t) getU32(header + 20));
+    if (latHi < stream -> latBR || latLo > stream -> latTL) return false;
+    if (stream -> lonTL > stream -> lonBR)
+        return lonHi >= stream -> lonTL || lonLo <= stream -> lonBR;
+    return lonHi >= stream -> lonTL && lonLo <= stream -> lonBR;
+}
+
+static bool inBox(const Stream* stream) {
+    double lat = stream -> record.lat, lon = stream -> record.lon;
+    if (lat > stream -> latTL || lat < stream -> latBR) return false;
+    if (stream -> lonTL > stream -> lonBR)
+        return lon >= stream -> lonTL || lon <= stream -> lonBR;
+    return lon >= stream -> lonTL && lon <= stream -> lonBR;
+}
+
+/* Function: readBlock
+ * -------------------
+ * Reads and decodes the next block of an
+ * index stream, seeking past blocks wholly
+ * outside its box. Returns false at the
+ * end or if the block is damaged.
+ */
+
+static bool readBlock(Stream* stream) {
+    unsigned char header[BLOCK_HEADER];
+    size_t count, size;
+    for (;;) {
+        size_t got = fread(header, 1, BLOCK_HEADER, stream -> file);
+        if (got != BLOCK_HEADER) {
+            stream -> ended = got == 0 && !ferror(stream -> file);
+            return false;
+        }
+        count = getU32(header);
+        size = getU32(header + 4);
+        if (count == 0 || count > INDEX_BLOCK || size > MAX_PAYLOAD) return false;
+        stream -> passed += count;
+        if (!stream -> boxed || overlaps(stream, header)) break;
+        if (fseek(stream -> file, (long) size, SEEK_CUR) != 0) return false;
+    }
+
+    if (!reserve(&stream -> payload, &stream -> payloadCapacity, size) ||
+        fread(stream -> payload, 1, size, stream -> file) != size)
+        return false;
+
+    const unsigned char* in = stream -> payload;
+    const unsigned char* end = in + size;
+
+    //the columns are decoded in separate passes, leaving
+    //the running sums as plain loops over arrays
+    int32_t* columns[2] = {stream -> lats, stream -> lons};
+    for (int c = 0; c < 2; c++) {
+        for (size_t i = 0; i < count; i++) {
+            if (!getVarint(&in, end, &stream -> deltas[i])) return false;
+            stream -> deltas[i] = unzigzag(stream -> deltas[i]);
+        }
+        uint32_t sum = 0;
+        for (size_t i = 0; i < count; i++) {
+            sum += stream -> deltas[i];
+            columns[c][i] = (int32_t) sum;
+        }
+    }
+
+    size_t used = 0, prevLen = 0;
+    for (size_t i = 0; i < count; i++) {
+        uint32_t shared, rest;
+        if (!getVarint(&in, end, &shared) || !getVarint(&in, end, &rest) ||
+            shared > prevLen || rest > (size_t) (end - in) ||
+            !reserve(&stream -> paths, &stream -> pathsCapacity, used + shared + rest + 1))
+            return false;
+
+        char* path = stream -> paths + used;
+        if (i > 0) memmove(path, stream -> paths + stream -> offsets[i - 1], shared);
+        memcpy(path + shared, in, rest);
+        path[shared + rest] = '\0';
+        in += rest;
+
+        stream -> offsets[i] = used;
+        prevLen = shared + rest;
+        used += prevLen + 1;
+    }
+
+    stream -> blockCount = count;
+    stream -> blockNext = 0;
+    return true;
+}
+
+/* Function: streamNext
+ * --------------------
+ * Reads the next record of a stream.
+ * Returns false at the end or on error.
+ */
+
+static bool streamNext(Stream* stream) {
+    if (stream -> blocked) {
+        size_t i;
+        do {
+            if (stream -> blockNext == stream -> blockCount && !readBlock(stream)) {
+                //a clean end comes between blocks, after every record
+                stream -> failed = !stream -> ended || stream -> passed != stream -> records;
+                return false;
+            }
+            i = stream -> blockNext++;
+            stream -> record.lat = fromFixed(stream -> lats[i]);
+            stream -> record.lon = fromFixed(stream -> lons[i]);
+        } while (stream -> boxed && !inBox(stream));
+
+        stream -> lat = stream -> lats[i];
+        stream -> lon = stream -> lons[i];
+        stream -> record.key = fixedKey(stream -> lat, stream -> lon);
+        stream -> record.path = stream -> paths + stream -> offsets[i];
+    } else {
+        unsigned char fixed[RUN_HEADER];
+        size_t got = fread(fixed, 1, sizeof(fixed), stream -> file);
+        if (got != sizeof(fixed)) {
+            stream -> failed = got != 0 || ferror(stream -> file);
+            return false;
+        }
+
+        size_t len = getU32(fixed + 16);
+        if (!reserve(&stream -> paths, &stream -> pathsCapacity, len + 1) ||
+            fread(stream -> paths, 1, len, stream -> file) != len) {
+            stream -> failed = true;
+            return false;
+        }
+        stream -> paths[len] = '\0';
+
+        stream -> lat = (int32_t) getU32(fixed + 8);
+        stream -> lon = (int32_t) getU32(fixed + 12);
+        stream -> record.key = getU64(fixed);
+        stream -> record.path = stream -> paths;
+    }
+
+    stream -> record.lat = fromFixed(stream -> lat);
+    stream -> record.lon = fromFixed(stream -> lon);
+    return true;
+}
+
+static bool streamOpen(Stream* stream, const char* path, bool blocked) {
+    memset(stream, 0, sizeof(Stream));
+    stream -> blocked = blocked;
+    stream -> file = fopen(path, "rb");
+    if (stream -> file == NULL) return false;
+    stream -> buffer = malloc(IO_BUFFER);
+    if (stream -> buffer != NULL)
+        setvbuf(stream -> file, stream -> buffer, _IOFBF, IO_BUFFER);
+    return true;
+}
+
+static void streamClose(Stream* stream) {
+    if (stream -> file != NULL) fclose(stream -> file);
+    free(stream -> buffer);
+    free(stream -> paths);
+    free(stream -> payload);
+}
+
+/* Section: runs
+ * -------------
+ */
+
+IndexBuild* indexBuildCreate(const char* path, size_t memory, int workers) {
+    IndexBuild* build = calloc(1, sizeof(IndexBuild));
+    if (build == NULL) return NULL;
+
+    build -> path = strdup(path);
+    build -> buffers = calloc(workers, sizeof(RunBuffer));
+    if (build -> path == NULL || build -> buffers == NULL) {
+        free(build -> path);
+        free(build -> buffers);
+        free(build);
+        return NULL;
+    }
+
+    build -> memory = memory < INDEX_MIN_MEMORY ? INDEX_MIN_MEMORY : memory;
+    build -> workers = workers;
+    pthread_mutex_init(&build -> lock, NULL);
+    return build;
+}
+
+void indexBuildByPath(IndexBuild* build) {
+    build -> byPath = true;
+}
+
+/* Function: addRun
+ * ----------------
+ * Creates the name of a new run file and
+ * adds it to the run list. Returns the name,
+ * or NULL if out of memory.
+ */
+
+static char* addRun(IndexBuild* build) {
+    pthread_mutex_lock(&build -> lock);
+    char* name = malloc(strlen(build -> path) + 32);
+    if (name != NULL)
+        sprintf(name, "%s.run%lu", build -> path, build -> nextRun++);
+
+    if (name != NULL && build -> runCount == build -> runCapacity) {
+        size_t capacity = build -> runCapacity ? build -> runCapacity * 2 : 16;
+        char** runs = realloc(build -> runs, capacity * sizeof(char*));
+        if (runs == NULL) {
+            free(name);
+            name = NULL;
+        } else {
+            build -> runs = runs;
+            build -> runCapacity = capacity;
+        }
+    }
+
+    if (name != NULL) build -> runs[build -> runCount++] = name;
+    pthread_mutex_unlock(&build -> lock);
+    return name;
+}
+
+/* Type: SortItem
+ * --------------
+ * qsort has no context argument, so entries
+ * are sorted along with their paths through
+ * this wrapper instead. The buffer capacity
+ * leaves room for one per entry.
+ */
+
+typedef struct {
+    const Entry* entry;
+    const char* path;
+} SortItem;
+
+static int compareItems(const void* a, const void* b) {
+    const SortItem* p = a;
+    const SortItem* q = b;
+    if (p -> entry -> key != q -> entry -> key)
+        return p -> entry -> key < q -> entry -> key ? -1 : 1;
+    return strcmp(p -> path, q -> path);
+}
+
+static int compareItemsByPath(const void* a, const void* b) {
+    const SortItem* p = a;
+    const SortItem* q = b;
+    int order = strcmp(p -> path, q -> path);
+    if (order != 0 || p -> entry -> key == q -> entry -> key) return order;
+    return p -> entry -> key < q -> entry -> key ? -1 : 1;
+}
+
+/* Function: flushBuffer
+ * ---------------------
+ * Sorts the records of a worker buffer and
+ * writes them out as a new run, emptying
+ * the buffer. Returns false on failure.
+ */
+
+static bool flushBuffer(IndexBuild* build, RunBuffer* buffer) {
+    if (buffer -> count == 0) return true;
+
+    SortItem* items = malloc(buffer -> count * sizeof(SortItem));
+    char* name = items != NULL ? addRun(build) : NULL;
+    FILE* file = name != NULL ? fopen(name, "wb") : NULL;
+    bool ok = file != NULL;
+
+    for (size_t i = 0; ok && i < buffer -> count; i++) {
+        items[i].entry = &buffer -> entries[i];
+        items[i].path = buffer -> arena + buffer -> entries[i].path;
+    }
+    if (ok) qsort(items, buffer -> count, sizeof(SortItem),
+        build -> byPath ? compareItemsByPath : compareItems);
+
+    for (size_t i = 0; ok && i < buffer -> count; i++)
+        ok = writeRun(file, items[i].entry -> key, items[i].entry -> lat,
+            items[i].entry -> lon, items[i].path);
+    if (file != NULL && fclose(file) != 0) ok = false;
+
+    free(items);
+    buffer -> count = 0;
+    buffer -> used = 0;
+    return ok;
+}
+
+bool indexBuildAdd(IndexBuild* build, int worker, double lat, double lon,
+    const char* path) {
+    RunBuffer* buffer = &build -> buffers[worker];
+    size_t len = strlen(path) + 1;
+    if (build -> failed) return false;
+
+    if (buffer -> entries == NULL) {
+        size_t share = build -> memory / build -> workers;
+        if (share < MIN_WORKER_MEMORY) share = MIN_WORKER_MEMORY;
+        buffer -> capacity = share / 2 / (sizeof(Entry) + sizeof(SortItem));
+        buffer -> arenaCapacity = share / 2;
+        buffer -> entries = malloc(buffer -> capacity * sizeof(Entry));
+        buffer -> arena = malloc(buffer -> arenaCapacity);
+        if (buffer -> entries == NULL || buffer -> arena == NULL) {
+            build -> failed = true;
+            return false;
+        }
+    }
+
+    if (len > buffer -> arenaCapacity) return true; // no such paths exist
+    if ((buffer -> count == buffer -> capacity ||
+        buffer -> used + len > buffer -> arenaCapacity) && !flushBuffer(build, buffer)) {
+        build -> failed = true;
+        return false;
+    }
+
+    Entry* entry = &buffer -> entries[buffer -> count++];
+    entry -> lat = toFixed(lat);
+    entry -> lon = toFixed(lon);
+    entry -> key = fixedKey(entry -> lat, entry -> lon);
+    entry -> path = buffer -> used;
+    memcpy(buffer -> arena + buffer -> used, path, len);
+    buffer -> used += len;
+    return true;
+}
+
+/* Section: merging
+ * ----------------
+ */
+
+static bool streamBefore(const Stream* a, const Stream* b, bool byPath) {
+    int order = strcmp(a -> record.path, b -> record.path);
+    if (byPath && order != 0) return order < 0;
+    if (a -> record.key != b -> record.key) return a -> record.key < b -> record.key;
+    return order < 0;
+}
+
+static void siftDown(Stream** heap, size_t count, size_t i, bool byPath) {
+    for (;;) {
+        size_t least = i, left = 2 * i + 1, right = left + 1;
+        if (left < count && streamBefore(heap[left], heap[least], byPath)) least = left;
+        if (right < count && streamBefore(heap[right], heap[least], byPath)) least = right;
+        if (least == i) return;
+        Stream* swap = heap[i]; heap[i] = heap[least]; heap[least] = swap;
+        i = least;
+    }
+}
+
+/* Function: readHeader
+ * --------------------
+ * Reads and checks the header of an index
+ * file, setting count to its record count.
+ */
+
+static bool readHeader(Stream* stream, uint64_t* count) {
+    unsigned char fixed[HEADER_SIZE];
+    if (fread(fixed, 1, HEADER_SIZE, stream -> file) != HEADER_SIZE ||
+        memcmp(fixed, INDEX_MAGIC, 4) != 0 || getU32(fixed + 4) != INDEX_VERSION)
+        return false;
+
+    *count = stream -> records = getU64(fixed + 8);
+    return true;
+}
+
+/* Function: mergeFiles
+ * --------------------
+ * Merges count runs, or index files if
+ * indexes is set, into the file at dest,
+ * with an index header if asked for, in
+ * path order if byPath is set. Only records
+ * keep accepts are written if it is not
+ * NULL. Returns false on failure.
+ */
+
+static bool mergeFiles(const char* const* inputs, size_t count, const char* dest,
+    bool indexes, bool header, bool byPath, IndexFilter keep, void* ctx) {
+    Stream* streams = calloc(count ? count : 1, sizeof(Stream));
+    Stream** heap = malloc((count ? count : 1) * sizeof(Stream*));
+    BlockWriter* writer = header ? calloc(1, sizeof(BlockWriter)) : NULL;
+    FILE* out = fopen(dest, "wb");
+    char* outBuffer = malloc(IO_BUFFER);
+    bool ok = streams != NULL && heap != NULL && out != NULL && (writer || !header);
+    if (ok && outBuffer != NULL) setvbuf(out, outBuffer, _IOFBF, IO_BUFFER);
+    if (writer != NULL) writer -> file = out;
+
+    unsigned char fixed[HEADER_SIZE] = INDEX_MAGIC;
+    if (ok && header) ok = fwrite(fixed, 1, HEADER_SIZE, out) == HEADER_SIZE;
+
+    size_t live = 0;
+    uint64_t expected;
+    for (size_t i = 0; ok && i < count; i++) {
+        ok = streamOpen(&streams[i], inputs[i], indexes) &&
+            (!indexes || readHeader(&streams[i], &expected));
+        if (ok && streamNext(&streams[i])) heap[live++] = &streams[i];
+    }
+    for (size_t i = live; ok && i-- > 0;) siftDown(heap, live, i, byPath);
+
+    while (ok && live > 0) {
+        const Stream* next = heap[0];
+        if (keep == NULL || keep(ctx, (size_t) (next - streams), &next -> record))
+            ok = header ? blockAdd(writer, next -> lat, next -> lon, next -> record.path)
+                : writeRun(out, next -> record.key, next -> lat, next -> lon,
+                    next -> record.path);
+        if (!streamNext(heap[0])) heap[0] = heap[--live];
+        siftDown(heap, live, 0, byPath);
+    }
+
+    //a damaged input ends early rather than failing the add
+    for (size_t i = 0; ok && i < count; i++)
+        if (streams[i].failed) ok = false;
+
+    //the count is known only now
+    if (ok && header) ok = flushBlock(writer);
+    if (ok && header) {
+        memcpy(fixed, INDEX_MAGIC, 4);
+        putU32(fixed + 4, INDEX_VERSION);
+        putU64(fixed + 8, writer -> written);
+        ok = fseek(out, 0, SEEK_SET) == 0 && fwrite(fixed, 1, HEADER_SIZE, out) == HEADER_SIZE;
+    }
+
+    for (size_t i = 0; streams != NULL && i < count; i++)
+        streamClose(&streams[i]);
+    if (out != NULL && fclose(out) != 0) ok = false;
+    if (writer != NULL) {
+        free(writer -> paths);
+        free(writer -> payload);
+    }
+    free(writer);
+    free(outBuffer);
+    free(streams);
+    free(heap);
+    return ok;
+}
+
+bool indexMerge(const char* const* paths, size_t count, const char* dest,
+    IndexFilter keep, void* ctx) {
+    bool ok = mergeFiles(paths, count, dest, true, true, false, keep, ctx);
+    if (!ok) remove(dest);
+    return ok;
+}
+
+bool indexBuildFinish(IndexBuild* build) {
+    for (int i = 0; i < build -> workers && !build -> failed; i++)
+        if (!flushBuffer(build, &build -> buffers[i])) build -> failed = true;
+
+    //the buffers are no longer needed, which frees the budget
+    //for the read buffers of the merge
+    for (int i = 0; i < build -> workers; i++) {
+        free(build -> buffers[i].entries);
+        free(build -> buffers[i].arena);
+        memset(&build -> buffers[i], 0, sizeof(RunBuffer));
+    }
+    if (build -> failed) return false;
+
+    //merge the oldest runs into new ones until few enough remain
+    size_t fanIn = build -> memory / IO_BUFFER - 1;
+    if (fanIn < 2) fanIn = 2;
+    size_t first = 0;
+    while (build -> runCount - first > fanIn) {
+        char* name = addRun(build);
+        if (name == NULL || !mergeFiles((const char* const*) build -> runs + first,
+            fanIn, name, false, false, build -> byPath, NULL, NULL))
+            return false;
+        for (size_t i = first; i < first + fanIn; i++) {
+            remove(build -> runs[i]);
+            free(build -> runs[i]);
+            build -> runs[i] = NULL;
+        }
+        first += fanIn;
+    }
+
+    bool ok = mergeFiles((const char* const*) build -> runs + first,
+        build -> runCount - first, build -> path, false, true, build -> byPath,
+        NULL, NULL);
+    if (!ok) remove(build -> path);
+    return ok;
+}
+
+void indexBuildFree(IndexBuild* build) {
+    if (build == NULL) return;
+    for (size_t i = 0; i < build -> runCount; i++) {
+        if (build -> runs[i] != NULL) remove(build -> runs[i]);
+        free(build -> runs[i]);
+    }
+    for (int i = 0; i < build -> workers; i++) {
+        free(build -> buffers[i].entries);
+        free(build -> buffers[i].arena);
+    }
+    pthread_mutex_destroy(&build -> lock);
+    free(build -> runs);
+    free(build -> buffers);
+    free(build -> path);
+    free(build);
+}
+
+/* Section: reading
+ * ----------------
+ */
+
+IndexReader* indexOpen(const char* path) {
+    IndexReader* reader = malloc(sizeof(IndexReader));
+    if (reader == NULL) return NULL;
+    if (!streamOpen(&reader -> stream, path, true)) {
+        free(reader);
+        return NULL;
+    }
+
+    if (!readHeader(&reader -> stream, &reader -> count)) {
+        streamClose(&reader -> stream);
+        free(reader);
+        return NULL;
+    }
+    return reader;
+}
+
+uint64_t indexCount(const IndexReader* reader) {
+    return reader -> count;
+}
+
+bool indexNext(IndexReader* reader, IndexRecord* record) {
+    if (!streamNext(&reader -> stream)) return false;
+    *record = reader -> stream.record;
+    return true;
+}
+
+bool indexFailed(const IndexReader* reader) {
+    return reader -> stream.failed;
+}
+
+void indexSetBox(IndexReader* reader, double latTL, double lonTL,
+    double latBR, double lonBR) {
+    Stream* stream = &reader -> stream;
+    stream -> boxed = true;
+    stream -> latTL = latTL; stream -> lonTL = lonTL;
+    stream -> latBR = latBR; stream -> lonBR = lonBR;
+}
+
+void indexClose(IndexReader* reader) {
+    if (reader == NULL) return;
+    streamClose(&reader -> stream);
+    free(reader);
+}
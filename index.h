@@ -0,0 +1,180 @@
+/* File: index.h
+ * -------------
+ * Builds and reads coordinate index files: the
+ * position and path of every image of a folder,
+ * sorted along a Hilbert curve so that images
+ * close on the map are close in the file.
+ * Builds keep to a fixed memory budget whatever
+ * the number of images by writing sorted runs
+ * to temporary files and merging them at the
+ * end.
+ *
+ * An index file is the magic BIDX, a u32 version
+ * and a u64 record count, followed by blocks of
+ * up to 1024 consecutive records, each headed
+ * by its bounding box so that reads for a box
+ * skip the rest. Positions are kept in fixed
+ * point to 1e-7 degrees, about a centimeter, and
+ * keys are computed from those on reading. Each
+ * block is a u32 record count, a u32 payload
+ * size, the i32 least and greatest latitude
+ * and least and greatest longitude, then the
+ * payload: the zigzag varint deltas of every
+ * latitude, then those of every longitude, then
+ * every path as a varint length shared with the
+ * path before, a varint length and the bytes of
+ * the rest. Fixed-width fields are little-endian.
+ */
+
+#ifndef _INDEX_H_
+#define _INDEX_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define INDEX_MIN_MEMORY (4 * 1024 * 1024)
+
+typedef struct IndexBuild IndexBuild;
+typedef struct IndexReader IndexReader;
+
+/* Type: IndexRecord
+ * -----------------
+ * One record of an index. The path belongs
+ * to the reader and is only valid until the
+ * next record is read.
+ */
+
+typedef struct {
+    uint64_t key;
+    double lat, lon;
+    const char* path;
+} IndexRecord;
+
+/* Function: indexKey
+ * ------------------
+ * Returns the spatial key of a position.
+ */
+
+uint64_t indexKey(double lat, double lon);
+
+/* Function: indexBuildCreate
+ * --------------------------
+ * Starts building the index file at path
+ * with at most memory bytes of records held
+ * at once, split evenly between workers,
+ * each of which adds records on its own.
+ * Returns NULL if out of memory.
+ */
+
+IndexBuild* indexBuildCreate(const char* path, size_t memory, int workers);
+
+/* Function: indexBuildByPath
+ * ---------------------------
+ * Makes build sort its records by path
+ * instead of position, for joining two
+ * indexes file by file. Must be called
+ * before any record is added.
+ */
+
+void indexBuildByPath(IndexBuild* build);
+
+/* Function: indexBuildAdd
+ * -----------------------
+ * Adds a record from the given worker.
+ * Returns false if a run could not be
+ * written or memory ran out.
+ */
+
+bool indexBuildAdd(IndexBuild* build, int worker, double lat, double lon,
+    const char* path);
+
+/* Function: indexBuildFinish
+ * --------------------------
+ * Merges everything added into the index
+ * file. Returns false if that failed.
+ */
+
+bool indexBuildFinish(IndexBuild* build);
+
+/* Function: indexBuildFree
+ * ------------------------
+ * Releases all memory held by build and
+ * removes its temporary files.
+ */
+
+void indexBuildFree(IndexBuild* build);
+
+/* Type: IndexFilter
+ * ------------------
+ * Decides whether a record read from input
+ * number source of a merge is kept.
+ */
+
+typedef bool (*IndexFilter)(void* ctx, size_t source, const IndexRecord* record);
+
+/* Function: indexMerge
+ * --------------------
+ * Merges count index files into a new one
+ * at dest, keeping only the records keep
+ * accepts unless it is NULL. Returns false
+ * if that failed.
+ */
+
+bool indexMerge(const char* const* paths, size_t count, const char* dest,
+    IndexFilter keep, void* ctx);
+
+/* Function: indexOpen
+ * -------------------
+ * Opens an index file for reading from
+ * the start. Returns NULL if it cannot be
+ * read or is not an index.
+ */
+
+IndexReader* indexOpen(const char* path);
+
+/* Function: indexCount
+ * --------------------
+ * Returns the number of records.
+ */
+
+uint64_t indexCount(const IndexReader* reader);
+
+/* Function: indexNext
+ * -------------------
+ * Reads the next record in file order.
+ * Returns false at the end or on error,
+ * which indexFailed tells apart.
+ */
+
+bool indexNext(IndexReader* reader, IndexRecord* record);
+
+/* Function: indexFailed
+ * ---------------------
+ * Returns true if indexNext stopped on a
+ * damaged or short file or a failed read
+ * rather than at the end of the records.
+ */
+
+bool indexFailed(const IndexReader* reader);
+
+/* Function: indexSetBox
+ * ---------------------
+ * Limits the records indexNext returns to
+ * those inside the rectangle from latTL,
+ * lonTL to latBR, lonBR, which wraps around
+ * the antimeridian if lonTL is east of
+ * lonBR. Blocks outside it are not read.
+ */
+
+void indexSetBox(IndexReader* reader, double latTL, double lonTL,
+    double latBR, double lonBR);
+
+/* Function: indexClose
+ * --------------------
+ * Closes the file and releases reader.
+ */
+
+void indexClose(IndexReader* reader);
+
+#endif
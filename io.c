@@ -0,0 +1,497 @@
+/* File: io.c
+ * ----------
+ * Implements the backends declared in io.h.
+ * The simulated backend draws every random
+ * choice from a hash of the operation rather
+ * than from shared state, so it needs no lock
+ * and repeats exactly across runs.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include "io.h"
+
+#define COPY_BLOCK 65536
+
+static IoBackend* current;
+
+/* Section: POSIX backend
+ * ----------------------
+ * Files are heap-allocated descriptors so
+ * that they fit the void* of the interface.
+ */
+
+static void* posixOpen(IoBackend* io, const char* path, long long* size) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+
+    struct stat fileStat;
+    int* file = malloc(sizeof(int));
+    if (file == NULL || fstat(fd, &fileStat) != 0) {
+        free(file);
+        close(fd);
+        return NULL;
+    }
+
+    *file = fd;
+    if (size != NULL) *size = (long long) fileStat.st_size;
+    return file;
+}
+
+static long long posixPread(IoBackend* io, void* file, void* buf,
+    size_t len, long long offset) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t got = pread(*(int*) file, (char*) buf + done, len - done, offset + done);
+        if (got < 0 && errno == EINTR) continue;
+        if (got < 0) return -1;
+        if (got == 0) break;
+        done += got;
+    }
+    return (long long) done;
+}
+
+static void posixClose(IoBackend* io, void* file) {
+    close(*(int*) file);
+    free(file);
+}
+
+static int posixStat(IoBackend* io, const char* path, struct stat* fileStat) {
+    return stat(path, fileStat);
+}
+
+static void* posixOpenDir(IoBackend* io, const char* path) {
+    return opendir(path);
+}
+
+static const char* posixReadDir(IoBackend* io, void* dir, bool* regular) {
+    struct dirent* fileEnt = readdir(dir);
+    if (fileEnt == NULL) return NULL;
+    *regular = fileEnt -> d_type == DT_REG;
+    return fileEnt -> d_name;
+}
+
+static void posixCloseDir(IoBackend* io, void* dir) {
+    closedir(dir);
+}
+
+/* Function: posixCopy
+ * -------------------
+ * Copies src to dest block by block, giving
+ * dest the permission bits of src. A partly
+ * written dest is removed.
+ */
+
+static bool posixCopy(IoBackend* io, const char* src, const char* dest) {
+    struct stat fileStat;
+    int in = open(src, O_RDONLY);
+    if (in < 0) return false;
+    if (fstat(in, &fileStat) != 0) {
+        close(in);
+        return false;
+    }
+
+    int out = open(dest, O_WRONLY | O_CREAT | O_TRUNC, fileStat.st_mode & 0777);
+    char* block = malloc(COPY_BLOCK);
+    bool ok = out >= 0 && block != NULL;
+    ssize_t got;
+
+    while (ok && ((got = read(in, block, COPY_BLOCK)) > 0 || (got < 0 && errno == EINTR)))
+        for (ssize_t done = 0, put; ok && done < got; done += put > 0 ? put : 0) {
+            put = write(out, block + done, got - done);
+            ok = put >= 0 || errno == EINTR;
+        }
+    if (ok && got < 0) ok = false;
+
+    free(block);
+    close(in);
+    if (out >= 0 && close(out) != 0) ok = false;
+    if (!ok && out >= 0) unlink(dest);
+    return ok;
+}
+
+static IoBackend posix = {
+    posixOpen, posixPread, posixClose, posixStat,
+    posixOpenDir, posixReadDir, posixCloseDir, posixCopy, NULL
+};
+
+IoBackend* ioPosix(void) {
+    return &posix;
+}
+
+/* Section: simulated backend
+ * --------------------------
+ * Each operation class has a latency model
+ * and a failure rate. Open files and open
+ * directories are wrapped to remember the
+ * path, which seeds the hash of later reads.
+ */
+
+enum { OP_OPEN, OP_READ, OP_STAT, OP_LIST, OP_COPY, OP_COUNT };
+static const char* opNames[OP_COUNT] = { "open", "read", "stat", "list", "copy" };
+
+typedef struct {
+    double mean;   // seconds
+    double jitter; // seconds either side of the mean
+    bool exponential;
+    double failRate;
+} OpModel;
+
+typedef struct {
+    IoBackend base;
+    IoBackend* inner;
+    OpModel ops[OP_COUNT];
+    uint64_t seed;
+} SimBackend;
+
+typedef struct {
+    void* inner;
+    uint64_t pathHash;
+} SimHandle;
+
+static uint64_t mix(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static uint64_t hashPath(const char* path) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (; *path; path++) {
+        h ^= (unsigned char) *path;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+/* Function: uniform
+ * -----------------
+ * Returns a number in [0, 1) drawn from the
+ * given key, one stream per draw index.
+ */
+
+static double uniform(uint64_t key, int draw) {
+    return (mix(key + 0x9E3779B97F4A7C15ULL * (draw + 1)) >> 11) * 0x1.0p-53;
+}
+
+/* Function: simulate
+ * ------------------
+ * Sleeps for the latency of one operation,
+ * identified by path and offset, and decides
+ * its outcome. Returns false if it should fail.
+ */
+
+static bool simulate(SimBackend* sim, int op, uint64_t pathHash, long long offset) {
+    OpModel* model = &sim -> ops[op];
+    uint64_t key = mix(sim -> seed ^ mix(pathHash ^ mix((uint64_t) offset * OP_COUNT + op)));
+
+    double delay = model -> mean;
+    if (model -> exponential) delay = -model -> mean * log(1 - uniform(key, 0));
+    delay += model -> jitter * (2 * uniform(key, 1) - 1);
+
+    if (delay > 0) {
+        struct timespec pause = { (time_t) delay, (long) ((delay - (time_t) delay) * 1e9) };
+        while (nanosleep(&pause, &pause) != 0 && errno == EINTR);
+    }
+
+    return uniform(key, 2) >= model -> failRate;
+}
+
+static void* simOpen(IoBackend* io, const char* path, long long* size) {
+    SimBackend* sim = (SimBackend*) io;
+    uint64_t pathHash = hashPath(path);
+    if (!simulate(sim, OP_OPEN, pathHash, 0)) return NULL;
+
+    SimHandle* handle = malloc(sizeof(SimHandle));
+    if (handle == NULL) return NULL;
+    handle -> inner = sim -> inner -> open(sim -> inner, path, size);
+    handle -> pathHash = pathHash;
+    if (handle -> inner == NULL) {
+        free(handle);
+        return NULL;
+    }
+    return handle;
+}
+
+static long long simPread(IoBackend* io, void* file, void* buf,
+    size_t len, long long offset) {
+    SimBackend* sim = (SimBackend*) io;
+    SimHandle* handle = file;
+    if (!simulate(sim, OP_READ, handle -> pathHash, offset + 1)) return -1;
+    return sim -> inner -> pread(sim -> inner, handle -> inner, buf, len, offset);
+}
+
+static void simClose(IoBackend* io, void* file) {
+    SimBackend* sim = (SimBackend*) io;
+    SimHandle* handle = file;
+    sim -> inner -> close(sim -> inner, handle -> inner);
+    free(handle);
+}
+
+static int simStat(IoBackend* io, const char* path, struct stat* fileStat) {
+    SimBackend* sim = (SimBackend*) io;
+    if (!simulate(sim, OP_STAT, hashPath(path), 0)) return -1;
+    return sim -> inner -> stat(sim -> inner, path, fileStat);
+}
+
+static void* simOpenDir(IoBackend* io, const char* path) {
+    SimBackend* sim = (SimBackend*) io;
+    uint64_t pathHash = hashPath(path);
+    if (!simulate(sim, OP_LIST, pathHash, 0)) return NULL;
+
+    SimHandle* handle = malloc(sizeof(SimHandle));
+    if (handle == NULL) return NULL;
+    handle -> inner = sim -> inner -> openDir(sim -> inner, path);
+    handle -> pathHash = pathHash;
+    if (handle -> inner == NULL) {
+        free(handle);
+        return NULL;
+    }
+    return handle;
+}
+
+//a listing costs one latency and fails as a whole, on opening
+static const char* simReadDir(IoBackend* io, void* dir, bool* regular) {
+    SimBackend* sim = (SimBackend*) io;
+    SimHandle* handle = dir;
+    return sim -> inner -> readDir(sim -> inner, handle -> inner, regular);
+}
+
+static void simCloseDir(IoBackend* io, void* dir) {
+    SimBackend* sim = (SimBackend*) io;
+    SimHandle* handle = dir;
+    sim -> inner -> closeDir(sim -> inner, handle -> inner);
+    free(handle);
+}
+
+static bool simCopy(IoBackend* io, const char* src, const char* dest) {
+    SimBackend* sim = (SimBackend*) io;
+    if (!simulate(sim, OP_COPY, hashPath(src), 0)) return false;
+    return sim -> inner -> copy(sim -> inner, src, dest);
+}
+
+static void simDestroy(IoBackend* io) {
+    free(io);
+}
+
+/* Function: parseTime
+ * -------------------
+ * Parses a duration such as 5ms or 200us
+ * into seconds. Returns the end of the
+ * duration, or NULL if malformed.
+ */
+
+static const char* parseTime(const char* text, double* seconds) {
+    char* end;
+    double value = strtod(text, &end);
+    if (end == text || value < 0) return NULL;
+
+    double scale = 1e-3;
+    if (strncmp(end, "us", 2) == 0) { scale = 1e-6; end += 2; }
+    else if (strncmp(end, "ms", 2) == 0) end += 2;
+    else if (*end == 's') { scale = 1; end += 1; }
+
+    *seconds = value * scale;
+    return end;
+}
+
+/* Function: parseItem
+ * -------------------
+ * Applies one item of a spec, of length
+ * len, to sim. Returns false if malformed.
+ */
+
+static bool parseItem(SimBackend* sim, const char* item, size_t len) {
+    char text[len + 1];
+    memcpy(text, item, len);
+    text[len] = '\0';
+
+    char* value = strchr(text, '=');
+    if (value == NULL) return false;
+    *value++ = '\0';
+
+    char* end;
+    if (strcmp(text, "seed") == 0) {
+        sim -> seed = strtoull(value, &end, 10);
+        return end != value && *end == '\0';
+    }
+
+    //op, op.fail or fail, where op may be all
+    const char* field = NULL;
+    char* dot = strchr(text, '.');
+    if (dot != NULL) {
+        *dot = '\0';
+        field = dot + 1;
+    } else if (strcmp(text, "fail") == 0) {
+        field = "fail";
+        text[0] = '\0';
+    }
+
+    int first = 0, last = OP_COUNT - 1;
+    if (text[0] != '\0' && strcmp(text, "all") != 0) {
+        for (first = 0; first < OP_COUNT && strcmp(text, opNames[first]) != 0; first++);
+        if (first == OP_COUNT) return false;
+        last = first;
+    }
+
+    if (field != NULL) {
+        if (strcmp(field, "fail") != 0) return false;
+        double rate = strtod(value, &end);
+        if (end == value || *end != '\0' || rate < 0 || rate > 1) return false;
+        for (int op = first; op <= last; op++) sim -> ops[op].failRate = rate;
+        return true;
+    }
+
+    OpModel model = sim -> ops[first];
+    const char* at = value;
+    model.exponential = strncmp(at, "exp:", 4) == 0;
+    if (model.exponential) at += 4;
+    if ((at = parseTime(at, &model.mean)) == NULL) return false;
+    model.jitter = 0;
+    if (*at == '~' && (at = parseTime(at + 1, &model.jitter)) == NULL) return false;
+    if (*at != '\0') return false;
+
+    for (int op = first; op <= last; op++) {
+        model.failRate = sim -> ops[op].failRate;
+        sim -> ops[op] = model;
+    }
+    return true;
+}
+
+IoBackend* ioSimCreate(const char* spec, IoBackend* inner) {
+    SimBackend* sim = calloc(1, sizeof(SimBackend));
+    if (sim == NULL) return NULL;
+
+    sim -> base = (IoBackend) {
+        simOpen, simPread, simClose, simStat,
+        simOpenDir, simReadDir, simCloseDir, simCopy, simDestroy
+    };
+    sim -> inner = inner;
+
+    while (*spec != '\0') {
+        size_t len = strcspn(spec, ",");
+        if (len == 0 || !parseItem(sim, spec, len)) {
+            free(sim);
+            return NULL;
+        }
+        spec += len + (spec[len] == ',');
+    }
+
+    return &sim -> base;
+}
+
+void ioFree(IoBackend* io) {
+    if (io != NULL && io -> destroy != NULL) io -> destroy(io);
+}
+
+/* Section: current backend
+ * ------------------------
+ */
+
+void ioSetBackend(IoBackend* io) {
+    current = io;
+}
+
+static IoBackend* backend(void) {
+    return current != NULL ? current : &posix;
+}
+
+void* ioOpen(const char* path, long long* size) {
+    return backend() -> open(backend(), path, size);
+}
+
+long long ioPread(void* file, void* buf, size_t len, long long offset) {
+    return backend() -> pread(backend(), file, buf, len, offset);
+}
+
+void ioClose(void* file) {
+    backend() -> close(backend(), file);
+}
+
+int ioStat(const char* path, struct stat* fileStat) {
+    return backend() -> stat(backend(), path, fileStat);
+}
+
+void* ioOpenDir(const char* path) {
+    return backend() -> openDir(backend(), path);
+}
+
+const char* ioReadDir(void* dir, bool* regular) {
+    return backend() -> readDir(backend(), dir, regular);
+}
+
+void ioCloseDir(void* dir) {
+    backend() -> closeDir(backend(), dir);
+}
+
+bool ioCopy(const char* src, const char* dest) {
+    return backend() -> copy(backend(), src, dest);
+}
+
+/* Section: stdio bridge
+ * ---------------------
+ * A cookie stream keeps its own position
+ * and turns each buffered read into one
+ * positioned read on the backend.
+ */
+
+typedef struct {
+    void* file;
+    long long size;
+    long long position;
+} Stream;
+
+static ssize_t streamRead(void* cookie, char* buf, size_t len) {
+    Stream* stream = cookie;
+    long long got = ioPread(stream -> file, buf, len, stream -> position);
+    if (got < 0) return -1;
+    stream -> position += got;
+    return (ssize_t) got;
+}
+
+static int streamSeek(void* cookie, off64_t* offset, int whence) {
+    Stream* stream = cookie;
+    long long base = whence == SEEK_SET ? 0
+        : whence == SEEK_CUR ? stream -> position : stream -> size;
+    if (base + *offset < 0) return -1;
+    stream -> position = base + *offset;
+    *offset = stream -> position;
+    return 0;
+}
+
+static int streamClose(void* cookie) {
+    Stream* stream = cookie;
+    ioClose(stream -> file);
+    free(stream);
+    return 0;
+}
+
+FILE* ioFopen(const char* path, const char* mode) {
+    if (backend() == &posix || strcmp(mode, "rb") != 0) return fopen(path, mode);
+
+    Stream* stream = malloc(sizeof(Stream));
+    if (stream == NULL) return NULL;
+    stream -> position = 0;
+    stream -> file = ioOpen(path, &stream -> size);
+    if (stream -> file == NULL) {
+        free(stream);
+        return NULL;
+    }
+
+    cookie_io_functions_t functions = { streamRead, NULL, streamSeek, streamClose };
+    FILE* file = fopencookie(stream, "rb", functions);
+    if (file == NULL) streamClose(stream);
+    return file;
+}
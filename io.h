@@ -0,0 +1,127 @@
+/* File: io.h
+ * ----------
+ * The file access layer shared by the EXIF
+ * parser and the scanner. Every read of the
+ * source tree goes through the current
+ * backend: plain POSIX calls by default, or
+ * a simulated store that adds latency and
+ * failures on top of another backend, so
+ * that slow or flaky storage such as NFS
+ * can be reproduced on a local disk.
+ */
+
+#ifndef _IO_H_
+#define _IO_H_
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/stat.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Type: IoBackend
+ * ---------------
+ * A table of file operations. Backends put
+ * this first in their own state so that
+ * each operation can find it. Operations
+ * return NULL, -1 or false on failure and
+ * must be safe to call from many threads.
+ */
+
+typedef struct IoBackend IoBackend;
+struct IoBackend {
+    void* (*open)(IoBackend* io, const char* path, long long* size);
+    long long (*pread)(IoBackend* io, void* file, void* buf,
+        size_t len, long long offset);
+    void (*close)(IoBackend* io, void* file);
+    int (*stat)(IoBackend* io, const char* path, struct stat* fileStat);
+    void* (*openDir)(IoBackend* io, const char* path);
+    const char* (*readDir)(IoBackend* io, void* dir, bool* regular);
+    void (*closeDir)(IoBackend* io, void* dir);
+    bool (*copy)(IoBackend* io, const char* src, const char* dest);
+    void (*destroy)(IoBackend* io);
+};
+
+/* Function: ioPosix
+ * -----------------
+ * Returns the backend that uses the
+ * local file system directly.
+ */
+
+IoBackend* ioPosix(void);
+
+/* Function: ioSimCreate
+ * ---------------------
+ * Creates a backend that forwards to inner
+ * after sleeping for a simulated latency,
+ * or fails instead, as described by spec:
+ * a comma separated list of items
+ *
+ *   op=[exp:]TIME[~TIME]  latency of op, fixed or
+ *                         exponential with that mean,
+ *                         plus uniform jitter of ±TIME
+ *   op.fail=P             failure rate of op
+ *   fail=P                failure rate of every op
+ *   seed=N                seed of the simulation
+ *
+ * where op is open, read, stat, list, copy or
+ * all, and TIME is a number with unit us, ms
+ * (default) or s. Outcomes are drawn from a
+ * hash of the seed and the operation's path
+ * and offset, so a run behaves the same way
+ * however its threads are scheduled. Returns
+ * NULL if spec is malformed.
+ */
+
+IoBackend* ioSimCreate(const char* spec, IoBackend* inner);
+
+/* Function: ioFree
+ * ----------------
+ * Releases a backend made by ioSimCreate.
+ */
+
+void ioFree(IoBackend* io);
+
+/* Function: ioSetBackend
+ * ----------------------
+ * Makes io the backend of all the
+ * functions below. Not thread-safe;
+ * call it before starting a scan.
+ */
+
+void ioSetBackend(IoBackend* io);
+
+/* Functions: ioOpen, ioPread, ioClose, ioStat,
+ *            ioOpenDir, ioReadDir, ioCloseDir, ioCopy
+ * ---------------------------------------------------
+ * Perform one operation with the current backend.
+ */
+
+void* ioOpen(const char* path, long long* size);
+long long ioPread(void* file, void* buf, size_t len, long long offset);
+void ioClose(void* file);
+int ioStat(const char* path, struct stat* fileStat);
+void* ioOpenDir(const char* path);
+const char* ioReadDir(void* dir, bool* regular);
+void ioCloseDir(void* dir);
+bool ioCopy(const char* src, const char* dest);
+
+/* Function: ioFopen
+ * -----------------
+ * Opens a file for reading as a stdio
+ * stream whose reads go through the
+ * current backend, for code written
+ * against stdio. Other modes always
+ * open the local file.
+ */
+
+FILE* ioFopen(const char* path, const char* mode);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
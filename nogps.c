@@ -0,0 +1,336 @@
+/* File: nogps.c
+ * -------------
+ * Implements the negative cache declared in
+ * nogps.h. The file holds a sorted list of
+ * 64-bit keys, each with the day it was last
+ * seen, after a short header giving the
+ * format and reader versions. On load
+ * the keys go into an open-addressed table
+ * that is never written during a run, so
+ * lookups take no lock; keys added during
+ * the run go to a separate locked list.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include "nogps.h"
+
+#define CACHE_MAGIC "BNGC"
+#define CACHE_VERSION 2
+
+//version of the readers that found the cached files to
+//lack GPS, bumped with every new source of positions so
+//that negatives from older readers are dropped:
+//  1 TIFF-based RAW files
+//  2 HEIC/HEIF files
+//  3 PNG and WebP files
+//  4 XMP packets inside JPEG files
+//  5 XMP sidecar files
+//  6 MP4 and MOV files
+#define CACHE_READERS 6
+#define CACHE_MAX_KEYS (1ULL << 28) // 3 GB of entries
+#define CACHE_MAX_DAYS 180 // keys unseen for longer are dropped
+#define ENTRY_SIZE 12
+
+/* Type: Entry
+ * -----------
+ * One key with the day, counted from the
+ * epoch, on which it was last seen.
+ */
+
+typedef struct {
+    uint64_t key;
+    uint32_t day;
+} Entry;
+
+struct NoGpsCache {
+    char* path;
+    uint32_t today;
+
+    //keys loaded from the file
+    uint64_t* slots;
+    uint32_t* days;
+    unsigned char* hits;
+    size_t mask;
+
+    //keys added during this run
+    uint64_t* added;
+    size_t addedCount, addedCapacity;
+    pthread_mutex_t lock;
+};
+
+static uint64_t mix(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+uint64_t noGpsKey(const struct stat* fileStat) {
+    uint64_t h = mix((uint64_t) fileStat -> st_dev);
+    h = mix(h ^ (uint64_t) fileStat -> st_ino);
+    h = mix(h ^ (uint64_t) fileStat -> st_size);
+    h = mix(h ^ (uint64_t) fileStat -> st_mtim.tv_sec);
+    h = mix(h ^ (uint64_t) fileStat -> st_mtim.tv_nsec);
+    return h == 0 ? 1 : h; // zero marks a free slot
+}
+
+static uint64_t readLE64(const unsigned char* p) {
+    uint64_t value = 0;
+    for (int b = 7; b >= 0; b--) value = (value << 8) | p[b];
+    return value;
+}
+
+static void writeLE64(unsigned char* p, uint64_t value) {
+    for (int b = 0; b < 8; b++) p[b] = (unsigned char) (value >> (8 * b));
+}
+
+static uint32_t readLE32(const unsigned char* p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+static void writeLE32(unsigned char* p, uint32_t value) {
+    for (int b = 0; b < 4; b++) p[b] = (unsigned char) (value >> (8 * b));
+}
+
+/* Function: loadEntries
+ * ---------------------
+ * Reads the entries of a cache file into
+ * a fresh array. Returns their number,
+ * leaving entries NULL on any error,
+ * including a count that does not match
+ * the size of the file.
+ */
+
+static size_t loadEntries(const char* path, Entry** entries) {
+    unsigned char header[16];
+    FILE* file = fopen(path, "rb");
+    *entries = NULL;
+    if (file == NULL) return 0;
+
+    if (fread(header, 1, sizeof(header), file) != sizeof(header) ||
+        memcmp(header, CACHE_MAGIC, 4) != 0 || header[4] != CACHE_VERSION ||
+        (header[6] | header[7] << 8) != CACHE_READERS) {
+        fclose(file);
+        return 0; // not a cache we can use
+    }
+
+    //trust the count only as far as the file bears it out
+    struct stat fileStat;
+    uint64_t count = readLE64(header + 8);
+    if (fstat(fileno(file), &fileStat) != 0 || fileStat.st_size < 16 ||
+        (fileStat.st_size - 16) % ENTRY_SIZE != 0 ||
+        count != (uint64_t) (fileStat.st_size - 16) / ENTRY_SIZE ||
+        count > CACHE_MAX_KEYS) {
+        fclose(file);
+        return 0;
+    }
+
+    unsigned char* raw = malloc(count * ENTRY_SIZE + 1);
+    *entries = malloc((count + 1) * sizeof(Entry));
+    if (raw == NULL || *entries == NULL ||
+        fread(raw, ENTRY_SIZE, count, file) != count) {
+        free(*entries);
+        *entries = NULL;
+        count = 0;
+    } else {
+        for (size_t i = 0; i < count; i++) {
+            (*entries)[i].key = readLE64(raw + ENTRY_SIZE * i);
+            (*entries)[i].day = readLE32(raw + ENTRY_SIZE * i + 8);
+        }
+    }
+
+    free(raw);
+    fclose(file);
+    return count;
+}
+
+NoGpsCache* noGpsLoad(const char* path) {
+    NoGpsCache* cache = calloc(1, sizeof(NoGpsCache));
+    if (cache == NULL) return NULL;
+    pthread_mutex_init(&cache -> lock, NULL);
+
+    Entry* entries;
+    size_t count = loadEntries(path, &entries);
+    size_t capacity = 16;
+    while (capacity < count * 2) capacity *= 2;
+
+    cache -> path = strdup(path);
+    cache -> today = (uint32_t) (time(NULL) / 86400);
+    cache -> slots = calloc(capacity, sizeof(uint64_t));
+    cache -> days = calloc(capacity, sizeof(uint32_t));
+    cache -> hits = calloc(capacity, 1);
+    cache -> mask = capacity - 1;
+    if (cache -> path == NULL || cache -> slots == NULL || cache -> days == NULL ||
+        cache -> hits == NULL) {
+        free(entries);
+        noGpsFree(cache);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        uint64_t key = entries[i].key;
+        if (key == 0) continue;
+        size_t slot = mix(key) & cache -> mask;
+        while (cache -> slots[slot] != 0 && cache -> slots[slot] != key)
+            slot = (slot + 1) & cache -> mask;
+        cache -> slots[slot] = key;
+        cache -> days[slot] = entries[i].day;
+    }
+
+    free(entries);
+    return cache;
+}
+
+/* Function: findSlot
+ * ------------------
+ * Returns the slot holding a loaded key,
+ * or SIZE_MAX if it was not loaded.
+ */
+
+static size_t findSlot(const NoGpsCache* cache, uint64_t key) {
+    size_t slot = mix(key) & cache -> mask;
+
+    while (cache -> slots[slot] != 0) {
+        if (cache -> slots[slot] == key) return slot;
+        slot = (slot + 1) & cache -> mask;
+    }
+
+    return SIZE_MAX;
+}
+
+bool noGpsContains(NoGpsCache* cache, uint64_t key) {
+    size_t slot = findSlot(cache, key);
+    if (slot == SIZE_MAX) return false;
+    cache -> hits[slot] = 1; // benign race: every writer stores 1
+    return true;
+}
+
+void noGpsAdd(NoGpsCache* cache, uint64_t key) {
+    pthread_mutex_lock(&cache -> lock);
+
+    if (cache -> addedCount == cache -> addedCapacity) {
+        size_t capacity = cache -> addedCapacity ? cache -> addedCapacity * 2 : 1024;
+        uint64_t* added = realloc(cache -> added, capacity * sizeof(uint64_t));
+        if (added != NULL) {
+            cache -> added = added;
+            cache -> addedCapacity = capacity;
+        }
+    }
+
+    //a failed grow just forgets the key
+    if (cache -> addedCount < cache -> addedCapacity)
+        cache -> added[cache -> addedCount++] = key;
+
+    pthread_mutex_unlock(&cache -> lock);
+}
+
+static int compareEntries(const void* a, const void* b) {
+    uint64_t ka = ((const Entry*) a) -> key, kb = ((const Entry*) b) -> key;
+    return (ka > kb) - (ka < kb);
+}
+
+/* Function: fresh
+ * ---------------
+ * Checks whether a key last seen on day
+ * is recent enough to be kept.
+ */
+
+static bool fresh(const NoGpsCache* cache, uint32_t day) {
+    return day >= cache -> today || cache -> today - day <= CACHE_MAX_DAYS;
+}
+
+bool noGpsSave(NoGpsCache* cache) {
+    //other processes may have saved the same file since it
+    //was loaded, so take turns and keep the keys they added
+    char lockPath[strlen(cache -> path) + 6];
+    strcpy(lockPath, cache -> path); strcat(lockPath, ".lock");
+    int lockFd = open(lockPath, O_RDWR | O_CREAT, 0644);
+    if (lockFd >= 0) flock(lockFd, LOCK_EX);
+
+    Entry* others;
+    size_t otherCount = loadEntries(cache -> path, &others);
+    size_t total = cache -> addedCount + otherCount + cache -> mask + 1;
+
+    //gather the loaded, added and other keys in sorted order;
+    //loaded keys are kept whether seen in this run or not,
+    //until they have gone unseen for CACHE_MAX_DAYS
+    Entry* entries = malloc((total + 1) * sizeof(Entry));
+    unsigned char* raw = malloc(total * ENTRY_SIZE + 16);
+    if (entries == NULL || raw == NULL) {
+        free(others);
+        free(entries);
+        free(raw);
+        if (lockFd >= 0) close(lockFd);
+        return false;
+    }
+
+    size_t count = 0;
+    for (size_t slot = 0; slot <= cache -> mask; slot++) {
+        uint32_t day = cache -> hits[slot] ? cache -> today : cache -> days[slot];
+        if (cache -> slots[slot] != 0 && fresh(cache, day))
+            entries[count++] = (Entry) {cache -> slots[slot], day};
+    }
+    for (size_t i = 0; i < cache -> addedCount; i++)
+        entries[count++] = (Entry) {cache -> added[i], cache -> today};
+    for (size_t i = 0; i < otherCount; i++)
+        if (others[i].key != 0 && fresh(cache, others[i].day))
+            entries[count++] = others[i];
+    qsort(entries, count, sizeof(Entry), compareEntries);
+
+    //of the copies of a key, keep the latest day
+    size_t unique = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (unique > 0 && entries[unique - 1].key == entries[i].key) {
+            if (entries[i].day > entries[unique - 1].day)
+                entries[unique - 1].day = entries[i].day;
+        } else entries[unique++] = entries[i];
+    }
+
+    memset(raw, 0, 16);
+    memcpy(raw, CACHE_MAGIC, 4);
+    raw[4] = CACHE_VERSION;
+    raw[6] = CACHE_READERS & 0xFF;
+    raw[7] = CACHE_READERS >> 8;
+    writeLE64(raw + 8, unique);
+    for (size_t i = 0; i < unique; i++) {
+        writeLE64(raw + 16 + ENTRY_SIZE * i, entries[i].key);
+        writeLE32(raw + 16 + ENTRY_SIZE * i + 8, entries[i].day);
+    }
+
+    //write beside the cache, then swap it in
+    size_t size = 16 + unique * ENTRY_SIZE;
+    char tempPath[strlen(cache -> path) + 5];
+    strcpy(tempPath, cache -> path); strcat(tempPath, ".tmp");
+    FILE* file = fopen(tempPath, "wb");
+    bool ok = file != NULL && fwrite(raw, 1, size, file) == size;
+    if (file != NULL && fclose(file) != 0) ok = false;
+    if (ok) ok = rename(tempPath, cache -> path) == 0;
+    else if (file != NULL) remove(tempPath);
+
+    if (lockFd >= 0) close(lockFd);
+    free(others);
+    free(entries);
+    free(raw);
+    return ok;
+}
+
+void noGpsFree(NoGpsCache* cache) {
+    if (cache == NULL) return;
+    pthread_mutex_destroy(&cache -> lock);
+    free(cache -> path);
+    free(cache -> slots);
+    free(cache -> days);
+    free(cache -> hits);
+    free(cache -> added);
+    free(cache);
+}
@@ -0,0 +1,85 @@
+/* File: nogps.h
+ * -------------
+ * Remembers files that were found to carry no
+ * GPS position, keyed by device, inode, size and
+ * modification time, so that later runs can skip
+ * them without opening them. Any change to a file
+ * changes its key, which makes it be read again.
+ * Lookups and additions are safe to make from
+ * several threads at once.
+ */
+
+#ifndef _NOGPS_H_
+#define _NOGPS_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/stat.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct NoGpsCache NoGpsCache;
+
+/* Function: noGpsLoad
+ * -------------------
+ * Loads the cache stored at path. A missing
+ * or unreadable file gives an empty cache.
+ * Returns NULL only if out of memory.
+ */
+
+NoGpsCache* noGpsLoad(const char* path);
+
+/* Function: noGpsKey
+ * ------------------
+ * Computes the cache key of a file from
+ * the result of stat on it.
+ */
+
+uint64_t noGpsKey(const struct stat* fileStat);
+
+/* Function: noGpsContains
+ * -----------------------
+ * Checks whether key is known to lack GPS,
+ * and marks it as seen today if so.
+ */
+
+bool noGpsContains(NoGpsCache* cache, uint64_t key);
+
+/* Function: noGpsAdd
+ * ------------------
+ * Records that the file with key has no
+ * GPS position.
+ */
+
+void noGpsAdd(NoGpsCache* cache, uint64_t key);
+
+/* Function: noGpsSave
+ * -------------------
+ * Writes the loaded and added keys back to
+ * the file the cache was loaded from,
+ * replacing it atomically, along with keys
+ * other processes saved there since it was
+ * loaded, so runs over different folders
+ * can share one file. Keys not seen for 180
+ * days are dropped. Saves of the same file
+ * take turns through a lock on path.lock.
+ * Returns false if the file could not be
+ * written.
+ */
+
+bool noGpsSave(NoGpsCache* cache);
+
+/* Function: noGpsFree
+ * -------------------
+ * Releases all memory held by cache.
+ */
+
+void noGpsFree(NoGpsCache* cache);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,1028 @@
+/* File: scan.c
+ * ------------
+ * Implements the scanning engine declared in
+ * scan.h. The folder is listed up front and
+ * its files are shared out to the workers one
+ * at a time, so a slow file holds up only the
+ * worker reading it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "scan.h"
+#include "exif.h"
+#include "dedupe.h"
+#include "nogps.h"
+#include "xmp.h"
+#include "video.h"
+#include "io.h"
+
+#define MAX_SIDECAR (4 * 1024 * 1024)
+#define RING_SIZE 1024
+#define RING_WAIT 100000 // nanoseconds between polls
+#define NO_SLOT -1 // a file handled without holding a slot
+
+/* Type: EXIFCoord
+ * ---------------
+ * Stores the EXIF GPS coordinate
+ * of a particular image. Set the
+ * error boolean if EXIF read failed,
+ * and unreadable as well if the file
+ * itself could not be read.
+ */
+
+typedef struct {
+    double lat;
+    double lon;
+    bool error;
+    bool unreadable;
+} EXIFCoord;
+
+/* Type: FileList
+ * --------------
+ * Names of the regular files found
+ * in a directory, read up front so
+ * that workers can share them out.
+ * XMP sidecar files are not listed
+ * as files of their own; instead,
+ * sidecars[i] names the sidecar of
+ * file i, or is NULL if it has none.
+ */
+
+typedef struct {
+    char** names;
+    const char** sidecars;
+    size_t count;
+    char** sidecarNames;
+    size_t sidecarCount;
+} FileList;
+
+/* Type: ScanJob
+ * -------------
+ * Shared state of one parallel scan. The
+ * next field is a cursor into files that
+ * workers advance atomically, and stopped
+ * is set once the callback asks to stop.
+ */
+
+typedef struct {
+    const BoundConfig* config;
+    FileList files;
+    size_t next;
+    int stopped;
+    bool interactive;
+    BoundCallback onResult;
+    void* ctx;
+    DedupeSet* dedupe;
+    NoGpsCache* noGps;
+} ScanJob;
+
+typedef struct {
+    ScanJob* job;
+    int id;
+} ScanWorker;
+
+/* Type: Scheduler
+ * ---------------
+ * Slots shared by every scan of the process,
+ * as set by boundSetSlots. busy counts the
+ * files being read by bulk (0) and by
+ * interactive (1) scans, and waiting the
+ * interactive workers held up for a slot.
+ */
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t freed;
+    int slots, reserved;
+    int busy[2];
+    int waiting;
+} Scheduler;
+
+static pthread_once_t initOnce = PTHREAD_ONCE_INIT;
+static Scheduler scheduler = {PTHREAD_MUTEX_INITIALIZER,
+    PTHREAD_COND_INITIALIZER, 0, 0, {0, 0}, 0};
+
+/* Function: copyFile
+ * ------------------
+ * Attempts to copy the file at src
+ * to the path given by dest through
+ * the current I/O backend. Returns
+ * false if the copy failed.
+ */
+
+static bool copyFile(const char* src, const char* dest) {
+    return ioCopy(src, dest);
+}
+
+/* Function: convertDMS
+ * --------------------
+ * Takes an array of six values representing
+ * the degree, minute, and second values of
+ * a GPS coordinate in rational form, as well
+ * as a direction character. Returns the coord
+ * in decimal degree form relative to NE such
+ * that W and S coordinates are negative.
+ */
+
+static double convertDMS(const int* DMSArray, char direction) {
+    double minutes = (float) 1 / (float) 60;
+    double seconds = (float) 1 / (float) 3600;
+
+    double degrees = (float) DMSArray[0] / (float) DMSArray[1];
+    degrees += (float) DMSArray[2] / (float) DMSArray[3] * minutes;
+    degrees += (float) DMSArray[4] / (float) DMSArray[5] * seconds;
+
+    degrees *= (direction == 'N' || direction == 'E') ? 1.0 : -1.0;
+    return degrees;
+}
+
+/* Function: getIfdCoord
+ * ---------------------
+ * Reads and processes the EXIF GPS data
+ * from an already parsed IFD table array.
+ * Returns a struct representing the decimal
+ * latitude and longitude of image GPS data.
+ */
+
+static EXIFCoord getIfdCoord(void** ifdArray) {
+    EXIFCoord coord = {0, 0, true, false}; // initialize struct with defaults
+
+    //default coord error value is true
+    if (ifdArray == NULL) return coord;
+
+    //see exif.h for documentation on how these calls work
+    TagNodeInfo* lat = getTagInfo(ifdArray, IFD_GPS, TAG_GPSLatitude);
+    TagNodeInfo* lon = getTagInfo(ifdArray, IFD_GPS, TAG_GPSLongitude);
+    TagNodeInfo* latDir = getTagInfo(ifdArray, IFD_GPS, TAG_GPSLatitudeRef);
+    TagNodeInfo* lonDir = getTagInfo(ifdArray, IFD_GPS, TAG_GPSLongitudeRef);
+
+    //coord stays an error if any read fails
+    if (lat && !lat -> error && lon && !lon -> error &&
+        latDir && !latDir -> error && lonDir && !lonDir -> error) {
+        coord.lat = convertDMS((int*) lat -> numData, latDir -> byteData[0]);
+        coord.lon = convertDMS((int*) lon -> numData, lonDir -> byteData[0]);
+        coord.error = false;
+    }
+
+    //getTagInfo hands out copies
+    if (lat) freeTagInfo(lat);
+    if (lon) freeTagInfo(lon);
+    if (latDir) freeTagInfo(latDir);
+    if (lonDir) freeTagInfo(lonDir);
+    return coord;
+}
+
+/* Function: getXmpCoord
+ * ---------------------
+ * Reads the GPS position from the XMP
+ * packet of a JPEG file, where some
+ * editors write it instead of EXIF.
+ * The packet is read along with the
+ * EXIF data, and only for JPEG files
+ * whose EXIF data has no position.
+ */
+
+static EXIFCoord getXmpCoord(const char* packet, unsigned int length) {
+    EXIFCoord coord = {0, 0, true, false};
+    if (packet != NULL)
+        coord.error = !xmpGetCoord(packet, length, &coord.lat, &coord.lon);
+    return coord;
+}
+
+/* Function: getSidecarCoord
+ * -------------------------
+ * Reads the GPS position from an XMP
+ * sidecar file kept next to an image.
+ */
+
+static EXIFCoord getSidecarCoord(const char* sidecar) {
+    EXIFCoord coord = {0, 0, true, false};
+    FILE* file = ioFopen(sidecar, "rb");
+    if (file == NULL) return coord;
+
+    //sidecars are a few kilobytes of text
+    char* packet = NULL;
+    long length;
+    if (fseek(file, 0, SEEK_END) == 0 && (length = ftell(file)) > 0 &&
+        length <= MAX_SIDECAR && fseek(file, 0, SEEK_SET) == 0 &&
+        (packet = malloc(length)) != NULL &&
+        fread(packet, 1, length, file) == (size_t) length)
+        coord.error = !xmpGetCoord(packet, length, &coord.lat, &coord.lon);
+
+    free(packet);
+    fclose(file);
+    return coord;
+}
+
+/* Function: getVideoCoord
+ * -----------------------
+ * Reads the recording location of
+ * an MP4 or QuickTime video.
+ */
+
+static EXIFCoord getVideoCoord(const char* path) {
+    EXIFCoord coord = {0, 0, true, false};
+    coord.error = !videoGetCoord(path, &coord.lat, &coord.lon);
+    return coord;
+}
+
+/* Function: getFileCoord
+ * ----------------------
+ * Takes the GPS position of a file from its
+ * parsed IFD table array and the result of
+ * parsing it, falling back to the XMP packet
+ * read with it
+ * and then to its sidecar, if it has one,
+ * when the EXIF data holds none. Files of
+ * no image format are tried as videos.
+ */
+
+static EXIFCoord getFileCoord(const char* path, const char* sidecar,
+    void** ifdArray, int result, const char* xmp, unsigned int xmpLength) {
+    EXIFCoord coord = getIfdCoord(ifdArray);
+    if (coord.error && result == ERR_UNKNOWN_FORMAT) coord = getVideoCoord(path);
+    else if (coord.error) coord = getXmpCoord(xmp, xmpLength);
+    if (coord.error && sidecar != NULL) coord = getSidecarCoord(sidecar);
+    coord.unreadable = result == ERR_READ_FILE;
+    return coord;
+}
+
+/* Function: coordInBounds
+ * -----------------------
+ * Checks if the GPS position of a given image
+ * falls within the provided bounding rectangle
+ * defined by its top left and bottom right corners
+ * on a map of the world centered at the Greenwich
+ * meridian and oriented upright.
+ */
+
+static bool coordInBounds(EXIFCoord imageGPS, double latTL,
+    double lonTL, double latBR, double lonBR) {
+    //getEXIFCoords sets false flag if the
+    //GPS data could not actually be read
+    if (imageGPS.error) return false;
+
+    //check bounds [inclusive check with bounds]
+    if (imageGPS.lat <= latTL && imageGPS.lon >= lonTL
+        && imageGPS.lat >= latBR && imageGPS.lon <= lonBR)
+        return true;
+
+    //not in bounds
+    return false;
+}
+
+/* Function: writeThumbnail
+ * ------------------------
+ * Writes the embedded thumbnail of the image
+ * at path, found at offset and of length
+ * bytes, to thumbsPath under the same
+ * name, plus .jpg unless it is a JPEG.
+ * The thumbnail is read straight
+ * from its offset in the file, so the main
+ * image data is never touched. Returns false
+ * if the image has no thumbnail or it could
+ * not be copied.
+ */
+
+static bool writeThumbnail(const char* path, unsigned int offset,
+    unsigned int length, const char* thumbsPath, const char* name) {
+    if (length == 0) return false;
+
+    unsigned char* data = malloc(length);
+    void* src = ioOpen(path, NULL);
+    bool copied = data != NULL && src != NULL &&
+        ioPread(src, data, length, offset) == (long long) length;
+    if (src != NULL) ioClose(src);
+
+    //compute the thumbnail name from the thumbnail folder; the
+    //thumbnail is always a JPEG, so other images get a suffix
+    const char* dot = strrchr(name, '.');
+    bool jpeg = dot != NULL && (strcasecmp(dot, ".jpg") == 0 ||
+        strcasecmp(dot, ".jpeg") == 0);
+    char thumbName[strlen(thumbsPath) + strlen(name) + 6];
+    strcpy(thumbName, thumbsPath); strcat(thumbName, "/");
+    strcat(thumbName, name);
+    if (!jpeg) strcat(thumbName, ".jpg");
+
+    FILE* out = copied ? fopen(thumbName, "wb") : NULL;
+    if (out == NULL) copied = false;
+    else {
+        if (fwrite(data, 1, length, out) != length) copied = false;
+        if (fclose(out) != 0) copied = false;
+    }
+
+    free(data);
+    return copied;
+}
+
+/* Function: hashTag
+ * -----------------
+ * Folds the id and value of one tag into a
+ * running FNV-1a hash. Missing tags fold in
+ * just their id so that fields cannot shift
+ * into each other. Returns the new hash.
+ */
+
+static uint64_t hashTag(uint64_t h, void** ifdArray,
+    IFD_TYPE ifdType, unsigned short tagId, bool* found) {
+    TagNodeInfo* tag = getTagInfo(ifdArray, ifdType, tagId);
+    const unsigned char* data = (const unsigned char*) &tagId;
+    size_t len = sizeof(tagId);
+
+    for (int pass = 0; pass < 2; pass++) {
+        for (size_t i = 0; i < len; i++) {
+            h ^= data[i];
+            h *= 0x100000001b3ULL;
+        }
+
+        //second pass hashes the value itself
+        if (tag == NULL || tag -> error) break;
+        if (tag -> byteData != NULL) {
+            data = tag -> byteData;
+            len = tag -> count;
+        } else if (tag -> numData != NULL) {
+            data = (const unsigned char*) tag -> numData;
+            len = tag -> count * sizeof(int) *
+                (tag -> type == TYPE_RATIONAL || tag -> type == TYPE_SRATIONAL ? 2 : 1);
+        } else break;
+    }
+
+    if (found) *found = tag != NULL && !tag -> error;
+    if (tag) freeTagInfo(tag);
+    return h;
+}
+
+/* Function: getIfdFingerprint
+ * ---------------------------
+ * Computes a 64-bit fingerprint of an image
+ * from its capture time, camera, position and
+ * pixel size, as duplicates of one photo keep
+ * those identical. Returns zero if the image
+ * has no original capture time, since such
+ * images cannot be told apart reliably.
+ */
+
+static uint64_t getIfdFingerprint(void** ifdArray) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    bool dated;
+    if (ifdArray == NULL) return 0;
+
+    h = hashTag(h, ifdArray, IFD_EXIF, TAG_DateTimeOriginal, &dated);
+    h = hashTag(h, ifdArray, IFD_EXIF, TAG_SubSecTimeOriginal, NULL);
+    h = hashTag(h, ifdArray, IFD_0TH, TAG_Make, NULL);
+    h = hashTag(h, ifdArray, IFD_0TH, TAG_Model, NULL);
+    h = hashTag(h, ifdArray, IFD_GPS, TAG_GPSLatitude, NULL);
+    h = hashTag(h, ifdArray, IFD_GPS, TAG_GPSLongitude, NULL);
+    h = hashTag(h, ifdArray, IFD_EXIF, TAG_PixelXDimension, NULL);
+    h = hashTag(h, ifdArray, IFD_EXIF, TAG_PixelYDimension, NULL);
+
+    if (!dated) return 0;
+    return h == 0 ? 1 : h; // zero is reserved for no fingerprint
+}
+
+/* Function: isSidecar
+ * -------------------
+ * Checks whether a file name ends
+ * in .xmp, in any letter case.
+ */
+
+static bool isSidecar(const char* name) {
+    size_t len = strlen(name);
+    return len > 4 && strcasecmp(name + len - 4, ".xmp") == 0;
+}
+
+static uint64_t hashName(const char* name, size_t len) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char) name[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+/* Function: findSidecar
+ * ---------------------
+ * Looks up the sidecar whose name without
+ * .xmp equals the first len characters of
+ * name in a table built by matchSidecars.
+ */
+
+static const char* findSidecar(char** table, size_t mask,
+    const char* name, size_t len) {
+    for (size_t slot = hashName(name, len) & mask; table[slot] != NULL;
+        slot = (slot + 1) & mask)
+        if (strlen(table[slot]) == len + 4 && strncmp(table[slot], name, len) == 0)
+            return table[slot];
+    return NULL;
+}
+
+/* Function: matchSidecars
+ * -----------------------
+ * Moves the XMP sidecars of a FileList out
+ * of its names and pairs each remaining file
+ * with its sidecar, found either as the full
+ * name plus .xmp (IMG_1234.CR2.xmp) or as
+ * the name without its extension plus .xmp
+ * (IMG_1234.xmp). Names are matched through
+ * a hash table, without touching the disk.
+ * Returns false if out of memory.
+ */
+
+static bool matchSidecars(FileList* files) {
+    size_t count = 0;
+    for (size_t i = 0; i < files -> count; i++)
+        if (isSidecar(files -> names[i])) count++;
+
+    files -> sidecars = calloc(files -> count + 1, sizeof(char*));
+    files -> sidecarNames = malloc((count + 1) * sizeof(char*));
+    if (files -> sidecars == NULL || files -> sidecarNames == NULL)
+        return false;
+    if (count == 0) return true;
+
+    //table of sidecars keyed by name without .xmp
+    size_t capacity = 16;
+    while (capacity < count * 2) capacity *= 2;
+    char** table = calloc(capacity, sizeof(char*));
+    if (table == NULL) return false;
+
+    size_t kept = 0;
+    for (size_t i = 0; i < files -> count; i++) {
+        char* name = files -> names[i];
+        if (!isSidecar(name)) {
+            files -> names[kept++] = name;
+            continue;
+        }
+
+        size_t slot = hashName(name, strlen(name) - 4) & (capacity - 1);
+        while (table[slot] != NULL) slot = (slot + 1) & (capacity - 1);
+        table[slot] = name;
+        files -> sidecarNames[files -> sidecarCount++] = name;
+    }
+
+    files -> count = kept;
+    for (size_t i = 0; i < kept; i++) {
+        const char* name = files -> names[i];
+        const char* dot = strrchr(name, '.');
+        const char* sidecar = findSidecar(table, capacity - 1, name, strlen(name));
+        if (sidecar == NULL && dot != NULL)
+            sidecar = findSidecar(table, capacity - 1, name, dot - name);
+        files -> sidecars[i] = sidecar;
+    }
+
+    free(table);
+    return true;
+}
+
+/* Function: listDir
+ * -----------------
+ * Reads the names of all regular files in
+ * a directory into files. Returns BOUND_OK
+ * or an error, in which case files still
+ * needs to be freed.
+ */
+
+static int listDir(const char* srcPath, FileList* files) {
+    *files = (FileList) {NULL, NULL, 0, NULL, 0};
+    size_t capacity = 0;
+    void* src = ioOpenDir(srcPath);
+    if (src == NULL) return BOUND_ERR_SOURCE;
+
+    //iterate through all entries in a dir
+    const char* entName;
+    bool regular;
+    while ((entName = ioReadDir(src, &regular)) != NULL) {
+        if (!regular)
+            continue; // not a regular file
+
+        if (files -> count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            char** names = realloc(files -> names, capacity * sizeof(char*));
+            if (names == NULL) break;
+            files -> names = names;
+        }
+
+        files -> names[files -> count] = strdup(entName);
+        if (files -> names[files -> count] == NULL) break;
+        files -> count += 1;
+    }
+
+    //avoid mem leak
+    ioCloseDir(src);
+    if (entName != NULL) return BOUND_ERR_MEMORY; // stopped early
+    return matchSidecars(files) ? BOUND_OK : BOUND_ERR_MEMORY;
+}
+
+static void freeFileList(FileList* files) {
+    for (size_t i = 0; i < files -> count; i++)
+        free(files -> names[i]);
+    for (size_t i = 0; i < files -> sidecarCount; i++)
+        free(files -> sidecarNames[i]);
+    free(files -> names);
+    free(files -> sidecars);
+    free(files -> sidecarNames);
+}
+
+
+/* Type: FileFacts
+ * ---------------
+ * What reading one file found out: its
+ * position, whether that lies within the
+ * bounds, and for matches what the sinks
+ * need, so that no parsed data has to be
+ * kept to act on the file.
+ */
+
+typedef struct {
+    EXIFCoord coord;
+    bool match;
+    uint64_t fingerprint;
+    unsigned int thumbOffset, thumbLength;
+} FileFacts;
+
+/* Function: readFile
+ * ------------------
+ * Parses one file and gathers its facts,
+ * passing its tags on first if asked to.
+ */
+
+static FileFacts readFile(ScanJob* job, int worker, const char* path,
+    const char* sidecar) {
+    const BoundConfig* config = job -> config;
+    FileFacts facts = {{0, 0, true, false}, false, 0, 0, 0};
+    int result; unsigned char* xmp; unsigned int xmpLength;
+    void** ifdArray = createIfdTableArrayAndXmp(path, &result, &xmp, &xmpLength);
+    if (config -> onTags != NULL && !config -> onTags(job -> ctx, worker, path, ifdArray))
+        __atomic_store_n(&job -> stopped, 1, __ATOMIC_RELAXED);
+    facts.coord = getFileCoord(path, sidecar, ifdArray, result,
+        (const char*) xmp, xmpLength);
+    free(xmp);
+
+    facts.match = coordInBounds(facts.coord, config -> latTL, config -> lonTL,
+        config -> latBR, config -> lonBR);
+    if (facts.match && job -> dedupe != NULL)
+        facts.fingerprint = getIfdFingerprint(ifdArray);
+    if (facts.match && config -> thumbsPath != NULL &&
+        getThumbnailRangeOnIfdTableArray(ifdArray, &facts.thumbOffset,
+            &facts.thumbLength) != 0)
+        facts.thumbLength = 0;
+
+    if (ifdArray != NULL) freeIfdTableArray(ifdArray);
+    return facts;
+}
+
+/* Function: claimSlot
+ * -------------------
+ * Waits for a slot to read one file in. An
+ * interactive scan may take any free slot;
+ * a bulk scan may not take the reserved
+ * ones and waits as long as an interactive
+ * scan is waiting, so it yields at the next
+ * file boundary. Does nothing without slots.
+ */
+
+static void claimSlot(bool interactive) {
+    pthread_mutex_lock(&scheduler.lock);
+    if (scheduler.slots > 0) {
+        if (interactive) scheduler.waiting += 1;
+        while (scheduler.busy[0] + scheduler.busy[1] >= scheduler.slots ||
+            (!interactive && (scheduler.waiting > 0 ||
+            scheduler.busy[0] >= scheduler.slots - scheduler.reserved)))
+            pthread_cond_wait(&scheduler.freed, &scheduler.lock);
+        if (interactive) scheduler.waiting -= 1;
+    }
+    scheduler.busy[interactive] += 1; // counted even without slots
+    pthread_mutex_unlock(&scheduler.lock);
+}
+
+static void releaseSlot(bool interactive) {
+    pthread_mutex_lock(&scheduler.lock);
+    scheduler.busy[interactive] -= 1;
+    pthread_cond_broadcast(&scheduler.freed);
+    pthread_mutex_unlock(&scheduler.lock);
+}
+
+/* Function: handleMatch
+ * ---------------------
+ * Hands a file found within the bounds to
+ * the sinks and reports it, first releasing
+ * the slot of the given class unless it is
+ * NO_SLOT, so that a slow callback never
+ * keeps other scans from reading.
+ */
+
+static void handleMatch(ScanJob* job, int worker, const char* path,
+    const char* name, const FileFacts* facts, int slot) {
+    const BoundConfig* config = job -> config;
+    BoundResult match = {path, name, facts -> coord.lat, facts -> coord.lon,
+        false, false, false, false};
+
+    if (facts -> fingerprint != 0 &&
+        !dedupeClaim(job -> dedupe, facts -> fingerprint, path))
+        match.duplicate = true; // an earlier copy of this photo was kept
+    else {
+        if (config -> destPath != NULL) {
+            //compute the image destination name from the config
+            char destName[strlen(config -> destPath) + strlen(name) + 2];
+            strcpy(destName, config -> destPath); strcat(destName, "/");
+            strcat(destName, name);
+
+            match.copied = copyFile(path, destName);
+            match.copyFailed = !match.copied;
+        }
+
+        if (config -> thumbsPath != NULL)
+            match.thumbnail = writeThumbnail(path, facts -> thumbOffset,
+                facts -> thumbLength, config -> thumbsPath, name);
+    }
+
+    if (slot != NO_SLOT) releaseSlot(slot);
+    if (!job -> onResult(job -> ctx, worker, &match))
+        __atomic_store_n(&job -> stopped, 1, __ATOMIC_RELAXED);
+}
+
+/* Function: scanFile
+ * ------------------
+ * Reads file i of a scan on the given
+ * worker into facts, unless the caller
+ * skips it or the no-GPS cache knows it
+ * has no position and its tags are not
+ * asked for.
+ * Sets key to the cache key of the file, or
+ * to zero if it has none. Returns false if
+ * the file was skipped.
+ */
+
+static bool scanFile(ScanJob* job, int worker, size_t i, uint64_t* key,
+    FileFacts* facts) {
+    const char* srcPath = job -> config -> srcPath;
+
+    //compute the image filename from the name and source path
+    const char* name = job -> files.names[i];
+    char fileName[strlen(srcPath) + strlen(name) + 2];
+    strcpy(fileName, srcPath); strcat(fileName, "/");
+    strcat(fileName, name);
+
+    //and likewise for its sidecar, if any
+    const char* sidecarName = job -> files.sidecars[i];
+    size_t sidecarLen = sidecarName ? strlen(sidecarName) : 0;
+    char sidecar[strlen(srcPath) + sidecarLen + 2];
+    if (sidecarName != NULL) {
+        strcpy(sidecar, srcPath); strcat(sidecar, "/");
+        strcat(sidecar, sidecarName);
+    }
+
+    //skip files the caller leaves out, then those remembered
+    //to have no position; a sidecar may gain one without the
+    //file changing, so those are always read, and so is every
+    //file when its tags are wanted whether it has a position
+    //or not. A known file is looked up even if the caller
+    //skips it, so that the cache keeps it when saved
+    const BoundConfig* config = job -> config;
+    struct stat fileStat;
+    bool statted = sidecarName == NULL &&
+        (job -> noGps != NULL || config -> skip != NULL) &&
+        ioStat(fileName, &fileStat) == 0;
+    bool known = false;
+    *key = 0;
+    if (job -> noGps != NULL && statted) {
+        *key = noGpsKey(&fileStat);
+        known = noGpsContains(job -> noGps, *key);
+    }
+    if (config -> skip != NULL &&
+        config -> skip(job -> ctx, worker, fileName, statted ? &fileStat : NULL))
+        return false;
+    if (known && config -> onTags == NULL) return false;
+
+    *facts = readFile(job, worker, fileName, sidecarName ? sidecar : NULL);
+    return true;
+}
+
+/* Function: handleFile
+ * --------------------
+ * Acts on the facts of file i: hands it to
+ * the sinks if it matched, and remembers it
+ * in the cache if it has no position. The
+ * slot, if not NO_SLOT, is released before
+ * any callback.
+ */
+
+static void handleFile(ScanJob* job, int worker, size_t i,
+    uint64_t key, const FileFacts* facts, int slot) {
+    const char* srcPath = job -> config -> srcPath;
+    const char* name = job -> files.names[i];
+
+    if (facts -> match) {
+        char fileName[strlen(srcPath) + strlen(name) + 2];
+        strcpy(fileName, srcPath); strcat(fileName, "/");
+        strcat(fileName, name);
+        handleMatch(job, worker, fileName, name, facts, slot);
+    } else if (slot != NO_SLOT) releaseSlot(slot);
+
+    if (key != 0 && facts -> coord.error && !facts -> coord.unreadable)
+        noGpsAdd(job -> noGps, key);
+}
+
+/* Function: scanWorker
+ * --------------------
+ * Thread body of a scan. Claims the next
+ * unvisited file until none remain, so
+ * slow files do not hold up other workers.
+ * Each file is read and copied holding a
+ * slot, which is released before the
+ * result is reported.
+ */
+
+static void* scanWorker(void* arg) {
+    ScanWorker* worker = arg;
+    ScanJob* job = worker -> job;
+    bool interactive = job -> interactive;
+
+    while (!__atomic_load_n(&job -> stopped, __ATOMIC_RELAXED)) {
+        claimSlot(interactive);
+        size_t i = __sync_fetch_and_add(&job -> next, 1);
+        uint64_t key;
+        FileFacts facts;
+        if (i < job -> files.count && scanFile(job, worker -> id, i, &key, &facts))
+            handleFile(job, worker -> id, i, key, &facts, interactive);
+        else releaseSlot(interactive);
+        if (i >= job -> files.count) break;
+    }
+
+    return NULL;
+}
+
+/* Function: runThreads
+ * --------------------
+ * Runs a scan over the configured number
+ * of threads, the calling thread among
+ * them. Returns BOUND_OK.
+ */
+
+static int runThreads(ScanJob* job) {
+    ScanWorker workers[BOUND_MAX_THREADS];
+    pthread_t threads[BOUND_MAX_THREADS];
+    int started = 0;
+
+    for (int i = 0; i < job -> config -> threads; i++) {
+        workers[i].job = job;
+        workers[i].id = i;
+
+        //the calling thread acts as the first worker
+        if (i == 0) continue;
+        if (pthread_create(&threads[i], NULL, scanWorker, &workers[i]) != 0)
+            break; // carry on with the workers we have
+        started = i;
+    }
+
+    scanWorker(&workers[0]);
+    for (int i = 1; i <= started; i++)
+        pthread_join(threads[i], NULL);
+    return BOUND_OK;
+}
+
+/* Section: process shards
+ * -----------------------
+ * With procs set, files are read by child
+ * processes instead of threads, so that an
+ * input that crashes the parser only takes
+ * down one child. Child k reads the files
+ * whose name hashes to k modulo procs and
+ * passes its facts back through a ring in
+ * shared memory that only it writes to and
+ * only the parent reads from, which needs
+ * no lock. The parent acts on all results,
+ * so copies, duplicates and the cache are
+ * decided in one place. A child that dies
+ * is started again after the file it was
+ * reading, which is left out of the scan.
+ */
+
+typedef struct {
+    uint32_t index;
+    bool read;   // false if skipped by the cache
+    uint64_t key;
+    FileFacts facts;
+} RingEntry;
+
+typedef struct {
+    uint64_t head;    // entries written, by the child
+    uint64_t tail;    // entries taken, by the parent
+    uint64_t current; // file being read plus one, or zero
+    RingEntry entries[RING_SIZE];
+} Ring;
+
+static void ringWait(void) {
+    struct timespec wait = {0, RING_WAIT};
+    nanosleep(&wait, NULL);
+}
+
+static bool inShard(const char* name, int shard, int procs) {
+    return hashName(name, strlen(name)) % (uint64_t) procs == (uint64_t) shard;
+}
+
+/* Function: shardMain
+ * -------------------
+ * Body of child shard, reading its files
+ * from index first on. Never returns.
+ */
+
+static void shardMain(ScanJob* job, Ring* ring, int shard, size_t first) {
+    int procs = job -> config -> procs;
+
+    for (size_t i = first; i < job -> files.count; i++) {
+        if (!inShard(job -> files.names[i], shard, procs)) continue;
+        __atomic_store_n(&ring -> current, i + 1, __ATOMIC_RELEASE);
+
+        RingEntry entry = {(uint32_t) i, false, 0, {{0, 0, true, false}, false, 0, 0, 0}};
+        entry.read = scanFile(job, 0, i, &entry.key, &entry.facts);
+
+        //wait for room, then publish the entry
+        uint64_t head = ring -> head;
+        while (head - __atomic_load_n(&ring -> tail, __ATOMIC_ACQUIRE) >= RING_SIZE)
+            ringWait();
+        ring -> entries[head % RING_SIZE] = entry;
+        __atomic_store_n(&ring -> head, head + 1, __ATOMIC_RELEASE);
+    }
+
+    __atomic_store_n(&ring -> current, 0, __ATOMIC_RELEASE);
+    _exit(0);
+}
+
+static pid_t startShard(ScanJob* job, Ring* ring, int shard, size_t first) {
+    pid_t pid = fork();
+    if (pid == 0) shardMain(job, ring, shard, first);
+    return pid;
+}
+
+/* Function: drainRing
+ * -------------------
+ * Acts on every entry waiting in ring.
+ * Returns whether there were any.
+ */
+
+static bool drainRing(ScanJob* job, Ring* ring) {
+    uint64_t head = __atomic_load_n(&ring -> head, __ATOMIC_ACQUIRE);
+    uint64_t tail = ring -> tail;
+    if (tail == head) return false;
+
+    for (; tail < head; tail++) {
+        const RingEntry* entry = &ring -> entries[tail % RING_SIZE];
+        if (__atomic_load_n(&job -> stopped, __ATOMIC_RELAXED)) continue;
+        if (entry -> read)
+            handleFile(job, 0, entry -> index, entry -> key, &entry -> facts, NO_SLOT);
+        else noGpsContains(job -> noGps, entry -> key); // keep it cached
+    }
+
+    __atomic_store_n(&ring -> tail, tail, __ATOMIC_RELEASE);
+    return true;
+}
+
+/* Function: runShards
+ * -------------------
+ * Runs a scan over procs child processes
+ * and acts on their results as they come.
+ * Returns BOUND_OK or an error.
+ */
+
+static int runShards(ScanJob* job) {
+    int procs = job -> config -> procs;
+    Ring* rings = mmap(NULL, procs * sizeof(Ring), PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    pid_t pids[BOUND_MAX_PROCS];
+    if (rings == MAP_FAILED) return BOUND_ERR_MEMORY;
+
+    //output buffered before the fork must not be written twice
+    fflush(NULL);
+    int running = 0;
+    for (int k = 0; k < procs; k++) {
+        memset(&rings[k], 0, offsetof(Ring, entries));
+        pids[k] = startShard(job, &rings[k], k, 0);
+        if (pids[k] > 0) running++;
+    }
+
+    int status = running == procs ? BOUND_OK : BOUND_ERR_PROCESS;
+    while (running > 0) {
+        bool progress = false;
+        for (int k = 0; k < procs; k++) {
+            int exitStatus;
+            bool exited = pids[k] > 0 && waitpid(pids[k], &exitStatus, WNOHANG) == pids[k];
+            progress |= drainRing(job, &rings[k]);
+            if (!exited) continue;
+
+            //a child that died mid-file skips it when restarted
+            uint64_t current = __atomic_load_n(&rings[k].current, __ATOMIC_ACQUIRE);
+            bool crashed = !WIFEXITED(exitStatus) || WEXITSTATUS(exitStatus) != 0;
+            pids[k] = -1;
+            running--;
+            if (crashed && current != 0 && !__atomic_load_n(&job -> stopped, __ATOMIC_RELAXED)) {
+                rings[k].current = 0;
+                fflush(NULL);
+                pids[k] = startShard(job, &rings[k], k, current);
+                if (pids[k] > 0) running++;
+                else status = BOUND_ERR_PROCESS;
+            }
+            progress = true;
+        }
+
+        //stopping early ends the children at once
+        if (__atomic_load_n(&job -> stopped, __ATOMIC_RELAXED))
+            for (int k = 0; k < procs; k++)
+                if (pids[k] > 0) kill(pids[k], SIGKILL);
+        if (!progress) ringWait();
+    }
+
+    munmap(rings, procs * sizeof(Ring));
+    return status;
+}
+
+/* Function: initScanning
+ * ----------------------
+ * Sets up the EXIF parser for scanning once
+ * per process: thumbnails are read by offset
+ * when needed, and input goes through io.h.
+ */
+
+static void initScanning(void) {
+    setLoadThumbnail(0);
+    setFileOpener(ioFopen);
+}
+
+void boundConfigInit(BoundConfig* config, const char* srcPath) {
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    *config = (BoundConfig) {0};
+    config -> srcPath = srcPath;
+    config -> latTL = 90; config -> lonTL = -180;
+    config -> latBR = -90; config -> lonBR = 180;
+    config -> threads = online < 1 ? 1
+        : (online > BOUND_MAX_THREADS ? BOUND_MAX_THREADS : (int) online);
+}
+
+int boundScan(const BoundConfig* config, BoundCallback onResult, void* ctx) {
+    if (config -> srcPath == NULL || onResult == NULL ||
+        config -> threads < 1 || config -> threads > BOUND_MAX_THREADS ||
+        config -> procs < 0 || config -> procs > BOUND_MAX_PROCS ||
+        (config -> procs > 0 && (config -> onTags != NULL || config -> skip != NULL)))
+        return BOUND_ERR_CONFIG;
+    pthread_once(&initOnce, initScanning);
+
+    ScanJob job = {config, {NULL, NULL, 0, NULL, 0}, 0, 0, false,
+        onResult, ctx, NULL, NULL};
+    int status = listDir(config -> srcPath, &job.files);
+    job.interactive = config -> priority == BOUND_INTERACTIVE ||
+        (config -> priority == BOUND_AUTO && job.files.count <= BOUND_INTERACTIVE_FILES);
+    if (status == BOUND_OK && config -> dedupe &&
+        (job.dedupe = dedupeCreate(config -> verify)) == NULL)
+        status = BOUND_ERR_MEMORY;
+    bool ownCache = config -> noGps == NULL && config -> cachePath != NULL;
+    job.noGps = config -> noGps;
+    if (status == BOUND_OK && ownCache &&
+        (job.noGps = noGpsLoad(config -> cachePath)) == NULL)
+        status = BOUND_ERR_MEMORY;
+
+    if (status == BOUND_OK)
+        status = config -> procs > 0 ? runShards(&job) : runThreads(&job);
+    if (status == BOUND_OK && ownCache && !noGpsSave(job.noGps))
+        status = BOUND_ERR_CACHE;
+
+    freeFileList(&job.files);
+    dedupeFree(job.dedupe);
+    if (ownCache) noGpsFree(job.noGps);
+    return status;
+}
+
+void boundSetSlots(int slots, int reserved) {
+    pthread_mutex_lock(&scheduler.lock);
+    scheduler.slots = slots > 0 ? slots : 0;
+    scheduler.reserved = reserved < 0 ? 0 : reserved;
+    if (scheduler.slots > 1 && scheduler.reserved >= scheduler.slots)
+        scheduler.reserved = scheduler.slots - 1; // leave bulk scans one slot
+    if (scheduler.slots == 1) scheduler.reserved = 0;
+    pthread_cond_broadcast(&scheduler.freed);
+    pthread_mutex_unlock(&scheduler.lock);
+}
+
+const char* boundStrError(int status) {
+    switch (status) {
+        case BOUND_OK: return "success";
+        case BOUND_ERR_CONFIG: return "invalid scan configuration";
+        case BOUND_ERR_SOURCE: return "could not open source directory";
+        case BOUND_ERR_MEMORY: return "out of memory";
+        case BOUND_ERR_CACHE: return "could not write no-GPS cache";
+        case BOUND_ERR_PROCESS: return "could not start worker process";
+        default: return "unknown error";
+    }
+}
@@ -0,0 +1,203 @@
+/* File: scan.h
+ * ------------
+ * The scanning engine behind the bound command,
+ * built as libbound for programs that would
+ * otherwise run bound and parse its output.
+ * A scan reads the GPS position of every file
+ * in a folder on a pool of worker threads and
+ * reports each file inside a bounding rectangle
+ * to a callback as soon as it is found, after
+ * handing it to the configured sinks: a copy
+ * in a destination folder and its embedded
+ * thumbnail in a thumbnail folder.
+ *
+ * Files are read through the backend set with
+ * ioSetBackend, which is shared by all scans.
+ * Setting procs reads them in that many child
+ * processes instead of threads, which keeps
+ * the caller alive if a file crashes the
+ * parser; such files are left out. Forking
+ * is only safe while the caller runs no
+ * other threads.
+ */
+
+#ifndef _SCAN_H_
+#define _SCAN_H_
+
+#include <stdbool.h>
+#include <sys/stat.h>
+#include "nogps.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define BOUND_MAX_THREADS 256
+#define BOUND_MAX_PROCS 256
+#define BOUND_INTERACTIVE_FILES 1000
+
+/* Constants: scan priority
+ * ------------------------
+ * Interactive scans are small requests that
+ * someone waits on; bulk scans are rescans of
+ * large folders. An automatic scan counts as
+ * interactive if its folder holds at most
+ * BOUND_INTERACTIVE_FILES files.
+ */
+
+enum {
+    BOUND_AUTO = 0,
+    BOUND_INTERACTIVE,
+    BOUND_BULK
+};
+
+/* Constants: scan status
+ * ----------------------
+ * Returned by boundScan. A cache error is
+ * reported after the scan has run in full.
+ */
+
+enum {
+    BOUND_OK = 0,
+    BOUND_ERR_CONFIG = -1,
+    BOUND_ERR_SOURCE = -2,
+    BOUND_ERR_MEMORY = -3,
+    BOUND_ERR_CACHE = -4,
+    BOUND_ERR_PROCESS = -5
+};
+
+/* Type: BoundTagsCallback
+ * -----------------------
+ * Called for every file parsed, match or not,
+ * with its path and its IFD tables as made by
+ * createIfdTableArray in exif.h, or NULL if it
+ * has none. Both are only valid during the
+ * call. Calls come from worker threads as for
+ * BoundCallback. Returns false to end the scan
+ * early.
+ */
+
+typedef bool (*BoundTagsCallback)(void* ctx, int worker, const char* path,
+    void** ifdArray);
+
+/* Type: BoundSkipCallback
+ * -------------------------
+ * Called for every file before it is read,
+ * with its path and the result of stat on
+ * it, or NULL if it has a sidecar or could
+ * not be stat'ed. Returns true to leave the
+ * file out; it is then neither read nor
+ * reported. Calls come from worker threads
+ * as for BoundCallback, and always from
+ * the worker that goes on to read the file.
+ */
+
+typedef bool (*BoundSkipCallback)(void* ctx, int worker, const char* path,
+    const struct stat* fileStat);
+
+/* Type: BoundConfig
+ * -----------------
+ * What to scan and what to do with matches.
+ * Filter: files are matched if their position
+ * lies in the rectangle between the top left
+ * and bottom right corners, bounds included.
+ * Sinks: each path may be NULL to skip it.
+ * Start from boundConfigInit so that fields
+ * added later get their defaults.
+ */
+
+typedef struct {
+    const char* srcPath;
+    double latTL, lonTL, latBR, lonBR;
+    int threads;
+    const char* destPath;   // copy matches here
+    const char* thumbsPath; // write thumbnails here
+    bool dedupe;            // skip metadata duplicates
+    bool verify;            // confirm them by content
+    const char* cachePath;  // no-GPS cache, see nogps.h
+    NoGpsCache* noGps;      // or one already loaded, which
+                            // the caller saves and frees
+    int priority;           // class for boundSetSlots
+    int procs;              // child processes, if set
+    BoundTagsCallback onTags; // every file's tags, if set;
+                              // not with procs
+    BoundSkipCallback skip;   // files to leave out, if set;
+                              // not with procs
+} BoundConfig;
+
+/* Type: BoundResult
+ * -----------------
+ * One matching file. The strings are only
+ * valid during the callback. A duplicate is
+ * not handed to any sink.
+ */
+
+typedef struct {
+    const char* path;
+    const char* name;
+    double lat, lon;
+    bool duplicate;
+    bool copied;
+    bool copyFailed;
+    bool thumbnail;
+} BoundResult;
+
+/* Type: BoundCallback
+ * -------------------
+ * Called for every match from the worker
+ * thread that found it, numbered from zero
+ * to threads - 1, so calls may overlap but
+ * never on the same worker. With procs set,
+ * all calls come from the calling thread
+ * as worker zero. Returns false
+ * to end the scan early; files already
+ * being read are still reported.
+ */
+
+typedef bool (*BoundCallback)(void* ctx, int worker, const BoundResult* result);
+
+/* Function: boundConfigInit
+ * -------------------------
+ * Fills config with the defaults: the whole
+ * world as the rectangle, one thread per
+ * online processor, no sinks and automatic
+ * priority.
+ */
+
+void boundConfigInit(BoundConfig* config, const char* srcPath);
+
+/* Function: boundScan
+ * -------------------
+ * Scans config -> srcPath and calls onResult
+ * with ctx for each match. Returns once every
+ * file has been read, with BOUND_OK or one of
+ * the errors above. Scans may run in parallel.
+ */
+
+int boundScan(const BoundConfig* config, BoundCallback onResult, void* ctx);
+
+/* Function: boundSetSlots
+ * ------------------------
+ * Lets at most slots files be read at once
+ * across all scans of the process, whatever
+ * their thread counts, and keeps reserved of
+ * those slots for interactive scans. Bulk
+ * scans also hand their slots to waiting
+ * interactive scans after each file. Zero
+ * slots, the default, lifts the limit.
+ */
+
+void boundSetSlots(int slots, int reserved);
+
+/* Function: boundStrError
+ * -----------------------
+ * Describes a status returned by boundScan.
+ */
+
+const char* boundStrError(int status);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,606 @@
+/* File: segments.c
+ * ----------------
+ * Implements the segment sets declared in
+ * segments.h. Segments are reference counted
+ * so that queries and the compactor work on
+ * them without holding the lock; a segment
+ * merged away is only deleted once the last
+ * query reading it is done.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include "segments.h"
+#include "index.h"
+
+#define FANOUT 4
+#define TIER_BASE 1024
+
+/* Type: Segment
+ * -------------
+ * One index file and the folders whose
+ * older records it hides, sorted.
+ */
+
+typedef struct {
+    unsigned long id;
+    char* path;
+    uint64_t count;
+    char** folders;
+    size_t folderCount;
+    int refs;     // one for the set, one per reader
+    bool retired; // merged away, so delete when unused
+} Segment;
+
+struct SegmentSet {
+    char* dir;
+    bool writable;
+    int lockFd;   // LOCK, held exclusively by the writer
+    int readerFd; // READERS, held shared by every reader
+    pthread_mutex_t lock; // guards everything below
+    pthread_cond_t wake;
+    Segment** segments; // oldest first
+    size_t count;
+    unsigned long nextId;
+    bool stalled; // a compaction failed since the last add
+    bool closing;
+    pthread_t compactor;
+};
+
+static int compareFolders(const void* a, const void* b) {
+    return strcmp(*(char* const*) a, *(char* const*) b);
+}
+
+static char* joinPath(const char* dir, const char* name) {
+    char* path = malloc(strlen(dir) + strlen(name) + 2);
+    if (path != NULL) sprintf(path, "%s/%s", dir, name);
+    return path;
+}
+
+static char* segmentPath(const SegmentSet* set, unsigned long id) {
+    char name[32];
+    sprintf(name, "seg-%lu.bidx", id);
+    return joinPath(set -> dir, name);
+}
+
+/* Function: newSegment
+ * --------------------
+ * Creates the segment for the index file
+ * at path, taking over path and folders,
+ * which are freed if that fails.
+ */
+
+static Segment* newSegment(unsigned long id, char* path, char** folders,
+    size_t folderCount) {
+    Segment* segment = calloc(1, sizeof(Segment));
+    IndexReader* reader = segment != NULL && path != NULL ? indexOpen(path) : NULL;
+    if (reader == NULL) {
+        for (size_t i = 0; i < folderCount; i++) free(folders[i]);
+        free(folders);
+        free(path);
+        free(segment);
+        return NULL;
+    }
+
+    segment -> id = id;
+    segment -> path = path;
+    segment -> count = indexCount(reader);
+    segment -> folders = folders;
+    segment -> folderCount = folderCount;
+    segment -> refs = 1;
+    qsort(folders, folderCount, sizeof(char*), compareFolders);
+    indexClose(reader);
+    return segment;
+}
+
+/* Function: unreadRemove
+ * ----------------------
+ * Deletes the file at path unless another
+ * process has the set open for reading and
+ * may still go to it, in which case it is
+ * left for removeStrays.
+ */
+
+static void unreadRemove(const SegmentSet* set, const char* path) {
+    if (flock(set -> readerFd, LOCK_EX | LOCK_NB) != 0) return;
+    remove(path);
+    flock(set -> readerFd, LOCK_UN);
+}
+
+/* Function: dropSegment
+ * ---------------------
+ * Drops one reference to segment, deleting
+ * its file too if it was merged away. Must
+ * be called with the lock held.
+ */
+
+static void dropSegment(const SegmentSet* set, Segment* segment) {
+    if (--segment -> refs > 0) return;
+    if (segment -> retired) unreadRemove(set, segment -> path);
+    for (size_t i = 0; i < segment -> folderCount; i++)
+        free(segment -> folders[i]);
+    free(segment -> folders);
+    free(segment -> path);
+    free(segment);
+}
+
+/* Function: hides
+ * ---------------
+ * Returns whether a tombstone of segment
+ * covers the folder the file at path is
+ * directly inside.
+ */
+
+static bool hides(const Segment* segment, const char* path) {
+    const char* slash = strrchr(path, '/');
+    if (slash == NULL || segment -> folderCount == 0) return false;
+    size_t len = (size_t) (slash - path);
+
+    size_t lo = 0, hi = segment -> folderCount;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        const char* folder = segment -> folders[mid];
+        int order = strncmp(folder, path, len);
+        if (order == 0 && folder[len] == '\0') return true;
+        if (order < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return false;
+}
+
+/* Function: writeManifest
+ * -----------------------
+ * Replaces the manifest with one listing
+ * the count segments given. Must be called
+ * with the lock held.
+ */
+
+static bool writeManifest(SegmentSet* set, Segment** segments, size_t count) {
+    char* temp = joinPath(set -> dir, "MANIFEST.new");
+    char* path = joinPath(set -> dir, "MANIFEST");
+    FILE* file = temp != NULL && path != NULL ? fopen(temp, "w") : NULL;
+    bool ok = file != NULL && fprintf(file, "next %lu\n", set -> nextId) > 0;
+
+    for (size_t i = 0; ok && i < count; i++) {
+        ok = fprintf(file, "segment %lu\n", segments[i] -> id) > 0;
+        for (size_t j = 0; ok && j < segments[i] -> folderCount; j++)
+            ok = fprintf(file, "dead %s\n", segments[i] -> folders[j]) > 0;
+    }
+
+    //the rename makes the new list take effect all at once
+    if (file != NULL && (fflush(file) != 0 || fsync(fileno(file)) != 0)) ok = false;
+    if (file != NULL && fclose(file) != 0) ok = false;
+    if (ok) ok = rename(temp, path) == 0;
+    else if (temp != NULL) remove(temp);
+
+    free(temp);
+    free(path);
+    return ok;
+}
+
+/* Section: compaction
+ * -------------------
+ * Segments fall into size tiers a factor
+ * of FANOUT apart. The newest FANOUT
+ * neighbors sharing a tier are merged, and
+ * records hidden by a tombstone of a newer
+ * segment among them are dropped on the
+ * way. Tombstones stay with the merged
+ * segment unless it has become the oldest,
+ * since they may hide records further back.
+ */
+
+static int tier(uint64_t count) {
+    int tier = 0;
+    for (uint64_t rest = count / TIER_BASE; rest > 0; rest /= FANOUT) tier++;
+    return tier;
+}
+
+static bool findWindow(const SegmentSet* set, size_t* first) {
+    for (size_t end = set -> count; end >= FANOUT; end--) {
+        size_t start = end - FANOUT;
+        int level = tier(set -> segments[start] -> count);
+        bool same = true;
+        for (size_t i = start + 1; i < end && same; i++)
+            same = tier(set -> segments[i] -> count) == level;
+        if (same) {
+            *first = start;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool keepRecord(void* ctx, size_t source, const IndexRecord* record) {
+    Segment** window = ctx;
+    for (size_t newer = source + 1; newer < FANOUT; newer++)
+        if (hides(window[newer], record -> path)) return false;
+    return true;
+}
+
+/* Function: unionFolders
+ * ----------------------
+ * Collects the tombstones of a window of
+ * segments without repeats. Returns false
+ * if out of memory.
+ */
+
+static bool unionFolders(Segment** window, char*** folders, size_t* count) {
+    size_t total = 0;
+    for (int i = 0; i < FANOUT; i++) total += window[i] -> folderCount;
+    *folders = malloc((total ? total : 1) * sizeof(char*));
+    *count = 0;
+    if (*folders == NULL) return false;
+
+    for (int i = 0; i < FANOUT; i++)
+        for (size_t j = 0; j < window[i] -> folderCount; j++)
+            (*folders)[(*count)++] = window[i] -> folders[j];
+    qsort(*folders, *count, sizeof(char*), compareFolders);
+
+    size_t kept = 0;
+    for (size_t i = 0; i < *count; i++) {
+        if (kept > 0 && strcmp((*folders)[kept - 1], (*folders)[i]) == 0) continue;
+        (*folders)[kept++] = (*folders)[i];
+    }
+    *count = kept;
+
+    for (size_t i = 0; i < kept; i++) {
+        char* copy = strdup((*folders)[i]);
+        for (size_t j = 0; copy == NULL && j < i; j++) free((*folders)[j]);
+        if (copy == NULL) {
+            free(*folders);
+            *folders = NULL;
+            *count = 0;
+            return false;
+        }
+        (*folders)[i] = copy;
+    }
+    return true;
+}
+
+/* Function: compact
+ * -----------------
+ * Merges the window of segments starting
+ * at first. Called and returns with the
+ * lock held, but drops it while merging.
+ */
+
+static bool compact(SegmentSet* set, size_t first) {
+    Segment* window[FANOUT];
+    for (int i = 0; i < FANOUT; i++) {
+        window[i] = set -> segments[first + i];
+        window[i] -> refs += 1;
+    }
+    bool oldest = first == 0;
+    unsigned long id = set -> nextId++;
+    pthread_mutex_unlock(&set -> lock);
+
+    const char* paths[FANOUT];
+    for (int i = 0; i < FANOUT; i++) paths[i] = window[i] -> path;
+    char* path = segmentPath(set, id);
+    char** folders = NULL;
+    size_t folderCount = 0;
+    bool ok = path != NULL && (oldest || unionFolders(window, &folders, &folderCount)) &&
+        indexMerge(paths, FANOUT, path, keepRecord, window);
+
+    Segment* merged = NULL;
+    if (ok) merged = newSegment(id, path, folders, folderCount);
+    else {
+        for (size_t i = 0; i < folderCount; i++) free(folders[i]);
+        free(folders);
+        free(path);
+    }
+
+    pthread_mutex_lock(&set -> lock);
+
+    //only the compactor removes segments, so the window
+    //is still where it was
+    Segment* replaced[set -> count];
+    memcpy(replaced, set -> segments, set -> count * sizeof(Segment*));
+    size_t count = set -> count - FANOUT + 1;
+    if (merged != NULL) {
+        replaced[first] = merged;
+        memmove(replaced + first + 1, replaced + first + FANOUT,
+            (set -> count - first - FANOUT) * sizeof(Segment*));
+    }
+
+    ok = merged != NULL && writeManifest(set, replaced, count);
+    if (ok) {
+        memcpy(set -> segments, replaced, count * sizeof(Segment*));
+        set -> count = count;
+        for (int i = 0; i < FANOUT; i++) {
+            window[i] -> retired = true;
+            dropSegment(set, window[i]);
+        }
+    } else if (merged != NULL) {
+        merged -> retired = true;
+        dropSegment(set, merged);
+    }
+
+    for (int i = 0; i < FANOUT; i++) dropSegment(set, window[i]);
+    return ok;
+}
+
+/* Function: compactor
+ * -------------------
+ * Thread body of the compactions. Merges
+ * windows until none are left, then waits
+ * for a new segment or for the set to be
+ * closed.
+ */
+
+static void* compactor(void* arg) {
+    SegmentSet* set = arg;
+    pthread_mutex_lock(&set -> lock);
+
+    for (;;) {
+        size_t first;
+        if (!set -> stalled && findWindow(set, &first)) {
+            if (!compact(set, first)) set -> stalled = true;
+            continue;
+        }
+
+        if (set -> closing) break;
+        pthread_cond_wait(&set -> wake, &set -> lock);
+    }
+
+    pthread_mutex_unlock(&set -> lock);
+    return NULL;
+}
+
+/* Section: opening
+ * ----------------
+ */
+
+/* Function: readManifest
+ * ----------------------
+ * Loads the segments listed in the manifest
+ * of set, if it has one yet. Returns false
+ * if it cannot be read.
+ */
+
+static bool readManifest(SegmentSet* set) {
+    char* path = joinPath(set -> dir, "MANIFEST");
+    if (path == NULL) return false;
+    FILE* file = fopen(path, "r");
+    free(path);
+    if (file == NULL) return errno == ENOENT;
+
+    char* line = NULL;
+    size_t capacity = 0, allocated = 0;
+    ssize_t len;
+    bool ok = true;
+    unsigned long id = 0;
+    char** folders = NULL;
+    size_t folderCount = 0;
+    bool pending = false;
+
+    //a segment is created once its tombstones are all read
+    while (ok) {
+        len = getline(&line, &capacity, file);
+        if (len > 0 && line[len - 1] == '\n') line[--len] = '\0';
+        unsigned long listed;
+        bool segmentLine = len >= 0 && sscanf(line, "segment %lu", &listed) == 1;
+
+        if (pending && (len < 0 || segmentLine)) {
+            if (set -> count == allocated) {
+                allocated = allocated ? allocated * 2 : 16;
+                Segment** grown = realloc(set -> segments, allocated * sizeof(Segment*));
+                ok = grown != NULL;
+                if (ok) set -> segments = grown;
+            }
+            Segment* segment = ok ? newSegment(id, segmentPath(set, id), folders,
+                folderCount) : NULL;
+            ok = segment != NULL;
+            if (ok) set -> segments[set -> count++] = segment;
+            folders = NULL;
+            folderCount = 0;
+            pending = false;
+        }
+
+        if (len < 0 || !ok) break;
+        if (segmentLine) {
+            id = listed;
+            pending = true;
+        }
+        else if (strncmp(line, "dead ", 5) == 0 && pending) {
+            char** grown = realloc(folders, (folderCount + 1) * sizeof(char*));
+            ok = grown != NULL && (grown[folderCount] = strdup(line + 5)) != NULL;
+            if (grown != NULL) folders = grown;
+            if (ok) folderCount += 1;
+        } else ok = sscanf(line, "next %lu", &set -> nextId) == 1;
+    }
+
+    for (size_t i = 0; i < folderCount; i++) free(folders[i]);
+    free(folders);
+    free(line);
+    fclose(file);
+    return ok && !pending;
+}
+
+/* Function: removeStrays
+ * ----------------------
+ * Deletes segment files the manifest does
+ * not list, left behind by a crash during
+ * a build or right after a merge, or kept
+ * for a reader. Does nothing while a
+ * reader is open.
+ */
+
+static void removeStrays(SegmentSet* set) {
+    if (flock(set -> readerFd, LOCK_EX | LOCK_NB) != 0) return;
+    DIR* dir = opendir(set -> dir);
+    if (dir == NULL) {
+        flock(set -> readerFd, LOCK_UN);
+        return;
+    }
+
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        unsigned long id;
+        if (sscanf(entry -> d_name, "seg-%lu", &id) != 1) continue;
+
+        bool live = false;
+        for (size_t i = 0; i < set -> count && !live; i++)
+            live = set -> segments[i] -> id == id;
+        char* path = live ? NULL : joinPath(set -> dir, entry -> d_name);
+        if (path != NULL) remove(path);
+        free(path);
+    }
+    closedir(dir);
+    flock(set -> readerFd, LOCK_UN);
+}
+
+static int openLock(const SegmentSet* set, const char* name) {
+    char* path = joinPath(set -> dir, name);
+    int fd = path != NULL ? open(path, O_RDWR | O_CREAT, 0644) : -1;
+    free(path);
+    return fd;
+}
+
+SegmentSet* segmentsOpen(const char* dir, bool writable) {
+    if (writable && mkdir(dir, 0755) != 0 && errno != EEXIST) return NULL;
+
+    SegmentSet* set = calloc(1, sizeof(SegmentSet));
+    if (set == NULL) return NULL;
+    set -> writable = writable;
+    set -> lockFd = set -> readerFd = -1;
+    set -> dir = strdup(dir);
+    pthread_mutex_init(&set -> lock, NULL);
+    pthread_cond_init(&set -> wake, NULL);
+
+    //a reader takes its lock before the manifest, so no
+    //segment it lists is deleted until the reader is done
+    bool ok = set -> dir != NULL && (set -> readerFd = openLock(set, "READERS")) >= 0;
+    if (ok && writable) ok = (set -> lockFd = openLock(set, "LOCK")) >= 0 &&
+        flock(set -> lockFd, LOCK_EX | LOCK_NB) == 0;
+    else if (ok) ok = flock(set -> readerFd, LOCK_SH) == 0;
+    if (ok) ok = readManifest(set);
+    if (ok && writable) removeStrays(set);
+    if (ok && writable) ok = pthread_create(&set -> compactor, NULL, compactor, set) == 0;
+
+    if (!ok) {
+        for (size_t i = 0; i < set -> count; i++) dropSegment(set, set -> segments[i]);
+        if (set -> lockFd >= 0) close(set -> lockFd);
+        if (set -> readerFd >= 0) close(set -> readerFd);
+        free(set -> segments);
+        free(set -> dir);
+        free(set);
+        return NULL;
+    }
+    return set;
+}
+
+/* Section: updates and queries
+ * ----------------------------
+ */
+
+char* segmentsReserve(SegmentSet* set) {
+    if (!set -> writable) return NULL;
+    pthread_mutex_lock(&set -> lock);
+    unsigned long id = set -> nextId++;
+    pthread_mutex_unlock(&set -> lock);
+    return segmentPath(set, id);
+}
+
+bool segmentsAdd(SegmentSet* set, const char* path, const char* folder) {
+    const char* name = strrchr(path, '/');
+    unsigned long id;
+    if (!set -> writable || name == NULL || sscanf(name + 1, "seg-%lu", &id) != 1) return false;
+    if (folder != NULL && strchr(folder, '\n') != NULL) return false;
+
+    char** folders = folder != NULL ? malloc(sizeof(char*)) : NULL;
+    if (folder != NULL && (folders == NULL || (folders[0] = strdup(folder)) == NULL)) {
+        free(folders);
+        return false;
+    }
+    char* copy = strdup(path);
+    Segment* segment = copy != NULL ? newSegment(id, copy, folders, folder != NULL)
+        : NULL;
+    if (segment == NULL) return false;
+
+    pthread_mutex_lock(&set -> lock);
+    Segment** grown = realloc(set -> segments, (set -> count + 1) * sizeof(Segment*));
+    if (grown != NULL) set -> segments = grown;
+    bool ok = grown != NULL;
+    if (ok) {
+        set -> segments[set -> count] = segment;
+        ok = writeManifest(set, set -> segments, set -> count + 1);
+    }
+    if (ok) {
+        set -> count += 1;
+        set -> stalled = false;
+        pthread_cond_signal(&set -> wake);
+    } else dropSegment(set, segment);
+    pthread_mutex_unlock(&set -> lock);
+    return ok;
+}
+
+long segmentsQuery(SegmentSet* set, double latTL, double lonTL,
+    double latBR, double lonBR, SegmentVisitor visit, void* ctx) {
+    pthread_mutex_lock(&set -> lock);
+    size_t count = set -> count;
+    Segment** segments = malloc((count ? count : 1) * sizeof(Segment*));
+    for (size_t i = 0; segments != NULL && i < count; i++) {
+        segments[i] = set -> segments[i];
+        segments[i] -> refs += 1;
+    }
+    pthread_mutex_unlock(&set -> lock);
+    if (segments == NULL) return -1;
+
+    long found = 0;
+    bool stopped = false;
+    for (size_t i = 0; i < count && !stopped && found >= 0; i++) {
+        IndexReader* reader = indexOpen(segments[i] -> path);
+        if (reader == NULL) found = -1;
+        else indexSetBox(reader, latTL, lonTL, latBR, lonBR);
+
+        IndexRecord record;
+        while (reader != NULL && !stopped && indexNext(reader, &record)) {
+            bool hidden = false;
+            for (size_t newer = i + 1; newer < count && !hidden; newer++)
+                hidden = hides(segments[newer], record.path);
+            if (hidden) continue;
+
+            found += 1;
+            stopped = !visit(ctx, record.lat, record.lon, record.path);
+        }
+        if (reader != NULL && indexFailed(reader)) found = -1;
+        indexClose(reader);
+    }
+
+    pthread_mutex_lock(&set -> lock);
+    for (size_t i = 0; i < count; i++) dropSegment(set, segments[i]);
+    pthread_mutex_unlock(&set -> lock);
+    free(segments);
+    return found;
+}
+
+void segmentsClose(SegmentSet* set) {
+    if (set == NULL) return;
+    if (set -> writable) {
+        pthread_mutex_lock(&set -> lock);
+        set -> closing = true;
+        pthread_cond_signal(&set -> wake);
+        pthread_mutex_unlock(&set -> lock);
+        pthread_join(set -> compactor, NULL);
+    }
+
+    for (size_t i = 0; i < set -> count; i++) dropSegment(set, set -> segments[i]);
+    if (set -> lockFd >= 0) close(set -> lockFd);
+    close(set -> readerFd);
+    pthread_mutex_destroy(&set -> lock);
+    pthread_cond_destroy(&set -> wake);
+    free(set -> segments);
+    free(set -> dir);
+    free(set);
+}
@@ -0,0 +1,93 @@
+/* File: segments.h
+ * ----------------
+ * Keeps a coordinate index as a set of immutable
+ * index files, called segments, in a directory.
+ * Indexing a folder again writes a new segment
+ * holding its images along with a tombstone for
+ * the folder, which hides whatever older segments
+ * recorded for the images directly inside it, so
+ * an update costs only the folder's own records.
+ * A background thread merges runs of four similar
+ * sized neighboring segments into one, which
+ * keeps the number of segments logarithmic in
+ * the number of records.
+ *
+ * The directory holds seg-N.bidx files and a
+ * MANIFEST listing the live ones oldest first,
+ * one "segment N" line each, followed by one
+ * "dead folder" line per tombstone. Only one
+ * process may write to a directory at a time,
+ * holding LOCK, while any number read it under
+ * a shared lock on READERS; segments merged
+ * away while a reader is open are deleted by
+ * the next writer to open the set instead.
+ */
+
+#ifndef _SEGMENTS_H_
+#define _SEGMENTS_H_
+
+#include <stdbool.h>
+
+typedef struct SegmentSet SegmentSet;
+
+/* Type: SegmentVisitor
+ * --------------------
+ * Called once per record answering a query.
+ */
+
+typedef bool (*SegmentVisitor)(void* ctx, double lat, double lon, const char* path);
+
+/* Function: segmentsOpen
+ * ----------------------
+ * Opens the segment set in dir. A writable
+ * set is created if needed and starts its
+ * compaction thread; a read-only one only
+ * answers queries. Returns NULL if the
+ * directory is unusable, or if writable and
+ * another process is writing to it.
+ */
+
+SegmentSet* segmentsOpen(const char* dir, bool writable);
+
+/* Function: segmentsReserve
+ * -------------------------
+ * Returns the file name a new segment is
+ * to be built under, which the caller
+ * frees. Returns NULL if out of memory
+ * or the set is read-only.
+ */
+
+char* segmentsReserve(SegmentSet* set);
+
+/* Function: segmentsAdd
+ * ---------------------
+ * Publishes the index built at a reserved
+ * name as the newest segment, along with a
+ * tombstone for folder unless it is NULL.
+ * Returns false if that failed or the set
+ * is read-only.
+ */
+
+bool segmentsAdd(SegmentSet* set, const char* path, const char* folder);
+
+/* Function: segmentsQuery
+ * -----------------------
+ * Visits every live record inside the
+ * given rectangle. Returns the number of
+ * records visited, or -1 on failure, such
+ * as a damaged or truncated segment.
+ */
+
+long segmentsQuery(SegmentSet* set, double latTL, double lonTL,
+    double latBR, double lonBR, SegmentVisitor visit, void* ctx);
+
+/* Function: segmentsClose
+ * -----------------------
+ * Lets pending compactions finish, then
+ * stops the compaction thread and releases
+ * everything held by set.
+ */
+
+void segmentsClose(SegmentSet* set);
+
+#endif
@@ -0,0 +1,551 @@
+/* File: serve.c
+ * -------------
+ * Implements the query server declared in
+ * serve.h. Each connection gets a thread of
+ * its own. The current store is reached
+ * through a reference-counted snapshot; the
+ * lock around the pointer is only held to
+ * take or drop a reference, never while a
+ * query runs or a store is built. The
+ * updater remembers the stat key and the
+ * position of every file, so a rescan only
+ * reads the files added or changed since.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "serve.h"
+#include "scan.h"
+#include "store.h"
+#include "nogps.h"
+
+#define MAX_KNN 100000
+
+/* Type: Snapshot
+ * --------------
+ * One published store. refs counts the
+ * server's own reference plus one per
+ * query running on it.
+ */
+
+typedef struct {
+    CoordStore* store;
+    int refs;
+} Snapshot;
+
+/* Type: FileEntry
+ * ---------------
+ * What the last scan found out about one
+ * file: its stat key as made by noGpsKey,
+ * zero if it is to be read every time, and
+ * its position, if it has one.
+ */
+
+typedef struct {
+    char* path;
+    uint64_t key;
+    bool located;
+    double lat, lon;
+} FileEntry;
+
+/* Type: FileTable
+ * ---------------
+ * The files of a folder, sorted by path
+ * once a scan is done.
+ */
+
+typedef struct {
+    FileEntry* entries;
+    size_t count, capacity;
+} FileTable;
+
+typedef struct {
+    const ServeConfig* config;
+    FileTable files; // only touched by the updater
+    Snapshot* current;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    bool updateWanted;
+} Server;
+
+typedef struct {
+    Server* server;
+    int fd;
+} Connection;
+
+/* Type: Collector
+ * ---------------
+ * Context of a rescan: the table of the
+ * last scan, which of its entries are
+ * unchanged, and one table per worker of
+ * the files read this time.
+ */
+
+typedef struct {
+    const FileTable* old;
+    bool* kept;
+    FileTable read[BOUND_MAX_THREADS];
+    bool failed;
+} Collector;
+
+static int compareEntries(const void* a, const void* b) {
+    return strcmp(((const FileEntry*) a) -> path, ((const FileEntry*) b) -> path);
+}
+
+static void freeTable(FileTable* table) {
+    for (size_t i = 0; i < table -> count; i++)
+        free(table -> entries[i].path);
+    free(table -> entries);
+    *table = (FileTable) {NULL, 0, 0};
+}
+
+/* Function: addEntry
+ * ------------------
+ * Appends a file without a position to
+ * table, taking over path. Returns false
+ * if out of memory.
+ */
+
+static bool addEntry(FileTable* table, char* path, uint64_t key) {
+    if (table -> count == table -> capacity) {
+        size_t capacity = table -> capacity ? table -> capacity * 2 : 1024;
+        FileEntry* entries = realloc(table -> entries, capacity * sizeof(FileEntry));
+        if (entries == NULL) return false;
+        table -> entries = entries;
+        table -> capacity = capacity;
+    }
+
+    table -> entries[table -> count++] = (FileEntry) {path, key, false, 0, 0};
+    return true;
+}
+
+/* Function: skipUnchanged
+ * -----------------------
+ * Leaves out the files whose stat key is
+ * the one of the last scan and notes the
+ * others as read on the calling worker.
+ */
+
+static bool skipUnchanged(void* ctx, int worker, const char* path,
+    const struct stat* fileStat) {
+    Collector* collector = ctx;
+    uint64_t key = fileStat != NULL ? noGpsKey(fileStat) : 0;
+    FileEntry wanted = {(char*) path, 0, false, 0, 0};
+    const FileEntry* old = collector -> old -> count == 0 ? NULL
+        : bsearch(&wanted, collector -> old -> entries,
+            collector -> old -> count, sizeof(FileEntry), compareEntries);
+    if (old != NULL && key != 0 && old -> key == key) {
+        collector -> kept[old - collector -> old -> entries] = true;
+        return true;
+    }
+
+    char* copy = strdup(path);
+    if (copy != NULL && addEntry(&collector -> read[worker], copy, key)) return false;
+    free(copy);
+    collector -> failed = true;
+    return true;
+}
+
+/* Function: collect
+ * -----------------
+ * Gives the file just read on the calling
+ * worker its position.
+ */
+
+static bool collect(void* ctx, int worker, const BoundResult* result) {
+    Collector* collector = ctx;
+    FileTable* read = &collector -> read[worker];
+    if (read -> count > 0 &&
+        strcmp(read -> entries[read -> count - 1].path, result -> path) == 0) {
+        FileEntry* entry = &read -> entries[read -> count - 1];
+        entry -> located = true;
+        entry -> lat = result -> lat;
+        entry -> lon = result -> lon;
+    }
+    return !collector -> failed;
+}
+
+/* Function: fillStore
+ * -------------------
+ * Makes a finished store of the files of
+ * table that have a position. Returns NULL
+ * if out of memory.
+ */
+
+static CoordStore* fillStore(const FileTable* table) {
+    CoordStore* store = storeCreate();
+    bool ok = store != NULL;
+    for (size_t i = 0; ok && i < table -> count; i++) {
+        const FileEntry* entry = &table -> entries[i];
+        if (entry -> located)
+            ok = storeAdd(store, entry -> lat, entry -> lon, entry -> path);
+    }
+
+    if (ok && storeFinish(store)) return store;
+    storeFree(store);
+    return NULL;
+}
+
+/* Function: buildStore
+ * --------------------
+ * Rescans the source folder against files,
+ * the table of the last scan, reading only
+ * the files added or changed since, and
+ * makes a new finished store of the kept
+ * and the new positions. Files gone from
+ * the folder are dropped. On success files
+ * is replaced by the new table and store
+ * set to the new store, or to NULL if
+ * nothing changed. Returns false if the
+ * scan failed, leaving files as it was.
+ */
+
+static bool buildStore(const ServeConfig* config, FileTable* files,
+    CoordStore** store) {
+    Collector collector = {files, calloc(files -> count + 1, sizeof(bool)),
+        {{NULL, 0, 0}}, false};
+    BoundConfig scan;
+    boundConfigInit(&scan, config -> srcPath);
+    scan.threads = config -> threads;
+    scan.cachePath = config -> cachePath;
+    scan.priority = BOUND_BULK;
+    scan.skip = skipUnchanged;
+
+    int status = collector.kept == NULL ? BOUND_ERR_MEMORY
+        : boundScan(&scan, collect, &collector);
+    bool ok = !collector.failed && (status == BOUND_OK || status == BOUND_ERR_CACHE);
+
+    //the new table holds the kept entries and the read ones
+    size_t count = 0, read = 0;
+    for (size_t i = 0; ok && i < files -> count; i++) count += collector.kept[i];
+    bool changed = count < files -> count;
+    for (int w = 0; w < scan.threads; w++) read += collector.read[w].count;
+    changed = changed || read > 0;
+    FileTable table = {NULL, count + read, count + read};
+    if (ok && changed && (table.entries = malloc((count + read) * sizeof(FileEntry))) == NULL)
+        ok = false;
+
+    *store = NULL;
+    if (ok && changed) {
+        size_t n = 0;
+        for (size_t i = 0; i < files -> count; i++)
+            if (collector.kept[i]) table.entries[n++] = files -> entries[i];
+        for (int w = 0; w < scan.threads; w++)
+            for (size_t i = 0; i < collector.read[w].count; i++)
+                table.entries[n++] = collector.read[w].entries[i];
+        qsort(table.entries, table.count, sizeof(FileEntry), compareEntries);
+        ok = (*store = fillStore(&table)) != NULL;
+    }
+
+    if (ok && changed) {
+        //the paths now belong to the new table
+        for (size_t i = 0; i < files -> count; i++)
+            if (collector.kept[i]) files -> entries[i].path = NULL;
+        for (int w = 0; w < scan.threads; w++) free(collector.read[w].entries);
+        freeTable(files);
+        *files = table;
+    } else {
+        for (int w = 0; w < scan.threads; w++) freeTable(&collector.read[w]);
+        free(table.entries);
+    }
+
+    free(collector.kept);
+    return ok;
+}
+
+static Snapshot* acquire(Server* server) {
+    pthread_mutex_lock(&server -> lock);
+    Snapshot* snapshot = server -> current;
+    snapshot -> refs += 1;
+    pthread_mutex_unlock(&server -> lock);
+    return snapshot;
+}
+
+static void release(Server* server, Snapshot* snapshot) {
+    pthread_mutex_lock(&server -> lock);
+    bool last = --snapshot -> refs == 0;
+    pthread_mutex_unlock(&server -> lock);
+
+    if (last) {
+        storeFree(snapshot -> store);
+        free(snapshot);
+    }
+}
+
+/* Function: publish
+ * -----------------
+ * Makes store the one new queries see and
+ * drops the server's reference to the old
+ * one. Returns false if out of memory.
+ */
+
+static bool publish(Server* server, CoordStore* store) {
+    Snapshot* snapshot = malloc(sizeof(Snapshot));
+    if (snapshot == NULL) return false;
+    snapshot -> store = store;
+    snapshot -> refs = 1;
+
+    pthread_mutex_lock(&server -> lock);
+    Snapshot* old = server -> current;
+    server -> current = snapshot;
+    pthread_mutex_unlock(&server -> lock);
+
+    if (old != NULL) release(server, old);
+    return true;
+}
+
+/* Function: updater
+ * -----------------
+ * Thread body of the rescans. Sleeps until
+ * the interval passes or a client asks for
+ * an update, then rescans and publishes a
+ * new store if any file was added, changed
+ * or removed. A failed rescan keeps the old.
+ */
+
+static void* updater(void* arg) {
+    Server* server = arg;
+    int interval = server -> config -> interval;
+
+    for (;;) {
+        pthread_mutex_lock(&server -> lock);
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += interval;
+        while (!server -> updateWanted) {
+            if (interval == 0) pthread_cond_wait(&server -> wake, &server -> lock);
+            else if (pthread_cond_timedwait(&server -> wake, &server -> lock,
+                &deadline) == ETIMEDOUT)
+                break;
+        }
+        server -> updateWanted = false;
+        pthread_mutex_unlock(&server -> lock);
+
+        CoordStore* store;
+        if (!buildStore(server -> config, &server -> files, &store) ||
+            (store != NULL && !publish(server, store))) {
+            storeFree(store);
+            fprintf(stderr, "bound: warning: rescan failed\n");
+        }
+    }
+
+    return NULL;
+}
+
+static bool writeRecord(void* ctx, double lat, double lon, const char* path) {
+    return fprintf(ctx, "%.7f,%.7f,%s\n", lat, lon, path) > 0;
+}
+
+typedef struct {
+    FILE* out;
+    long found;
+} ScanAnswer;
+
+static bool writeMatch(void* ctx, int worker, const BoundResult* result) {
+    ScanAnswer* answer = ctx;
+    __sync_fetch_and_add(&answer -> found, 1);
+    return writeRecord(answer -> out, result -> lat, result -> lon, result -> path);
+}
+
+/* Function: scanFolder
+ * --------------------
+ * Answers a scan request by reading the
+ * folder at path as an interactive scan,
+ * ahead of any rescan in progress. Returns
+ * the number of matches, or -1 on failure.
+ */
+
+static long scanFolder(Server* server, char* path, FILE* out) {
+    path[strcspn(path, "\r\n")] = '\0';
+    if (path[0] == '\0') return -1;
+
+    ScanAnswer answer = {out, 0};
+    BoundConfig scan;
+    boundConfigInit(&scan, path);
+    scan.threads = server -> config -> threads;
+    scan.priority = BOUND_INTERACTIVE;
+    return boundScan(&scan, writeMatch, &answer) == BOUND_OK ? answer.found : -1;
+}
+
+/* Function: parseArgs
+ * -------------------
+ * Reads exactly count numbers from the
+ * rest of a request line into values.
+ */
+
+static bool parseArgs(char* rest, double* values, int count) {
+    for (int i = 0; i < count; i++) {
+        char* end;
+        values[i] = strtod(rest, &end);
+        if (end == rest) return false;
+        rest = end;
+    }
+    return strspn(rest, " \t\r\n") == strlen(rest);
+}
+
+/* Function: answer
+ * ----------------
+ * Answers one request line on out.
+ */
+
+static void answer(Server* server, char* line, FILE* out) {
+    char* command = line + strspn(line, " \t");
+    size_t len = strcspn(command, " \t\r\n");
+    char* rest = command + len;
+    double args[4];
+    long found = -1;
+
+    if (len == 6 && strncmp(command, "update", 6) == 0) {
+        pthread_mutex_lock(&server -> lock);
+        server -> updateWanted = true;
+        pthread_cond_signal(&server -> wake);
+        pthread_mutex_unlock(&server -> lock);
+        fprintf(out, "end 0\n");
+        return;
+    }
+
+    if (len == 4 && strncmp(command, "scan", 4) == 0) {
+        found = scanFolder(server, rest + strspn(rest, " \t"), out);
+        if (found >= 0) fprintf(out, "end %ld\n", found);
+        else fprintf(out, "error could not scan folder\n");
+        return;
+    }
+
+    Snapshot* snapshot = acquire(server);
+    CoordStore* store = snapshot -> store;
+
+    if (len == 4 && strncmp(command, "rect", 4) == 0) {
+        if (parseArgs(rest, args, 4))
+            found = (long) storeRect(store, args[0], args[1], args[2], args[3],
+                writeRecord, out);
+    } else if (len == 6 && strncmp(command, "radius", 6) == 0) {
+        if (parseArgs(rest, args, 3))
+            found = (long) storeRadius(store, args[0], args[1], args[2],
+                writeRecord, out);
+    } else if (len == 3 && strncmp(command, "knn", 3) == 0) {
+        if (parseArgs(rest, args, 3) && args[2] >= 1 && args[2] <= MAX_KNN)
+            found = storeNearest(store, args[0], args[1], (size_t) args[2],
+                writeRecord, out);
+    } else if (len == 5 && strncmp(command, "count", 5) == 0) {
+        if (parseArgs(rest, args, 0)) found = (long) storeCount(store);
+    }
+
+    release(server, snapshot);
+    if (found >= 0) fprintf(out, "end %ld\n", found);
+    else fprintf(out, "error invalid request\n");
+}
+
+/* Function: serveConnection
+ * -------------------------
+ * Thread body of one client. Answers its
+ * requests in order until it hangs up.
+ */
+
+static void* serveConnection(void* arg) {
+    Connection* connection = arg;
+    FILE* in = fdopen(connection -> fd, "r");
+    int outFd = dup(connection -> fd);
+    FILE* out = outFd >= 0 ? fdopen(outFd, "w") : NULL;
+
+    char* line = NULL;
+    size_t capacity = 0;
+    while (in != NULL && out != NULL && getline(&line, &capacity, in) >= 0) {
+        answer(connection -> server, line, out);
+        if (fflush(out) != 0) break; // client went away
+    }
+
+    free(line);
+    if (in != NULL) fclose(in);
+    else close(connection -> fd);
+    if (out != NULL) fclose(out);
+    else if (outFd >= 0) close(outFd);
+    free(connection);
+    return NULL;
+}
+
+/* Function: listenOn
+ * ------------------
+ * Binds a Unix domain socket at path,
+ * replacing any stale one. Any other kind
+ * of file there is left alone and fails
+ * the call. Returns the listening socket,
+ * or -1 on failure.
+ */
+
+static int listenOn(const char* path) {
+    struct sockaddr_un addr = {0};
+    if (strlen(path) >= sizeof(addr.sun_path)) return -1;
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    struct stat pathStat;
+    if (lstat(path, &pathStat) == 0) {
+        if (!S_ISSOCK(pathStat.st_mode)) return -1;
+        unlink(path);
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) != 0 ||
+        listen(fd, SOMAXCONN) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+const char* serveRun(const ServeConfig* config) {
+    Server server = {config, {NULL, 0, 0}, NULL, PTHREAD_MUTEX_INITIALIZER,
+        PTHREAD_COND_INITIALIZER, false};
+
+    //clients that hang up mid-answer must not end the server
+    signal(SIGPIPE, SIG_IGN);
+
+    //rescans may not crowd out folder scans of clients
+    boundSetSlots(config -> threads, config -> threads > 3 ? config -> threads / 4 : 1);
+
+    CoordStore* store;
+    if (!buildStore(config, &server.files, &store))
+        return "could not scan source directory";
+    if (store == NULL && (store = fillStore(&server.files)) == NULL)
+        return "out of memory"; // an empty folder changes nothing
+    if (!publish(&server, store)) return "out of memory";
+
+    int listener = listenOn(config -> socketPath);
+    if (listener < 0) return "could not listen on socket";
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, updater, &server) != 0)
+        return "could not start update thread";
+    pthread_detach(thread);
+
+    for (;;) {
+        int fd = accept(listener, NULL, NULL);
+        if (fd < 0 && (errno == EINTR || errno == ECONNABORTED)) continue;
+        if (fd < 0) return "could not accept connection";
+
+        Connection* connection = malloc(sizeof(Connection));
+        if (connection != NULL) {
+            connection -> server = &server;
+            connection -> fd = fd;
+        }
+        if (connection == NULL ||
+            pthread_create(&thread, NULL, serveConnection, connection) != 0) {
+            free(connection);
+            close(fd);
+            continue; // drop this client, keep serving the rest
+        }
+        pthread_detach(thread);
+    }
+}
@@ -0,0 +1,61 @@
+/* File: serve.h
+ * -------------
+ * A long-running query server. The positions of
+ * all images in a folder are read once
+ * into a coordinate store and kept in memory,
+ * and clients connected over a Unix domain
+ * socket query it with a line protocol:
+ *
+ *   rect latTL lonTL latBR lonBR
+ *   radius lat lon meters
+ *   knn lat lon k
+ *   count
+ *   update
+ *   scan path
+ *
+ * Each match is answered as a lat,lon,path line
+ * and every request ends with an end N line
+ * giving the number of matches, or with an
+ * error line if it was malformed. update asks
+ * for a rescan and answers end 0 at once. scan
+ * reads the images of another folder on the
+ * spot and answers with those that have a
+ * position; it takes priority over rescans.
+ *
+ * Rescans run on a background thread and only
+ * read the files added or changed since the
+ * last, told apart by their stat. The new store
+ * is made from those and the positions kept in
+ * memory, and replaces the old one in a single
+ * pointer swap; queries in flight finish on the
+ * store they started with.
+ */
+
+#ifndef _SERVE_H_
+#define _SERVE_H_
+
+/* Type: ServeConfig
+ * -----------------
+ * Where to listen and what to index. The
+ * folder is rescanned every interval
+ * seconds, or only on request if zero.
+ */
+
+typedef struct {
+    const char* socketPath;
+    const char* srcPath;
+    int threads;
+    const char* cachePath;
+    int interval;
+} ServeConfig;
+
+/* Function: serveRun
+ * ------------------
+ * Builds the store and serves queries until
+ * the process ends. Returns only on failure,
+ * with a description of the error.
+ */
+
+const char* serveRun(const ServeConfig* config);
+
+#endif
@@ -0,0 +1,375 @@
+/* File: store.c
+ * -------------
+ * Implements the coordinate store declared in
+ * store.h. Records are sorted by the key of a
+ * fixed latitude/longitude grid cell, row by
+ * row, so the cells of one row that overlap
+ * a query box form one contiguous run that
+ * two binary searches find.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include "store.h"
+
+#define EARTH_RADIUS 6371008.8
+#define CELL_DEG 0.25
+#define ROWS 720  // 180 / CELL_DEG
+#define COLS 1440 // 360 / CELL_DEG
+#define FIRST_RADIUS 10000.0
+
+/* Type: Record
+ * ------------
+ * One image position with the offset
+ * of its path in the arena.
+ */
+
+typedef struct {
+    double lat, lon;
+    uint64_t path;
+} Record;
+
+struct CoordStore {
+    Record* records;
+    size_t count, capacity;
+    char* paths;
+    uint64_t pathsUsed, pathsCapacity;
+    uint32_t* keys; // cell of each record once finished
+};
+
+/* Type: BoxQuery
+ * --------------
+ * State of one walk over the cells of a
+ * box. Records are passed to the visitor
+ * if they lie within the rectangle, or
+ * within the radius when meters is set.
+ */
+
+typedef struct {
+    double latTL, lonTL, latBR, lonBR;
+    double lat, lon, meters;
+    StoreVisitor visit;
+    void* ctx;
+    size_t visited;
+    bool stopped;
+} BoxQuery;
+
+CoordStore* storeCreate(void) {
+    return calloc(1, sizeof(CoordStore));
+}
+
+/* Function: reserve
+ * -----------------
+ * Makes room for one more record and a
+ * path of len bytes. Returns false if
+ * out of memory.
+ */
+
+static bool reserve(CoordStore* store, size_t len) {
+    if (store -> count == store -> capacity) {
+        size_t capacity = store -> capacity ? store -> capacity * 2 : 1024;
+        Record* records = realloc(store -> records, capacity * sizeof(Record));
+        if (records == NULL) return false;
+        store -> records = records;
+        store -> capacity = capacity;
+    }
+
+    if (store -> pathsUsed + len > store -> pathsCapacity) {
+        uint64_t capacity = store -> pathsCapacity ? store -> pathsCapacity * 2 : 16384;
+        while (capacity < store -> pathsUsed + len) capacity *= 2;
+        char* paths = realloc(store -> paths, capacity);
+        if (paths == NULL) return false;
+        store -> paths = paths;
+        store -> pathsCapacity = capacity;
+    }
+
+    return true;
+}
+
+bool storeAdd(CoordStore* store, double lat, double lon, const char* path) {
+    size_t len = strlen(path) + 1;
+    if (!reserve(store, len)) return false;
+
+    Record* record = &store -> records[store -> count++];
+    record -> lat = lat;
+    record -> lon = lon;
+    record -> path = store -> pathsUsed;
+    memcpy(store -> paths + store -> pathsUsed, path, len);
+    store -> pathsUsed += len;
+    return true;
+}
+
+bool storeMerge(CoordStore* into, CoordStore* from) {
+    for (size_t i = 0; i < from -> count; i++) {
+        const Record* record = &from -> records[i];
+        if (!storeAdd(into, record -> lat, record -> lon,
+            from -> paths + record -> path))
+            return false;
+    }
+
+    free(from -> records);
+    free(from -> paths);
+    free(from -> keys);
+    memset(from, 0, sizeof(CoordStore));
+    return true;
+}
+
+static int cellRow(double lat) {
+    int row = (int) floor((lat + 90) / CELL_DEG);
+    return row < 0 ? 0 : (row >= ROWS ? ROWS - 1 : row);
+}
+
+static int cellCol(double lon) {
+    int col = (int) floor((lon + 180) / CELL_DEG);
+    return col < 0 ? 0 : (col >= COLS ? COLS - 1 : col);
+}
+
+static uint32_t cellKey(double lat, double lon) {
+    return (uint32_t) cellRow(lat) * COLS + (uint32_t) cellCol(lon);
+}
+
+/* Type: SortKey
+ * -------------
+ * Cell of one record and its index.
+ */
+
+typedef struct {
+    uint32_t key;
+    uint32_t index;
+} SortKey;
+
+static int compareKeys(const void* a, const void* b) {
+    const SortKey* p = a;
+    const SortKey* q = b;
+    if (p -> key != q -> key) return p -> key < q -> key ? -1 : 1;
+    return p -> index < q -> index ? -1 : (p -> index > q -> index);
+}
+
+bool storeFinish(CoordStore* store) {
+    size_t n = store -> count;
+    SortKey* keys = malloc((n ? n : 1) * sizeof(SortKey));
+    Record* sorted = malloc((n ? n : 1) * sizeof(Record));
+    store -> keys = malloc((n ? n : 1) * sizeof(uint32_t));
+    if (keys == NULL || sorted == NULL || store -> keys == NULL) {
+        free(keys);
+        free(sorted);
+        return false;
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        keys[i].key = cellKey(store -> records[i].lat, store -> records[i].lon);
+        keys[i].index = (uint32_t) i;
+    }
+    qsort(keys, n, sizeof(SortKey), compareKeys);
+
+    //gather the records in key order
+    for (size_t i = 0; i < n; i++) {
+        sorted[i] = store -> records[keys[i].index];
+        store -> keys[i] = keys[i].key;
+    }
+
+    free(store -> records);
+    store -> records = sorted;
+    store -> capacity = n;
+    free(keys);
+    return true;
+}
+
+size_t storeCount(const CoordStore* store) {
+    return store -> count;
+}
+
+/* Function: lowerBound
+ * --------------------
+ * Returns the index of the first record
+ * whose cell key is at least key.
+ */
+
+static size_t lowerBound(const CoordStore* store, uint32_t key) {
+    size_t lo = 0, hi = store -> count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (store -> keys[mid] < key) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+/* Function: distance
+ * ------------------
+ * Returns the great-circle distance in
+ * meters between two points, by the
+ * haversine formula.
+ */
+
+static double distance(double lat1, double lon1, double lat2, double lon2) {
+    double phi1 = lat1 * M_PI / 180, phi2 = lat2 * M_PI / 180;
+    double dPhi = phi2 - phi1, dLambda = (lon2 - lon1) * M_PI / 180;
+    double a = sin(dPhi / 2) * sin(dPhi / 2) +
+        cos(phi1) * cos(phi2) * sin(dLambda / 2) * sin(dLambda / 2);
+    return 2 * EARTH_RADIUS * asin(sqrt(a < 1 ? a : 1));
+}
+
+/* Function: walkBox
+ * -----------------
+ * Walks the cells overlapping the box from
+ * latLo to latHi and lonLo to lonHi, which
+ * must not cross the antimeridian, and
+ * passes each record that matches the
+ * query on to its visitor.
+ */
+
+static void walkBox(const CoordStore* store, BoxQuery* query,
+    double latLo, double latHi, double lonLo, double lonHi) {
+    int colLo = cellCol(lonLo), colHi = cellCol(lonHi);
+
+    for (int row = cellRow(latLo); row <= cellRow(latHi) && !query -> stopped; row++) {
+        size_t end = lowerBound(store, (uint32_t) row * COLS + colHi + 1);
+        for (size_t i = lowerBound(store, (uint32_t) row * COLS + colLo); i < end; i++) {
+            const Record* record = &store -> records[i];
+            bool match = query -> meters > 0
+                ? distance(query -> lat, query -> lon,
+                    record -> lat, record -> lon) <= query -> meters
+                : record -> lat <= query -> latTL && record -> lat >= query -> latBR &&
+                    record -> lon >= query -> lonTL && record -> lon <= query -> lonBR;
+            if (!match) continue;
+
+            query -> visited += 1;
+            if (!query -> visit(query -> ctx, record -> lat, record -> lon,
+                store -> paths + record -> path)) {
+                query -> stopped = true;
+                break;
+            }
+        }
+    }
+}
+
+size_t storeRect(const CoordStore* store, double latTL, double lonTL,
+    double latBR, double lonBR, StoreVisitor visit, void* ctx) {
+    BoxQuery query = {latTL, lonTL, latBR, lonBR, 0, 0, 0, visit, ctx, 0, false};
+    if (store -> count > 0 && latTL >= latBR && lonTL <= lonBR)
+        walkBox(store, &query, latBR, latTL, lonTL, lonBR);
+    return query.visited;
+}
+
+size_t storeRadius(const CoordStore* store, double lat, double lon,
+    double meters, StoreVisitor visit, void* ctx) {
+    BoxQuery query = {0, 0, 0, 0, lat, lon, meters, visit, ctx, 0, false};
+    if (store -> count == 0 || !(meters > 0)) return 0;
+
+    //bounding box of the circle, widened to every
+    //longitude when it reaches over a pole
+    double dLat = meters / EARTH_RADIUS * 180 / M_PI;
+    double latLo = lat - dLat, latHi = lat + dLat;
+    double dLon = 180;
+    if (latLo > -90 && latHi < 90) {
+        double widest = fmax(fabs(latLo), fabs(latHi)) * M_PI / 180;
+        dLon = fmin(180, dLat / cos(widest));
+    }
+
+    double lonLo = lon - dLon, lonHi = lon + dLon;
+    if (dLon >= 180) walkBox(store, &query, latLo, latHi, -180, 180);
+    else {
+        //split boxes that cross the antimeridian
+        walkBox(store, &query, latLo, latHi, fmax(lonLo, -180), fmin(lonHi, 180));
+        if (lonLo < -180 && !query.stopped)
+            walkBox(store, &query, latLo, latHi, lonLo + 360, 180);
+        if (lonHi > 180 && !query.stopped)
+            walkBox(store, &query, latLo, latHi, -180, lonHi - 360);
+    }
+
+    return query.visited;
+}
+
+/* Type: Candidate
+ * ---------------
+ * A record gathered by storeNearest
+ * together with its distance.
+ */
+
+typedef struct {
+    double meters;
+    double lat, lon;
+    const char* path;
+} Candidate;
+
+typedef struct {
+    Candidate* items;
+    size_t count, capacity;
+    bool failed;
+} CandidateList;
+
+static bool gather(void* ctx, double lat, double lon, const char* path) {
+    CandidateList* list = ctx;
+    if (list -> count == list -> capacity) {
+        size_t capacity = list -> capacity ? list -> capacity * 2 : 64;
+        Candidate* items = realloc(list -> items, capacity * sizeof(Candidate));
+        if (items == NULL) {
+            list -> failed = true;
+            return false;
+        }
+        list -> items = items;
+        list -> capacity = capacity;
+    }
+
+    Candidate* candidate = &list -> items[list -> count++];
+    candidate -> lat = lat;
+    candidate -> lon = lon;
+    candidate -> path = path;
+    return true;
+}
+
+static int compareCandidates(const void* a, const void* b) {
+    const Candidate* p = a;
+    const Candidate* q = b;
+    return p -> meters < q -> meters ? -1 : (p -> meters > q -> meters);
+}
+
+/* Function: storeNearest
+ * ----------------------
+ * Searches circles of growing radius until
+ * one holds at least k records, which then
+ * contains the k nearest, or until the
+ * circle covers the whole earth.
+ */
+
+long storeNearest(const CoordStore* store, double lat, double lon,
+    size_t k, StoreVisitor visit, void* ctx) {
+    CandidateList list = {NULL, 0, 0, false};
+    if (k == 0 || store -> count == 0) return 0;
+
+    double meters = FIRST_RADIUS;
+    for (;;) {
+        list.count = 0;
+        storeRadius(store, lat, lon, meters, gather, &list);
+        if (list.failed) {
+            free(list.items);
+            return -1;
+        }
+        if (list.count >= k || meters >= M_PI * EARTH_RADIUS) break;
+        meters *= 4;
+    }
+
+    for (size_t i = 0; i < list.count; i++)
+        list.items[i].meters = distance(lat, lon, list.items[i].lat, list.items[i].lon);
+    qsort(list.items, list.count, sizeof(Candidate), compareCandidates);
+
+    size_t visited = 0;
+    while (visited < list.count && visited < k) {
+        const Candidate* candidate = &list.items[visited++];
+        if (!visit(ctx, candidate -> lat, candidate -> lon, candidate -> path)) break;
+    }
+
+    free(list.items);
+    return (long) visited;
+}
+
+void storeFree(CoordStore* store) {
+    if (store == NULL) return;
+    free(store -> records);
+    free(store -> paths);
+    free(store -> keys);
+    free(store);
+}
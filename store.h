@@ -0,0 +1,107 @@
+/* File: store.h
+ * -------------
+ * Keeps image coordinates in memory for fast
+ * spatial queries. Records are added while the
+ * store is being filled and sorted into a grid
+ * once by storeFinish; from then on the store
+ * is read-only and may be queried from any
+ * number of threads at once.
+ */
+
+#ifndef _STORE_H_
+#define _STORE_H_
+
+#include <stddef.h>
+#include <stdbool.h>
+
+typedef struct CoordStore CoordStore;
+
+/* Type: StoreVisitor
+ * ------------------
+ * Called once per record found by a query.
+ * Returns false to end the query early.
+ */
+
+typedef bool (*StoreVisitor)(void* ctx, double lat, double lon, const char* path);
+
+/* Function: storeCreate
+ * ---------------------
+ * Creates an empty store.
+ */
+
+CoordStore* storeCreate(void);
+
+/* Function: storeAdd
+ * ------------------
+ * Adds a record with the given decimal
+ * coordinate. The path is copied. Returns
+ * false if out of memory.
+ */
+
+bool storeAdd(CoordStore* store, double lat, double lon, const char* path);
+
+/* Function: storeMerge
+ * --------------------
+ * Moves all records of from into into,
+ * leaving from empty. Used to combine
+ * per-thread partial stores.
+ */
+
+bool storeMerge(CoordStore* into, CoordStore* from);
+
+/* Function: storeFinish
+ * ---------------------
+ * Sorts the records into the grid used by
+ * queries. No records may be added after.
+ * Returns false if out of memory.
+ */
+
+bool storeFinish(CoordStore* store);
+
+/* Function: storeCount
+ * --------------------
+ * Returns the number of records.
+ */
+
+size_t storeCount(const CoordStore* store);
+
+/* Function: storeRect
+ * -------------------
+ * Visits the records in the rectangle between
+ * the top left and bottom right corners, bounds
+ * included, in no particular order. Returns the
+ * number of records visited.
+ */
+
+size_t storeRect(const CoordStore* store, double latTL, double lonTL,
+    double latBR, double lonBR, StoreVisitor visit, void* ctx);
+
+/* Function: storeRadius
+ * ---------------------
+ * Visits the records within meters of the
+ * given point along the surface of the earth,
+ * in no particular order. Returns the number
+ * of records visited.
+ */
+
+size_t storeRadius(const CoordStore* store, double lat, double lon,
+    double meters, StoreVisitor visit, void* ctx);
+
+/* Function: storeNearest
+ * ----------------------
+ * Visits the k records nearest to the given
+ * point, nearest first. Returns the number of
+ * records visited, or -1 if out of memory.
+ */
+
+long storeNearest(const CoordStore* store, double lat, double lon,
+    size_t k, StoreVisitor visit, void* ctx);
+
+/* Function: storeFree
+ * -------------------
+ * Releases all memory held by store.
+ */
+
+void storeFree(CoordStore* store);
+
+#endif
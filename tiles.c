@@ -0,0 +1,253 @@
+/* File: tiles.c
+ * -------------
+ * Implements the tile pyramid declared in tiles.h.
+ * Points are only ever binned at the deepest zoom;
+ * each shallower level is produced when writing by
+ * folding the level below it into quarter-size
+ * parents, so adding a point is one hash update.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include "tiles.h"
+
+#define MERCATOR_MAX_LAT 85.05112878
+#define INITIAL_SLOTS 1024
+
+/* Type: TileBin
+ * -------------
+ * One occupied tile. The key packs the
+ * tile x into the high and y into the
+ * low 32 bits; a zero count marks a
+ * free slot in the open hash table.
+ */
+
+typedef struct {
+    uint64_t key;
+    uint32_t count;
+} TileBin;
+
+/* Type: TileTable
+ * ---------------
+ * Open-addressed hash table of tile bins
+ * using linear probing. Capacity is always
+ * a power of two and kept at most half full.
+ */
+
+typedef struct {
+    TileBin* bins;
+    size_t capacity;
+    size_t used;
+} TileTable;
+
+struct TileAgg {
+    int maxZoom;
+    TileTable leaves;
+};
+
+static uint64_t hashKey(uint64_t key) {
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    return key;
+}
+
+static bool tableInit(TileTable* table, size_t capacity) {
+    table -> bins = calloc(capacity, sizeof(TileBin));
+    table -> capacity = capacity;
+    table -> used = 0;
+    return table -> bins != NULL;
+}
+
+static bool tableAdd(TileTable* table, uint64_t key, uint32_t count);
+
+/* Function: tableGrow
+ * -------------------
+ * Doubles the capacity of a table and
+ * rehashes its bins into the new array.
+ * On allocation failure the table keeps
+ * its old (still valid) storage and false
+ * is returned.
+ */
+
+static bool tableGrow(TileTable* table) {
+    TileTable bigger;
+    if (!tableInit(&bigger, table -> capacity * 2)) return false;
+
+    for (size_t i = 0; i < table -> capacity; i++)
+        if (table -> bins[i].count > 0)
+            tableAdd(&bigger, table -> bins[i].key, table -> bins[i].count);
+
+    free(table -> bins);
+    *table = bigger;
+    return true;
+}
+
+/* Function: tableAdd
+ * ------------------
+ * Adds count to the bin of key. Returns
+ * false, leaving the table unchanged, if
+ * it had to grow and was out of memory.
+ */
+
+static bool tableAdd(TileTable* table, uint64_t key, uint32_t count) {
+    //keep the load factor under half
+    if ((table -> used + 1) * 2 > table -> capacity && !tableGrow(table))
+        return false;
+
+    size_t mask = table -> capacity - 1;
+    size_t slot = hashKey(key) & mask;
+
+    //probe until we find the key or a free slot
+    while (table -> bins[slot].count > 0 && table -> bins[slot].key != key)
+        slot = (slot + 1) & mask;
+
+    if (table -> bins[slot].count == 0) {
+        table -> bins[slot].key = key;
+        table -> used += 1;
+    }
+
+    table -> bins[slot].count += count;
+    return true;
+}
+
+static int compareBins(const void* a, const void* b) {
+    uint64_t ka = ((const TileBin*) a) -> key;
+    uint64_t kb = ((const TileBin*) b) -> key;
+    return (ka > kb) - (ka < kb);
+}
+
+/* Function: tileKey
+ * -----------------
+ * Computes the packed x and y index of
+ * the tile containing a point at the given
+ * zoom, following the slippy-map math.
+ */
+
+static uint64_t tileKey(double lat, double lon, int zoom) {
+    double n = (double) (1ULL << zoom);
+    if (lat > MERCATOR_MAX_LAT) lat = MERCATOR_MAX_LAT;
+    if (lat < -MERCATOR_MAX_LAT) lat = -MERCATOR_MAX_LAT;
+
+    double latRad = lat * M_PI / 180.0;
+    double fx = (lon + 180.0) / 360.0 * n;
+    double fy = (1.0 - log(tan(latRad) + 1.0 / cos(latRad)) / M_PI) / 2.0 * n;
+
+    //clamp the far edges into the last tile
+    uint64_t x = fx < 0 ? 0 : (fx >= n ? (uint64_t) n - 1 : (uint64_t) fx);
+    uint64_t y = fy < 0 ? 0 : (fy >= n ? (uint64_t) n - 1 : (uint64_t) fy);
+    return (x << 32) | y;
+}
+
+TileAgg* tileAggCreate(int maxZoom) {
+    if (maxZoom < 0 || maxZoom > TILES_MAX_ZOOM) return NULL;
+
+    TileAgg* agg = malloc(sizeof(TileAgg));
+    if (agg == NULL) return NULL;
+
+    agg -> maxZoom = maxZoom;
+    if (!tableInit(&agg -> leaves, INITIAL_SLOTS)) {
+        free(agg);
+        return NULL;
+    }
+
+    return agg;
+}
+
+bool tileAggAdd(TileAgg* agg, double lat, double lon) {
+    return tableAdd(&agg -> leaves, tileKey(lat, lon, agg -> maxZoom), 1);
+}
+
+bool tileAggMerge(TileAgg* into, const TileAgg* from) {
+    for (size_t i = 0; i < from -> leaves.capacity; i++)
+        if (from -> leaves.bins[i].count > 0 &&
+            !tableAdd(&into -> leaves, from -> leaves.bins[i].key,
+                from -> leaves.bins[i].count))
+            return false;
+    return true;
+}
+
+/* Function: writeLevel
+ * --------------------
+ * Sorts and writes the occupied bins of
+ * one zoom level. The bins array is owned
+ * by the caller and is reordered in place.
+ */
+
+static bool writeLevel(TileBin* bins, size_t count,
+    int zoom, FILE* out, bool binary) {
+    qsort(bins, count, sizeof(TileBin), compareBins);
+
+    for (size_t i = 0; i < count; i++) {
+        uint32_t x = (uint32_t) (bins[i].key >> 32);
+        uint32_t y = (uint32_t) bins[i].key;
+
+        if (!binary) {
+            if (fprintf(out, "%d,%u,%u,%u\n", zoom, x, y, bins[i].count) < 0)
+                return false;
+            continue;
+        }
+
+        //fixed 13-byte little-endian record
+        unsigned char rec[13];
+        uint32_t fields[3] = {x, y, bins[i].count};
+        rec[0] = (unsigned char) zoom;
+        for (int f = 0; f < 3; f++)
+            for (int b = 0; b < 4; b++)
+                rec[1 + f * 4 + b] = (unsigned char) (fields[f] >> (8 * b));
+
+        if (fwrite(rec, 1, sizeof(rec), out) != sizeof(rec))
+            return false;
+    }
+
+    return true;
+}
+
+bool tileAggWrite(const TileAgg* agg, FILE* out, bool binary) {
+    TileBin* levels[TILES_MAX_ZOOM + 1] = {NULL};
+    size_t counts[TILES_MAX_ZOOM + 1] = {0};
+    bool ok = true;
+
+    //compact the leaf table into a dense array
+    int z = agg -> maxZoom;
+    levels[z] = malloc((agg -> leaves.used + 1) * sizeof(TileBin));
+    if (levels[z] == NULL) return false;
+    for (size_t i = 0; i < agg -> leaves.capacity; i++)
+        if (agg -> leaves.bins[i].count > 0)
+            levels[z][counts[z]++] = agg -> leaves.bins[i];
+
+    //fold each level into its parent level
+    for (z = agg -> maxZoom; z > 0 && ok; z--) {
+        TileTable parents;
+        if (!tableInit(&parents, INITIAL_SLOTS)) { ok = false; break; }
+
+        for (size_t i = 0; i < counts[z] && ok; i++) {
+            uint64_t x = (levels[z][i].key >> 32) >> 1;
+            uint64_t y = (levels[z][i].key & 0xFFFFFFFFULL) >> 1;
+            ok = tableAdd(&parents, (x << 32) | y, levels[z][i].count);
+        }
+
+        levels[z - 1] = ok ? malloc((parents.used + 1) * sizeof(TileBin)) : NULL;
+        if (levels[z - 1] == NULL) ok = false;
+        else for (size_t i = 0; i < parents.capacity; i++)
+            if (parents.bins[i].count > 0)
+                levels[z - 1][counts[z - 1]++] = parents.bins[i];
+
+        free(parents.bins);
+    }
+
+    for (z = 0; z <= agg -> maxZoom && ok; z++)
+        ok = writeLevel(levels[z], counts[z], z, out, binary);
+
+    for (z = 0; z <= agg -> maxZoom; z++)
+        free(levels[z]);
+    return ok;
+}
+
+void tileAggFree(TileAgg* agg) {
+    if (agg == NULL) return;
+    free(agg -> leaves.bins);
+    free(agg);
+}
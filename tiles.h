@@ -0,0 +1,67 @@
+/* File: tiles.h
+ * -------------
+ * Aggregates image coordinates into Web Mercator
+ * tile counts for every zoom level from zero up
+ * to a chosen maximum, forming a density pyramid
+ * that map clients can draw as a heatmap overlay.
+ */
+
+#ifndef _TILES_H_
+#define _TILES_H_
+
+#include <stdio.h>
+#include <stdbool.h>
+
+#define TILES_MAX_ZOOM 24
+
+typedef struct TileAgg TileAgg;
+
+/* Function: tileAggCreate
+ * -----------------------
+ * Creates an empty aggregate whose points
+ * are binned at maxZoom. Lower levels are
+ * derived from those bins when written.
+ */
+
+TileAgg* tileAggCreate(int maxZoom);
+
+/* Function: tileAggAdd
+ * --------------------
+ * Counts one point at the given decimal
+ * latitude and longitude. Latitudes beyond
+ * the Mercator limit are clamped to it.
+ * Returns false if out of memory.
+ */
+
+bool tileAggAdd(TileAgg* agg, double lat, double lon);
+
+/* Function: tileAggMerge
+ * ----------------------
+ * Adds every count in from to into. Both
+ * aggregates must share the same maxZoom.
+ * Used to combine per-thread partials.
+ * Returns false if out of memory.
+ */
+
+bool tileAggMerge(TileAgg* into, const TileAgg* from);
+
+/* Function: tileAggWrite
+ * ----------------------
+ * Builds the pyramid and writes it to out,
+ * ordered by zoom, then x, then y. CSV rows
+ * are z,x,y,count; binary records are a u8
+ * zoom, u32 x, u32 y and u32 count, all in
+ * little-endian order. Returns false if a
+ * write or allocation failed.
+ */
+
+bool tileAggWrite(const TileAgg* agg, FILE* out, bool binary);
+
+/* Function: tileAggFree
+ * ---------------------
+ * Releases all memory held by agg.
+ */
+
+void tileAggFree(TileAgg* agg);
+
+#endif
@@ -0,0 +1,246 @@
+/* File: video.c
+ * -------------
+ * Implements the video reader declared in
+ * video.h. Atoms are walked by their sizes
+ * with seeks, so the media data, however
+ * large, is skipped without being read.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <sys/types.h>
+#include "video.h"
+#include "io.h"
+
+#define MAX_META_ATOM (1024 * 1024)
+#define LOCATION_KEY "com.apple.quicktime.location.ISO6709"
+
+/* Type: Atom
+ * ----------
+ * Position of an atom's payload in the
+ * file, as the offsets of its first byte
+ * and of the byte after its last.
+ */
+
+typedef struct {
+    off_t start;
+    off_t end;
+} Atom;
+
+static uint32_t readBE32(const unsigned char* p) {
+    return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | p[3];
+}
+
+/* Function: findAtom
+ * ------------------
+ * Walks the atoms between start and end
+ * by their headers and finds the first
+ * one of the given type. Returns false if
+ * there is none or a header is malformed.
+ */
+
+static bool findAtom(FILE* file, off_t start, off_t end,
+    const char* type, Atom* atom) {
+    unsigned char header[16];
+
+    while (end - start >= 8) {
+        if (fseeko(file, start, SEEK_SET) != 0 || fread(header, 1, 8, file) != 8)
+            return false;
+
+        uint64_t size = readBE32(header);
+        off_t headerLen = 8;
+        if (size == 1) {
+            //64-bit size after the type
+            if (fread(header + 8, 1, 8, file) != 8) return false;
+            size = (uint64_t) readBE32(header + 8) << 32 | readBE32(header + 12);
+            headerLen = 16;
+        } else if (size == 0) size = end - start; // runs to the end
+
+        if (size < (uint64_t) headerLen || size > (uint64_t) (end - start))
+            return false;
+        if (memcmp(header + 4, type, 4) == 0) {
+            atom -> start = start + headerLen;
+            atom -> end = start + (off_t) size;
+            return true;
+        }
+
+        start += (off_t) size;
+    }
+
+    return false;
+}
+
+/* Function: readAtom
+ * ------------------
+ * Reads the payload of a small atom into
+ * a new buffer, with a NUL after it for
+ * string parsing. Returns NULL if it is
+ * too large or cannot be read.
+ */
+
+static unsigned char* readAtom(FILE* file, Atom atom, size_t* len) {
+    if (atom.end - atom.start > MAX_META_ATOM) return NULL;
+    *len = (size_t) (atom.end - atom.start);
+
+    unsigned char* data = malloc(*len + 1);
+    if (data == NULL) return NULL;
+    if (fseeko(file, atom.start, SEEK_SET) != 0 || fread(data, 1, *len, file) != *len) {
+        free(data);
+        return NULL;
+    }
+
+    data[*len] = '\0';
+    return data;
+}
+
+/* Function: parseComponent
+ * ------------------------
+ * Parses one signed ISO 6709 component
+ * at *p, in degrees (DD.D), degrees and
+ * minutes (DDMM.M) or degrees, minutes
+ * and seconds (DDMMSS.S), where degrees
+ * take degreeDigits digits. Advances *p
+ * past it and returns false if malformed.
+ */
+
+static bool parseComponent(const char** p, int degreeDigits, double* value) {
+    const char* s = *p;
+    if (*s != '+' && *s != '-') return false;
+    double sign = *s == '-' ? -1 : 1;
+    s++;
+
+    //the count of whole digits gives the form
+    int digits = 0;
+    while (s[digits] >= '0' && s[digits] <= '9') digits++;
+    if (digits != degreeDigits && digits != degreeDigits + 2 &&
+        digits != degreeDigits + 4)
+        return false;
+
+    char* end;
+    double number = strtod(s, &end);
+    if (digits == degreeDigits + 2) {
+        double degrees = floor(number / 100);
+        number = degrees + (number - degrees * 100) / 60;
+    } else if (digits == degreeDigits + 4) {
+        double degrees = floor(number / 10000);
+        double minutes = floor((number - degrees * 10000) / 100);
+        number = degrees + minutes / 60 +
+            (number - degrees * 10000 - minutes * 100) / 3600;
+    }
+
+    *value = sign * number;
+    *p = end;
+    return true;
+}
+
+/* Function: parseISO6709
+ * ----------------------
+ * Parses a location such as
+ * "+37.7749-122.4194+010.000/".
+ */
+
+static bool parseISO6709(const char* text, double* lat, double* lon) {
+    return parseComponent(&text, 2, lat) && parseComponent(&text, 3, lon) &&
+        *lat >= -90 && *lat <= 90 && *lon >= -180 && *lon <= 180;
+}
+
+/* Function: readUdtaLocation
+ * --------------------------
+ * Reads the ©xyz atom of a udta atom,
+ * a 16-bit length and language followed
+ * by the ISO 6709 string.
+ */
+
+static bool readUdtaLocation(FILE* file, Atom udta, double* lat, double* lon) {
+    Atom xyz;
+    size_t len;
+    if (!findAtom(file, udta.start, udta.end, "\xA9xyz", &xyz)) return false;
+
+    unsigned char* data = readAtom(file, xyz, &len);
+    bool found = data != NULL && len > 4 && parseISO6709((char*) data + 4, lat, lon);
+    free(data);
+    return found;
+}
+
+/* Function: readMetaLocation
+ * --------------------------
+ * Reads the location key of a QuickTime
+ * meta atom. Its keys atom lists key names
+ * in order; the ilst atom holds one atom
+ * per value, typed by the 1-based index of
+ * its key, with the value in a data atom.
+ */
+
+static bool readMetaLocation(FILE* file, Atom meta, double* lat, double* lon) {
+    unsigned char header[8];
+    Atom keys, ilst, item, data;
+    size_t len;
+
+    //ISO meta atoms carry a version and flags first, QuickTime ones do not
+    if (fseeko(file, meta.start, SEEK_SET) != 0 || fread(header, 1, 8, file) != 8)
+        return false;
+    if (memcmp(header + 4, "hdlr", 4) != 0) meta.start += 4;
+
+    if (!findAtom(file, meta.start, meta.end, "keys", &keys) ||
+        !findAtom(file, meta.start, meta.end, "ilst", &ilst))
+        return false;
+
+    //find the index of the location key
+    unsigned char* list = readAtom(file, keys, &len);
+    if (list == NULL) return false;
+    uint32_t index = 0;
+    size_t pos = 8; // version, flags and entry count
+    for (uint32_t i = 1; pos + 8 <= len; i++) {
+        uint32_t size = readBE32(list + pos);
+        if (size < 8 || size > len - pos) break;
+        if (size - 8 == strlen(LOCATION_KEY) &&
+            memcmp(list + pos + 8, LOCATION_KEY, size - 8) == 0) {
+            index = i;
+            break;
+        }
+        pos += size;
+    }
+    free(list);
+    if (index == 0) return false;
+
+    //the item atom's type is the index itself
+    unsigned char type[4] = {index >> 24, index >> 16, index >> 8, index};
+    if (!findAtom(file, ilst.start, ilst.end, (char*) type, &item) ||
+        !findAtom(file, item.start, item.end, "data", &data))
+        return false;
+
+    //type indicator and locale precede the value
+    unsigned char* value = readAtom(file, data, &len);
+    bool found = value != NULL && len > 8 && parseISO6709((char*) value + 8, lat, lon);
+    free(value);
+    return found;
+}
+
+bool videoGetCoord(const char* path, double* lat, double* lon) {
+    FILE* file = ioFopen(path, "rb");
+    if (file == NULL) return false;
+
+    //only files that start with an ftyp atom
+    unsigned char header[8];
+    Atom moov, udta, meta;
+    bool found = false;
+    off_t end;
+
+    if (fread(header, 1, 8, file) == 8 && memcmp(header + 4, "ftyp", 4) == 0 &&
+        fseeko(file, 0, SEEK_END) == 0 && (end = ftello(file)) > 0 &&
+        findAtom(file, 0, end, "moov", &moov)) {
+        if (findAtom(file, moov.start, moov.end, "udta", &udta))
+            found = readUdtaLocation(file, udta, lat, lon);
+        if (!found && findAtom(file, moov.start, moov.end, "meta", &meta))
+            found = readMetaLocation(file, meta, lat, lon);
+        if (!found && findAtom(file, moov.start, moov.end, "udta", &udta) &&
+            findAtom(file, udta.start, udta.end, "meta", &meta))
+            found = readMetaLocation(file, meta, lat, lon);
+    }
+
+    fclose(file);
+    return found;
+}
@@ -0,0 +1,27 @@
+/* File: video.h
+ * -------------
+ * Reads the recording location of MP4 and
+ * QuickTime videos from their metadata atoms:
+ * the ISO 6709 string in moov/udta/©xyz, as
+ * written by Android, or the location key of
+ * moov/meta, as written by Apple devices. Only
+ * atom headers and the few metadata atoms are
+ * read, wherever moov sits in the file.
+ */
+
+#ifndef _VIDEO_H_
+#define _VIDEO_H_
+
+#include <stdbool.h>
+
+/* Function: videoGetCoord
+ * -----------------------
+ * Reads the location of the video at path
+ * into lat and lon as decimal degrees.
+ * Returns false if the file is not an MP4
+ * or QuickTime file or has no location.
+ */
+
+bool videoGetCoord(const char* path, double* lat, double* lon);
+
+#endif
@@ -0,0 +1,154 @@
+/* File: xmp.c
+ * -----------
+ * Implements the XMP scanner declared in
+ * xmp.h. Property names are found with a
+ * substring search that tests sixteen
+ * positions at a time where SSE2 exists,
+ * and values are parsed in place.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "xmp.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* Function: findText
+ * ------------------
+ * Returns the first occurrence of needle in
+ * the len bytes at text, or NULL. With SSE2,
+ * a block of sixteen candidate positions is
+ * kept only where both the first and the last
+ * byte of needle match, and only those are
+ * compared in full.
+ */
+
+static const char* findText(const char* text, size_t len,
+    const char* needle, size_t needleLen) {
+    size_t i = 0;
+    if (needleLen == 0 || needleLen > len) return NULL;
+
+#ifdef __SSE2__
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[needleLen - 1]);
+
+    for (; i + 16 + needleLen - 1 <= len; i += 16) {
+        __m128i blockFirst = _mm_loadu_si128((const __m128i*) (text + i));
+        __m128i blockLast = _mm_loadu_si128((const __m128i*) (text + i + needleLen - 1));
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(
+            _mm_cmpeq_epi8(first, blockFirst), _mm_cmpeq_epi8(last, blockLast)));
+
+        while (mask != 0) {
+            int bit = __builtin_ctz(mask);
+            if (memcmp(text + i + bit, needle, needleLen) == 0) return text + i + bit;
+            mask &= mask - 1;
+        }
+    }
+#endif
+
+    //remaining positions, or all of them without SSE2
+    for (; i + needleLen <= len; i++)
+        if (text[i] == needle[0] && memcmp(text + i, needle, needleLen) == 0)
+            return text + i;
+    return NULL;
+}
+
+/* Function: parseDegrees
+ * ----------------------
+ * Converts an XMP GPS coordinate between start
+ * and end, either "DDD,MM,SSk" or "DDD,MM.mmk"
+ * with k one of NSEW, or plain signed decimal
+ * degrees. Returns false if it is malformed.
+ */
+
+static bool parseDegrees(const char* start, const char* end, double* degrees) {
+    char value[64];
+    size_t len = end - start;
+    if (len == 0 || len >= sizeof(value)) return false;
+    memcpy(value, start, len);
+    value[len] = '\0';
+
+    //up to three comma separated parts
+    double parts[3] = {0, 0, 0};
+    char* p = value;
+    int count = 0;
+    while (count < 3) {
+        char* next;
+        parts[count++] = strtod(p, &next);
+        if (next == p) return false;
+        p = next;
+        if (*p != ',') break;
+        p++;
+    }
+
+    double sign = 1;
+    while (*p == ' ') p++;
+    if (*p == 'S' || *p == 'W' || *p == 's' || *p == 'w') sign = -1;
+    else if (*p != 'N' && *p != 'E' && *p != 'n' && *p != 'e' && *p != '\0')
+        return false;
+
+    *degrees = sign * (parts[0] + parts[1] / 60.0 + parts[2] / 3600.0);
+    return true;
+}
+
+/* Function: isOpeningTag
+ * ----------------------
+ * Checks whether the name at the given position
+ * is the name of an opening element tag, that
+ * is, preceded by '<' and an optional prefix.
+ */
+
+static bool isOpeningTag(const char* packet, const char* name) {
+    const char* p = name;
+    while (p > packet && p[-1] != '<' && p[-1] != '>' &&
+        p[-1] != ' ' && p[-1] != '\n' && p[-1] != '\t') p--;
+    return p > packet && p[-1] == '<' && *p != '/';
+}
+
+/* Function: findProperty
+ * ----------------------
+ * Finds the value of the property with the given
+ * name, written either as name="value" or as
+ * <prefix:name>value</prefix:name>, and converts
+ * it with parseDegrees. Other occurrences of the
+ * name, such as GPSLatitudeRef, are skipped.
+ */
+
+static bool findProperty(const char* packet, size_t len,
+    const char* name, double* degrees) {
+    const char* end = packet + len;
+    const char* p = packet;
+    size_t nameLen = strlen(name);
+
+    while ((p = findText(p, end - p, name, nameLen)) != NULL) {
+        const char* q = p + nameLen;
+        p += nameLen;
+        while (q < end && (*q == ' ' || *q == '\t' || *q == '\r' || *q == '\n')) q++;
+        if (q == end) return false;
+
+        const char* valueStart;
+        const char* valueEnd;
+        if (*q == '=') {
+            q++;
+            while (q < end && (*q == ' ' || *q == '\t')) q++;
+            if (q == end || (*q != '"' && *q != '\'')) continue;
+            valueStart = q + 1;
+            valueEnd = memchr(valueStart, *q, end - valueStart);
+        } else if (*q == '>' && isOpeningTag(packet, p - nameLen)) {
+            valueStart = q + 1;
+            valueEnd = memchr(valueStart, '<', end - valueStart);
+        } else continue;
+
+        if (valueEnd != NULL && parseDegrees(valueStart, valueEnd, degrees))
+            return true;
+    }
+
+    return false;
+}
+
+bool xmpGetCoord(const char* packet, size_t len, double* lat, double* lon) {
+    return findProperty(packet, len, "GPSLatitude", lat) &&
+        findProperty(packet, len, "GPSLongitude", lon);
+}
@@ -0,0 +1,27 @@
+/* File: xmp.h
+ * -----------
+ * Reads GPS positions out of XMP packets, as
+ * written by editors that leave the EXIF GPS
+ * tags alone. Packets are scanned for the few
+ * properties needed rather than parsed as XML,
+ * which keeps the cost close to an IFD lookup.
+ */
+
+#ifndef _XMP_H_
+#define _XMP_H_
+
+#include <stddef.h>
+#include <stdbool.h>
+
+/* Function: xmpGetCoord
+ * ---------------------
+ * Looks up exif:GPSLatitude and exif:GPSLongitude
+ * in the len bytes of packet, in attribute or
+ * element form, and converts them to signed
+ * decimal degrees. Returns false unless both
+ * are present and well formed.
+ */
+
+bool xmpGetCoord(const char* packet, size_t len, double* lat, double* lon);
+
+#endif